@@ -0,0 +1,389 @@
+/*
+ * BenchTienda.c
+ * Compilar: gcc -std=gnu11 -Wall -Wextra -pedantic -O2 BenchTienda.c -o BenchTienda -lpthread
+ *
+ * Generador de carga para comparar los modos de E/S del servidor. Cada
+ * conexión es un hilo que manda el mismo comando corto y espera la
+ * respuesta antes de mandar el siguiente (una petición en vuelo por
+ * conexión, como el cliente GTK).
+ *
+ * Comparación epoll vs io_uring:
+ *   ./ServidorTienda --modo epoll --trabajadores 0 &
+ *   ./BenchTienda 127.0.0.1 -c 64 -n 200000
+ *   ./ServidorTienda --modo uring --trabajadores 0 &
+ *   ./BenchTienda 127.0.0.1 -c 64 -n 200000
+ *
+ * Con -P N la conexión negocia PROTO:LINEAS y manda los comandos en
+ * ráfagas de N (pipelining); la latencia de cada petición se mide desde
+ * que salió su ráfaga:
+ *   ./BenchTienda 127.0.0.1 -c 8 -n 200000 -P 32
+ *
+ * Con -V modelo[,modelo...] cada conexión es un comprador: inicia sesión
+ * (-u usuario|clave), arma el carrito y manda CHECKOUT hasta agotar sus
+ * intentos o las existencias. Con -E se comprueba que no se vendió más de
+ * lo que había (ni menos, si hubo compradores de sobra); con el CSV del
+ * servidor en "...;images/S24.jpg;500":
+ *   ./BenchTienda 127.0.0.1 -c 1000 -n 1000 -V "Galaxy S24" -E 500
+ *
+ * Reporta peticiones por segundo y latencias p50/p99/máx.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdbool.h>
+
+#define SERVER_PORT 5000
+#define BUFFER_SIZE 8192
+
+typedef struct {
+    struct sockaddr_in addr;
+    const char *comando;
+    int profundidad;        /* 0: protocolo heredado, una petición en vuelo */
+    long peticiones;
+    double *latencias;      /* microsegundos, una por petición */
+    long hechas;
+    bool error;
+    const char *usuario;        /* modo compra: "usuario|clave" */
+    const char *modelos;        /* modo compra: separados por ',' */
+    long vendidas, agotadas;
+} Trabajo;
+
+static double ahora_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Las respuestas del protocolo siempre terminan en '\n' */
+static bool leer_respuesta(int sock, char *buf, size_t cap) {
+    size_t len = 0;
+    while (len < cap) {
+        ssize_t n = recv(sock, buf + len, cap - len, 0);
+        if (n <= 0) return false;
+        len += (size_t)n;
+        if (buf[len - 1] == '\n') return true;
+    }
+    return true;
+}
+
+/* Lectura con sobrante: lo que llegó de más queda para el siguiente marco */
+typedef struct {
+    char buf[BUFFER_SIZE];
+    size_t ini, fin;
+} Entrada;
+
+static bool rellenar(int sock, Entrada *e) {
+    if (e->ini < e->fin) return true;
+    ssize_t n = recv(sock, e->buf, sizeof(e->buf), 0);
+    if (n <= 0) return false;
+    e->ini = 0;
+    e->fin = (size_t)n;
+    return true;
+}
+
+/* Lee "<bytes>\n" del encabezado de un trozo */
+static bool leer_tamano(int sock, Entrada *e, size_t *len) {
+    *len = 0;
+    for (;;) {
+        if (!rellenar(sock, e)) return false;
+        char ch = e->buf[e->ini++];
+        if (ch == '\n') return true;
+        if (ch < '0' || ch > '9') return false;
+        *len = *len * 10 + (size_t)(ch - '0');
+    }
+}
+
+/* Consume una respuesta por trozos "<bytes>\n<datos>" terminada en "0\n" */
+static bool leer_marco(int sock, Entrada *e) {
+    size_t len;
+    while (leer_tamano(sock, e, &len)) {
+        if (len == 0) return true;
+        while (len > 0) {
+            if (!rellenar(sock, e)) return false;
+            size_t k = e->fin - e->ini;
+            if (k > len) k = len;
+            e->ini += k;
+            len -= k;
+        }
+    }
+    return false;
+}
+
+static void correr_lineas(Trabajo *t, int sock) {
+    static const char proto[] = "PROTO:LINEAS\n";
+    char buf[BUFFER_SIZE];
+    if (send(sock, proto, sizeof(proto) - 1, MSG_NOSIGNAL) != (ssize_t)(sizeof(proto) - 1)
+        || recv(sock, buf, 3, MSG_WAITALL) != 3 || memcmp(buf, "OK\n", 3) != 0) {
+        fprintf(stderr, "El servidor no acepta PROTO:LINEAS\n");
+        t->error = true;
+        return;
+    }
+    size_t cmd_len = strlen(t->comando);
+    size_t rafaga_cap = (cmd_len + 1) * (size_t)t->profundidad;
+    char *rafaga = malloc(rafaga_cap);
+    Entrada *e = calloc(1, sizeof(*e));
+    if (!rafaga || !e) {
+        t->error = true;
+        free(rafaga);
+        free(e);
+        return;
+    }
+    for (int i = 0; i < t->profundidad; ++i) {
+        memcpy(rafaga + i * (cmd_len + 1), t->comando, cmd_len);
+        rafaga[i * (cmd_len + 1) + cmd_len] = '\n';
+    }
+    while (t->hechas < t->peticiones) {
+        long n = t->peticiones - t->hechas;
+        if (n > t->profundidad) n = t->profundidad;
+        size_t bytes = (size_t)n * (cmd_len + 1);
+        double t0 = ahora_us();
+        if (send(sock, rafaga, bytes, MSG_NOSIGNAL) != (ssize_t)bytes) {
+            t->error = true;
+            break;
+        }
+        for (long i = 0; i < n; ++i) {
+            if (!leer_marco(sock, e)) {
+                t->error = true;
+                goto fin;
+            }
+            t->latencias[t->hechas++] = ahora_us() - t0;
+        }
+    }
+fin:
+    free(rafaga);
+    free(e);
+}
+
+/* Manda un comando del protocolo heredado y deja la respuesta en buf */
+static bool pedir(int sock, const char *comando, char *buf, size_t cap) {
+    size_t len = strlen(comando);
+    if (send(sock, comando, len, MSG_NOSIGNAL) != (ssize_t)len || !leer_respuesta(sock, buf, cap - 1)) return false;
+    buf[cap - 1] = '\0';
+    return true;
+}
+
+/* Modo compra: cada petición es un carrito completo más su CHECKOUT */
+static void correr_compras(Trabajo *t, int sock) {
+    char buf[BUFFER_SIZE], cmd[512];
+    memset(buf, 0, sizeof(buf));
+    snprintf(cmd, sizeof(cmd), "LOGIN:%s", t->usuario);
+    if (!pedir(sock, cmd, buf, sizeof(buf)) || strncmp(buf, "OK|", 3) != 0) {
+        fprintf(stderr, "LOGIN rechazado: %s\n", t->usuario);
+        t->error = true;
+        return;
+    }
+    while (t->hechas < t->peticiones) {
+        double t0 = ahora_us();
+        bool agotado = false;
+        for (const char *m = t->modelos; *m && !agotado;) {
+            size_t n = strcspn(m, ",");
+            snprintf(cmd, sizeof(cmd), "ADD_TO_CART:%.*s", (int)n, m);
+            memset(buf, 0, sizeof(buf));
+            if (!pedir(sock, cmd, buf, sizeof(buf))) {
+                t->error = true;
+                return;
+            }
+            if (strstr(buf, "Sin existencias")) agotado = true;
+            else if (strncmp(buf, "OK", 2) != 0) {
+                fprintf(stderr, "ADD_TO_CART: %s", buf);
+                t->error = true;
+                return;
+            }
+            m += n;
+            if (*m == ',') m++;
+        }
+        if (!agotado) {
+            /* REINTENTAR: el inventario se recargó justo entonces; el carrito sigue */
+            do {
+                memset(buf, 0, sizeof(buf));
+                if (!pedir(sock, "CHECKOUT:TDC", buf, sizeof(buf))) {
+                    t->error = true;
+                    return;
+                }
+            } while (strncmp(buf, "ERROR:REINTENTAR", 16) == 0);
+            if (strncmp(buf, "OK|", 3) == 0) t->vendidas++;
+            else if (strncmp(buf, "ERROR:SIN_EXISTENCIAS", 21) == 0) agotado = true;
+            else {
+                fprintf(stderr, "CHECKOUT: %s", buf);
+                t->error = true;
+                return;
+            }
+        }
+        t->latencias[t->hechas++] = ahora_us() - t0;
+        if (agotado) {
+            /* lo que quedó en el carrito ya no se puede comprar */
+            t->agotadas++;
+            return;
+        }
+    }
+}
+
+static void *correr_conexion(void *arg) {
+    Trabajo *t = arg;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&t->addr, sizeof(t->addr)) < 0) {
+        perror("connect");
+        t->error = true;
+        if (sock >= 0) close(sock);
+        return NULL;
+    }
+    int uno = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &uno, sizeof(uno));
+    if (t->modelos) {
+        correr_compras(t, sock);
+        close(sock);
+        return NULL;
+    }
+    if (t->profundidad > 0) {
+        correr_lineas(t, sock);
+        close(sock);
+        return NULL;
+    }
+    char buf[BUFFER_SIZE];
+    size_t cmd_len = strlen(t->comando);
+    for (long i = 0; i < t->peticiones; ++i) {
+        double t0 = ahora_us();
+        if (send(sock, t->comando, cmd_len, MSG_NOSIGNAL) != (ssize_t)cmd_len
+            || !leer_respuesta(sock, buf, sizeof(buf))) {
+            t->error = true;
+            break;
+        }
+        t->latencias[t->hechas++] = ahora_us() - t0;
+    }
+    close(sock);
+    return NULL;
+}
+
+static int comparar_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void uso(const char *prog) {
+    fprintf(stderr, "Uso: %s <IP_del_servidor> [-p puerto] [-c conexiones] [-n peticiones] [-m comando]\n"
+                    "       [-P profundidad] [-V modelo[,modelo...]] [-E existencias] [-u usuario|clave]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        uso(argv[0]);
+        return 1;
+    }
+    const char *ip = argv[1];
+    int puerto = SERVER_PORT;
+    int conexiones = 32;
+    long total = 100000;
+    const char *comando = "GET_BRANDS";
+    int profundidad = 0;
+    const char *modelos = NULL;
+    const char *usuario = "admin|admin123";
+    long existencias = -1;
+    for (int i = 2; i < argc; ++i) {
+        if (i + 1 >= argc) {
+            uso(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-p") == 0) puerto = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0) conexiones = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0) total = atol(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0) comando = argv[++i];
+        else if (strcmp(argv[i], "-P") == 0) profundidad = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-V") == 0) modelos = argv[++i];
+        else if (strcmp(argv[i], "-E") == 0) existencias = atol(argv[++i]);
+        else if (strcmp(argv[i], "-u") == 0) usuario = argv[++i];
+        else {
+            uso(argv[0]);
+            return 1;
+        }
+    }
+    if (conexiones < 1 || total < conexiones || profundidad < 0) {
+        uso(argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)puerto);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+        fprintf(stderr, "IP inválida: %s\n", ip);
+        return 1;
+    }
+
+    Trabajo *trabajos = calloc((size_t)conexiones, sizeof(*trabajos));
+    pthread_t *hilos = calloc((size_t)conexiones, sizeof(*hilos));
+    if (!trabajos || !hilos) {
+        perror("calloc");
+        return 1;
+    }
+    long por_conexion = total / conexiones;
+    for (int i = 0; i < conexiones; ++i) {
+        trabajos[i].addr = addr;
+        trabajos[i].comando = comando;
+        trabajos[i].profundidad = profundidad;
+        trabajos[i].peticiones = por_conexion;
+        trabajos[i].usuario = usuario;
+        trabajos[i].modelos = modelos;
+        trabajos[i].latencias = malloc((size_t)por_conexion * sizeof(double));
+        if (!trabajos[i].latencias) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    double t0 = ahora_us();
+    for (int i = 0; i < conexiones; ++i) pthread_create(&hilos[i], NULL, correr_conexion, &trabajos[i]);
+    for (int i = 0; i < conexiones; ++i) pthread_join(hilos[i], NULL);
+    double segundos = (ahora_us() - t0) / 1e6;
+
+    long hechas = 0, vendidas = 0, agotadas = 0;
+    int fallidas = 0;
+    for (int i = 0; i < conexiones; ++i) {
+        hechas += trabajos[i].hechas;
+        vendidas += trabajos[i].vendidas;
+        agotadas += trabajos[i].agotadas;
+        if (trabajos[i].error) fallidas++;
+    }
+    double *todas = malloc((size_t)(hechas ? hechas : 1) * sizeof(double));
+    long k = 0;
+    for (int i = 0; i < conexiones; ++i) {
+        memcpy(todas + k, trabajos[i].latencias, (size_t)trabajos[i].hechas * sizeof(double));
+        k += trabajos[i].hechas;
+        free(trabajos[i].latencias);
+    }
+    qsort(todas, (size_t)hechas, sizeof(double), comparar_double);
+
+    if (modelos) printf("Compras: %s\n", modelos);
+    else printf("Comando: %s%s\n", comando, profundidad ? " (PROTO:LINEAS)" : "");
+    if (profundidad) printf("Profundidad de pipelining: %d\n", profundidad);
+    printf("Conexiones: %d (%d con error)\n", conexiones, fallidas);
+    printf("Peticiones: %ld en %.2f s -> %.0f pet/s\n", hechas, segundos, segundos > 0 ? hechas / segundos : 0.0);
+    if (hechas > 0) {
+        printf("Latencia us: p50=%.1f p99=%.1f max=%.1f\n",
+               todas[hechas / 2], todas[(long)(hechas * 0.99)], todas[hechas - 1]);
+    }
+    bool sobreventa = false;
+    if (modelos) {
+        printf("Vendidas: %ld, compradores sin existencias: %d\n", vendidas, (int)agotadas);
+        if (existencias >= 0) {
+            /* cada compra lleva una unidad por modelo: no puede pasar de las existencias */
+            long intentos = por_conexion * conexiones;
+            long esperadas = existencias < intentos ? existencias : intentos;
+            sobreventa = vendidas > existencias;
+            bool exacto = vendidas == esperadas || fallidas > 0;
+            printf("Existencias: %ld -> %s\n", existencias,
+                   sobreventa ? "SOBREVENTA" : exacto ? "sin sobreventa" : "se vendió de menos");
+            sobreventa = sobreventa || !exacto;
+        }
+    }
+    free(todas);
+    free(trabajos);
+    free(hilos);
+    return sobreventa ? 3 : fallidas ? 2 : 0;
+}
@@ -11,6 +11,9 @@
  * - Folio OXXO + botón "Copiar".
  * - Guardar ticket a CSV/TXT.
  * - CSS tipo tienda en línea (style.css).
+ * - Negocia PROTO:LINEAS: comandos terminados en '\n' y respuestas por
+ *   trozos con fin explícito, sin el límite de un solo recv() de 8 KB.
+ * - Imágenes pedidas al servidor con GET_IMAGE (copia local como respaldo).
  */
 
 #include <gtk/gtk.h>
@@ -52,6 +55,15 @@ static char *g_last_ticket_raw = NULL;
 static char *g_current_user = NULL;
 static char *g_user_role = NULL;
 
+/* Protocolo por líneas (si el servidor lo acepta) */
+static gboolean g_lineas = FALSE;
+static char g_rx[BUFFER_SIZE];          /* bytes recibidos aún sin consumir */
+static size_t g_rx_ini = 0, g_rx_fin = 0;
+static char *g_resp = NULL;             /* última respuesta enmarcada */
+static size_t g_resp_len = 0;
+static size_t g_resp_cap = 0;
+static GHashTable *g_image_cache = NULL; /* ruta -> GdkPixbuf descargado */
+
 typedef struct {
     GtkWidget *filter_modelo;
     GtkWidget *filter_marca;
@@ -96,10 +108,81 @@ static void show_net_error_and_keep_ui(const char* msg) {
     gtk_widget_destroy(dialog);
 }
 
+static void report_recv_error(ssize_t n) {
+    if (n == 0)
+        show_net_error_and_keep_ui("El servidor cerró la conexión.");
+    else {
+        perror("recv");
+        show_net_error_and_keep_ui("Error al recibir respuesta del servidor.");
+    }
+}
+
+static gboolean rx_fill(void) {
+    if (g_rx_ini < g_rx_fin) return TRUE;
+    ssize_t n = recv(server_socket, g_rx, sizeof(g_rx), 0);
+    if (n <= 0) {
+        report_recv_error(n);
+        return FALSE;
+    }
+    g_rx_ini = 0;
+    g_rx_fin = (size_t)n;
+    return TRUE;
+}
+
+/* Lee el encabezado "<bytes>\n" de un trozo */
+static gboolean recv_chunk_size(size_t *len) {
+    *len = 0;
+    for (;;) {
+        if (!rx_fill()) return FALSE;
+        char ch = g_rx[g_rx_ini++];
+        if (ch == '\n') return TRUE;
+        if (!isdigit((unsigned char)ch)) {
+            show_net_error_and_keep_ui("Respuesta inválida del servidor.");
+            return FALSE;
+        }
+        *len = *len * 10 + (size_t)(ch - '0');
+    }
+}
+
+/* Junta los trozos "<bytes>\n<datos>" hasta el "0\n" final */
+static char* recv_framed(void) {
+    size_t total = 0, len;
+    for (;;) {
+        if (!recv_chunk_size(&len)) return NULL;
+        if (total + len + 1 > g_resp_cap) {
+            g_resp_cap = MAX(g_resp_cap * 2, total + len + 1);
+            g_resp = g_realloc(g_resp, g_resp_cap);
+        }
+        if (len == 0) break;
+        while (len > 0) {
+            if (!rx_fill()) return NULL;
+            size_t k = MIN(g_rx_fin - g_rx_ini, len);
+            memcpy(g_resp + total, g_rx + g_rx_ini, k);
+            g_rx_ini += k;
+            total += k;
+            len -= k;
+        }
+    }
+    g_resp[total] = '\0';
+    g_resp_len = total;
+    return g_resp;
+}
+
 static char* send_command(const char* command) {
     static char response_buffer[BUFFER_SIZE];
     memset(response_buffer, 0, sizeof(response_buffer));
     if (server_socket < 0) return NULL;
+    if (g_lineas) {
+        char *line = g_strdup_printf("%s\n", command);
+        ssize_t sent = send(server_socket, line, strlen(line), 0);
+        g_free(line);
+        if (sent < 0) {
+            perror("send");
+            show_net_error_and_keep_ui("Error al enviar comando al servidor.");
+            return NULL;
+        }
+        return recv_framed();
+    }
     if (send(server_socket, command, strlen(command), 0) < 0) {
         perror("send");
         show_net_error_and_keep_ui("Error al enviar comando al servidor.");
@@ -107,22 +190,61 @@ static char* send_command(const char* command) {
     }
     int bytes_received = recv(server_socket, response_buffer, sizeof(response_buffer) - 1, 0);
     if (bytes_received <= 0) {
-        if (bytes_received == 0)
-            show_net_error_and_keep_ui("El servidor cerró la conexión.");
-        else {
-            perror("recv");
-            show_net_error_and_keep_ui("Error al recibir respuesta del servidor.");
-        }
+        report_recv_error(bytes_received);
         return NULL;
     }
     response_buffer[bytes_received] = '\0';
     return response_buffer;
 }
 
-static GdkPixbuf *scale_pixbuf(const char *filename, int w, int h) {
+/* Servidores anteriores responden COMANDO_NO_VALIDO: se sigue con un recv() por respuesta */
+static void negotiate_lines_protocol(void) {
+    static const char proto[] = "PROTO:LINEAS\n";
+    char reply[64];
+    if (send(server_socket, proto, sizeof(proto) - 1, 0) < 0) return;
+    ssize_t n = recv(server_socket, reply, sizeof(reply) - 1, 0);
+    if (n <= 0) return;
+    reply[n] = '\0';
+    g_lineas = strcmp(reply, "OK\n") == 0;
+}
+
+/* Descarga la imagen por la conexión abierta; NULL si no está disponible */
+static GdkPixbuf *fetch_image(const char *path) {
+    if (!g_lineas) return NULL;
+    if (!g_image_cache)
+        g_image_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+    GdkPixbuf *cached = g_hash_table_lookup(g_image_cache, path);
+    if (cached) return g_object_ref(cached);
+
+    char *command = g_strdup_printf("GET_IMAGE:%s", path);
+    char *resp = send_command(command);
+    g_free(command);
+    if (!resp || strncmp(resp, "OK|", 3) != 0) return NULL;
+    /* OK|bytes|mtime\n seguido del archivo */
+    char *body = memchr(resp, '\n', g_resp_len);
+    if (!body) return NULL;
+    body++;
+    size_t size = strtoul(resp + 3, NULL, 10);
+    if (size != g_resp_len - (size_t)(body - resp)) return NULL;
+
     GdkPixbuf *pixbuf = NULL;
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+    gboolean ok = gdk_pixbuf_loader_write(loader, (const guchar *)body, size, NULL);
+    if (gdk_pixbuf_loader_close(loader, NULL) && ok) {
+        pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+        if (pixbuf) {
+            g_object_ref(pixbuf);
+            g_hash_table_insert(g_image_cache, g_strdup(path), g_object_ref(pixbuf));
+        }
+    }
+    g_object_unref(loader);
+    return pixbuf;
+}
+
+static GdkPixbuf *scale_pixbuf(const char *filename, int w, int h) {
+    GdkPixbuf *pixbuf = fetch_image(filename);
     GError *error = NULL;
-    pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+    if (!pixbuf) pixbuf = gdk_pixbuf_new_from_file(filename, &error);
     if (error != NULL) {
         g_clear_error(&error);
         pixbuf = gdk_pixbuf_new_from_file("images/placeholder.png", &error);
@@ -196,6 +318,7 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     printf("Conectado al servidor %s\n", server_ip);
+    negotiate_lines_protocol();
 
     gtk_init(&argc, &argv);
     load_css();
@@ -1,14 +1,94 @@
 /*
  * ServidorTienda.c
- * Compilar: gcc -std=gnu11 -Wall -Wextra -pedantic ServidorTienda.c -o ServidorTienda -lpthread
+ * Compilar: gcc -std=gnu11 -Wall -Wextra -pedantic ServidorTienda.c -o ServidorTienda -lpthread -lcrypt
+ * Ejecutar: ./ServidorTienda [--modo hilos|epoll|uring] [--trabajadores N]
+ *                           [--shards N] [--fijar-cpu]
+ *                           [--durabilidad estricta|diferida] [--espera-lote US]
+ *                           [--hilos-auth N] [--cola-auth N] [--max-conexiones N]
+ *                           [--conexiones-ip TASA[:RAFAGA]] [--comandos-ip TASA[:RAFAGA]]
+ *           ./ServidorTienda --medir-escaneo [FILAS]   (recorridos SIMD vs escalar)
  *
  * Correcciones:
  * - Uso de strdup (no g_strdup) para evitar dependencia a GLib.
  * - Trim seguro en el mismo buffer.
  * - Eliminación de separadores de miles (comas) en precio.
  * - GET_BRANDS devuelve marcas únicas y sin '|' final.
+ * - Modo epoll (edge-triggered) con estado por conexión, alternativo al
+ *   modelo de un hilo por cliente.
+ * - Pool de trabajadores (uno por CPU) con robo de tareas para ejecutar los
+ *   comandos leídos por el bucle epoll.
+ * - Modo io_uring opcional (recae en epoll si el kernel no lo soporta).
+ * - Shards: N acceptors con SO_REUSEPORT, cada uno con su bucle; STATS
+ *   (admin) muestra las conexiones por shard.
+ * - PROTO:LINEAS: comandos terminados en '\n' (pueden llegar partidos o
+ *   varios juntos) y respuestas por trozos "<bytes>\n<datos>" con fin "0\n".
+ * - Respuestas sin límite de 8 KB: se arman en bloques encadenados (tiempo
+ *   lineal, sin strcat) y salen con writev() sin copiarse.
+ * - GET_IMAGE:<ruta|modelo> sirve images/ con sendfile() ("OK|bytes|mtime\n"
+ *   y el archivo), con caché de descriptores y sin salir del directorio.
+ * - GET_BRANDS y GET_MODELS responden desde una caché ya serializada que
+ *   se reconstruye con cada cambio al inventario (contador de generación).
+ * - Inventario por versiones inmutables (puntero atómico + reclamación por
+ *   épocas): los lectores no toman locks mientras un admin elimina modelos.
+ * - Índices hash (direccionamiento abierto) por modelo, marca y usuario:
+ *   ADD_TO_CART, GET_MODELS y LOGIN ya no recorren las tablas; la tabla de
+ *   usuarios crece sin tope fijo.
+ * - Almacén de productos sin tope (antes 100): las cadenas van en una arena
+ *   por bloques y cada marca se guarda una sola vez; se libera de una vez.
+ * - Carga de CSV con mmap: los separadores se ubican con SIMD (SSE2; AVX2
+ *   con -mavx2), los archivos grandes se analizan por trozos en paralelo y
+ *   se reporta la velocidad en filas/s.
+ * - Snapshot binario por columnas (Tienda.snap, versionado y con CRC32C):
+ *   al arrancar se mapea y se usa directo; los CSV solo se vuelven a leer
+ *   si cambiaron después de escribirlo.
+ * - REMOVE_PRODUCT y REGISTER ya no reescriben los CSV: agregan un registro
+ *   con CRC a Tienda.wal (fsync por lotes) y un checkpoint periódico los
+ *   pasa a los CSV con temporal + rename; al arrancar se reaplica el WAL.
+ * - Hilo escritor del WAL: los registros entran a una cola sin locks y se
+ *   escriben por lotes (un writev y un fsync por lote); cada cliente recibe
+ *   su OK cuando su lote está en disco. --espera-lote y --durabilidad
+ *   diferida cambian latencia por menos fsyncs o por durabilidad.
+ * - Recarga en caliente del CSV del inventario (inotify): se lee en segundo
+ *   plano en un almacén nuevo y se publica como una versión más, sin cortar
+ *   conexiones; los carritos se pasan al almacén nuevo por modelo.
+ * - Existencias por producto (6a columna opcional del CSV): CHECKOUT aparta
+ *   todo el carrito o nada con compare-and-swap por producto, sin lock
+ *   global, y registra la venta en el WAL; sin existencias responde
+ *   "ERROR:SIN_EXISTENCIAS|modelo".
+ * - Sesiones: LOGIN entrega además "SESION|token" y RESUME:<token>
+ *   recupera usuario y carrito en otra conexión o tras reiniciar (mapa
+ *   repartido en shards, escrito a Tienda.sesiones cada 30 s).
+ * - SEARCH:<consulta> sobre marca, modelo y specs con un índice invertido
+ *   (listas comprimidas con saltos, intersección desde la más corta y los
+ *   50 mejores por puntaje); las bajas se filtran con la versión vigente.
+ * - FILTER:ram>=12;storage=512;price<20000 (también brand= y chipset=):
+ *   chipset, RAM y almacenamiento se sacan de specs al cargar; cada valor
+ *   de faceta tiene un conjunto roaring y la respuesta trae el total, los
+ *   productos y "FACETA|faceta|valor|productos".
+ * - GET_MODELS:<marca>;sort=price|name;offset=N;limit=M (y cursor=): cada
+ *   marca guarda sus productos ordenados por precio y por nombre desde la
+ *   carga y cada versión los filtra por las bajas, así que una página
+ *   cuesta O(limit); sin ';' la respuesta es la de siempre.
+ * - Productos por columnas: la marca (número) y el precio van en arreglos
+ *   densos aparte de los textos y los activos de cada versión en un mapa de
+ *   bits; FILTER evalúa marca y rango de precio en un solo recorrido con
+ *   AVX2/SSE2 (escalar sin SIMD). --medir-escaneo compara ambos.
+ * - Libro de pedidos: cada CHECKOUT queda con usuario, productos, precios,
+ *   método de pago y fecha en particiones por hilo (sin locks al leer) y
+ *   en Tienda.pedidos; SALES_REPORT:<desde>:<hasta> (admin) suma ingresos
+ *   por marca, modelo y método recorriendo las particiones en paralelo.
+ * - Claves con hash yescrypt (libcrypt) en vez de texto plano; las filas
+ *   viejas siguen sirviendo y un hilo de prioridad baja las migra (WAL y
+ *   checkpoint). El hash corre en un pool aparte (--hilos-auth) con cola
+ *   acotada (--cola-auth, "ERROR|BUSY" si se llena); STATS muestra la
+ *   cola y el tiempo por verificación en "AUTH|...".
+ * - Control de admisión: tope de conexiones simultáneas (--max-conexiones,
+ *   4096 por omisión) y cubetas de fichas por IP para conexiones y para
+ *   comandos (GCRA, un compare-and-swap por ficha). Lo que se pasa recibe
+ *   "ERROR|BUSY" al momento; STATS lo cuenta en "ADMISION|...".
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,26 +98,112 @@
 #include <time.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <poll.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <semaphore.h>
+#include <crypt.h>
+#include <linux/io_uring.h>
 
 #define PORT 5000
 #define BUFFER_SIZE 8192
-#define MAX_PRODUCTOS 100
 #define MAX_CARRITO  128
-#define MAX_USUARIOS 128
 #define INVENTARIO_FILE "InvetarioCelulares.csv"
 #define USUARIOS_FILE   "Usuarios.csv"
+#define SNAPSHOT_FILE   "Tienda.snap"
+#define WAL_FILE        "Tienda.wal"
+#define SESIONES_FILE   "Tienda.sesiones"
+#define PEDIDOS_FILE    "Tienda.pedidos"
+#define PROTO_LINEAS    "PROTO:LINEAS"
+#define IMAGENES_DIR    "images"
 
+/*
+ * Textos de un producto. Lo que se compara al recorrer (marca y precio)
+ * va aparte en columnas del almacén (col_marca, col_precio), así que los
+ * recorridos no tocan estos punteros.
+ */
 typedef struct {
-    char* marca;
     char* modelo;
     char* specs;
-    double precio;
     char* imagen;
-    bool activo;
+    int mismo_modelo;           /* siguiente producto con el mismo modelo, o -1 */
 } Producto;
 
-static Producto inventario[MAX_PRODUCTOS];
-static int inventario_size = 0;
+/* ---------- Arena de cadenas ---------- */
+
+/*
+ * Bloques encadenados donde las cadenas se copian una tras otra; no se
+ * liberan por separado sino todas juntas con arena_liberar().
+ */
+#define ARENA_BLOQUE (64 * 1024)
+
+typedef struct BloqueArena {
+    struct BloqueArena *sig;
+    size_t usado;
+    size_t cap;
+    char datos[];
+} BloqueArena;
+
+typedef struct {
+    BloqueArena *actual;
+    size_t bloques;
+    size_t bytes;               /* reservados en bloques */
+} Arena;
+
+/* Copia 'n' bytes de 's' terminados en '\0'; NULL si no hay memoria */
+static char *arena_copiar(Arena *a, const char *s, size_t n) {
+    BloqueArena *b = a->actual;
+    if (!b || b->cap - b->usado < n + 1) {
+        /* una cadena más grande que el bloque se lleva uno a su medida */
+        size_t cap = n + 1 > ARENA_BLOQUE ? n + 1 : ARENA_BLOQUE;
+        b = malloc(sizeof(*b) + cap);
+        if (!b) return NULL;
+        b->usado = 0;
+        b->cap = cap;
+        b->sig = a->actual;
+        a->actual = b;
+        a->bloques++;
+        a->bytes += cap;
+    }
+    char *p = b->datos + b->usado;
+    memcpy(p, s, n);
+    p[n] = '\0';
+    b->usado += n + 1;
+    return p;
+}
+
+static void arena_liberar(Arena *a) {
+    for (BloqueArena *b = a->actual, *sig; b; b = sig) {
+        sig = b->sig;
+        free(b);
+    }
+    *a = (Arena){0};
+}
+
+/* Archivo mapeado en memoria de solo lectura */
+typedef struct {
+    const char *datos;
+    size_t tam;
+} MapaArchivo;
 
 typedef struct {
     char *username;
@@ -46,514 +212,6947 @@ typedef struct {
     bool is_admin;
 } Usuario;
 
-static Usuario usuarios[MAX_USUARIOS];
-static int usuarios_size = 0;
+static Usuario *usuarios;       /* crece con REGISTER, bajo datos_lock en exclusiva */
+static int usuarios_size = 0;
+static int usuarios_cap = 0;
+
+/* Usuarios: LOGIN en paralelo, REGISTER en exclusiva. El inventario no usa locks. */
+static pthread_rwlock_t datos_lock;
+
+/* ---------- Índices hash (direccionamiento abierto) ---------- */
+
+/*
+ * Tabla de ids con sondeo lineal. La clave no se copia: se obtiene del id
+ * con 'clave', así el mismo código indexa modelos, marcas y usuarios. Se
+ * guarda el hash de cada ranura para descartar colisiones sin strcmp. No
+ * hay borrado: los ids indexados nunca desaparecen del almacén.
+ */
+typedef const char *(*ClaveIndice)(const void *ctx, int id);
+
+typedef struct {
+    int *ids;                   /* -1: ranura vacía */
+    uint32_t *hashes;
+    size_t cap;                 /* potencia de dos */
+    size_t n;
+    ClaveIndice clave;
+    const void *ctx;            /* dueño de las claves, para 'clave' */
+} IndiceHash;
+
+static uint32_t hash_bytes(const char *s, size_t n) {
+    uint32_t h = 2166136261u;   /* FNV-1a */
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static bool indice_crecer(IndiceHash *ix, size_t cap) {
+    int *ids = malloc(cap * sizeof(*ids));
+    uint32_t *hashes = malloc(cap * sizeof(*hashes));
+    if (!ids || !hashes) {
+        free(ids);
+        free(hashes);
+        return false;
+    }
+    memset(ids, -1, cap * sizeof(*ids));
+    for (size_t i = 0; i < ix->cap; ++i) {
+        if (ix->ids[i] < 0) continue;
+        size_t j = ix->hashes[i] & (cap - 1);
+        while (ids[j] >= 0) j = (j + 1) & (cap - 1);
+        ids[j] = ix->ids[i];
+        hashes[j] = ix->hashes[i];
+    }
+    free(ix->ids);
+    free(ix->hashes);
+    ix->ids = ids;
+    ix->hashes = hashes;
+    ix->cap = cap;
+    return true;
+}
+
+/* Busca los 'n' bytes de 'clave' (sin '\0' propio); -1 si no está */
+static int indice_buscar_n(const IndiceHash *ix, const char *clave, size_t n) {
+    if (ix->n == 0) return -1;
+    uint32_t h = hash_bytes(clave, n);
+    for (size_t j = h & (ix->cap - 1); ix->ids[j] >= 0; j = (j + 1) & (ix->cap - 1)) {
+        if (ix->hashes[j] != h) continue;
+        const char *k = ix->clave(ix->ctx, ix->ids[j]);
+        if (strncmp(k, clave, n) == 0 && k[n] == '\0') return ix->ids[j];
+    }
+    return -1;
+}
+
+static int indice_buscar(const IndiceHash *ix, const char *clave) {
+    return indice_buscar_n(ix, clave, strlen(clave));
+}
+
+/* Espacio para una clave más; factor de carga máximo 0.7 */
+static bool indice_reservar(IndiceHash *ix) {
+    return (ix->n + 1) * 10 <= ix->cap * 7 || indice_crecer(ix, ix->cap ? ix->cap * 2 : 16);
+}
+
+/* El llamador se asegura de que la clave no esté ya */
+static bool indice_insertar(IndiceHash *ix, int id) {
+    if (!indice_reservar(ix)) return false;
+    const char *k = ix->clave(ix->ctx, id);
+    uint32_t h = hash_bytes(k, strlen(k));
+    size_t j = h & (ix->cap - 1);
+    while (ix->ids[j] >= 0) j = (j + 1) & (ix->cap - 1);
+    ix->ids[j] = id;
+    ix->hashes[j] = h;
+    ix->n++;
+    return true;
+}
+
+static void indice_liberar(IndiceHash *ix) {
+    free(ix->ids);
+    free(ix->hashes);
+    ix->ids = NULL;
+    ix->hashes = NULL;
+    ix->cap = ix->n = 0;
+}
+
+/* Órdenes de GET_MODELS con sort=; ORDEN_ARCHIVO es el del CSV */
+enum { ORDEN_ARCHIVO, ORDEN_PRECIO, ORDEN_NOMBRE, N_ORDENES };
+
+/* Productos de una marca, en el orden del almacén */
+typedef struct {
+    const char *nombre;
+    int *productos;
+    int n;
+    int cap;
+    int *orden[N_ORDENES];      /* permutaciones de 'productos'; [ORDEN_ARCHIVO] es el mismo */
+} Marca;
+
+/*
+ * Índice invertido para SEARCH: cada término (palabra de marca, modelo o
+ * specs en minúsculas) tiene su lista de productos en orden, comprimida
+ * como diferencias en varint más un byte de peso, con un salto cada
+ * SALTO_CADA entradas para poder avanzar sin decodificar todo.
+ */
+typedef struct {
+    int previo;                 /* último id antes del salto */
+    uint32_t pos;               /* byte donde sigue la lista */
+} SaltoLista;
+
+typedef struct {
+    uint32_t inicio, fin;       /* bytes en 'datos' */
+    int n;                      /* productos con el término */
+    int primer_salto;           /* en 'saltos'; hasta el del término siguiente */
+} Termino;
+
+typedef struct {
+    IndiceHash por_texto;       /* término -> posición en 'terminos' */
+    const char **textos;        /* en la arena del almacén */
+    Termino *terminos;
+    int n_terminos;
+    int cap_terminos;
+    uint8_t *datos;
+    size_t n_datos;
+    size_t cap_datos;
+    SaltoLista *saltos;
+    size_t n_saltos;
+    size_t cap_saltos;
+    bool listo;
+} IndiceBusqueda;
+
+/*
+ * Conjunto de ids al estilo roaring: los ids se agrupan en bloques de
+ * 65536 por sus 16 bits altos; un bloque con pocos ids guarda los bajos en
+ * un arreglo ordenado y uno con más de ROARING_ARREGLO_MAX usa un mapa de
+ * 65536 bits. Así las intersecciones cuestan según los ids, no el rango.
+ */
+typedef struct {
+    uint16_t alto;
+    bool es_mapa;
+    uint32_t n;                 /* ids en el bloque */
+    uint32_t cap;               /* del arreglo */
+    union {
+        uint16_t *arreglo;
+        uint64_t *mapa;
+    };
+} BloqueRoaring;
+
+typedef struct {
+    BloqueRoaring *b;           /* por 'alto' creciente */
+    int n;
+    int cap;
+} Roaring;
+
+/* Facetas de FILTER: columnas que se sacan de cada producto al cargar */
+enum { FACETA_MARCA, FACETA_CHIPSET, FACETA_RAM, FACETA_ALMACENAMIENTO, FACETA_PRECIO, N_FACETAS };
+
+typedef struct {
+    const char *texto;          /* como sale en FACETA|... (en la arena) */
+    double min, max;            /* de los productos con este valor; numéricas */
+    Roaring productos;
+} ValorFaceta;
+
+typedef struct {
+    ValorFaceta *valores;
+    int n;
+    int cap;
+    IndiceHash por_texto;       /* texto -> posición en 'valores' */
+    int *columna;               /* valor de cada producto, -1 si no se pudo sacar */
+} Faceta;
+
+typedef struct {
+    Faceta faceta[N_FACETAS];
+    Roaring todos;
+    bool listo;
+} Facetas;
+
+/*
+ * Almacén de productos: se arma al cargar (o recargar) el CSV y ya no
+ * cambia; qué productos siguen activos lo dice cada versión publicada del
+ * inventario. Lo comparten con contador de referencias las versiones que
+ * salieron de él y los carritos que guardan índices suyos.
+ */
+typedef struct {
+    Producto *productos;
+    uint32_t *col_marca;        /* número de marca de cada producto */
+    double *col_precio;         /* precio de cada producto */
+    int n;
+    int cap;
+    Marca *marcas;
+    int n_marcas;
+    int cap_marcas;
+    IndiceHash por_modelo;      /* primer producto con ese modelo */
+    IndiceHash por_marca;
+    atomic_int *existencias;    /* por producto; lo único que cambia tras armarlo */
+    IndiceBusqueda busqueda;    /* se arma con la primera versión (busqueda_construir) */
+    Facetas facetas;            /* igual (facetas_construir) */
+    bool derivados;             /* ya se armaron búsqueda, facetas y órdenes */
+    Arena arena;                /* cadenas de todos los productos */
+    MapaArchivo mapa;           /* snapshot del que salieron, si no hubo CSV */
+    atomic_int refs;
+} Almacen;
+
+static const char *clave_usuario(const void *ctx, int id) {
+    (void)ctx;
+    return usuarios[id].username;
+}
+
+static const char *clave_modelo(const void *ctx, int id) {
+    return ((const Almacen *)ctx)->productos[id].modelo;
+}
+
+static const char *clave_marca(const void *ctx, int id) {
+    return ((const Almacen *)ctx)->marcas[id].nombre;
+}
+
+static const char *producto_marca(const Almacen *a, int id) {
+    return a->marcas[a->col_marca[id]].nombre;
+}
+
+/* Mapas de bits de productos (activos, resultados de un recorrido): bit i = producto i */
+static size_t mapa_palabras(int n) {
+    return ((size_t)n + 63) / 64;
+}
+
+static bool mapa_bit(const uint64_t *mapa, int i) {
+    return mapa[i >> 6] >> (i & 63) & 1;
+}
+
+static const char *clave_termino(const void *ctx, int id) {
+    return ((const IndiceBusqueda *)ctx)->textos[id];
+}
+
+static const char *clave_valor_faceta(const void *ctx, int id) {
+    return ((const Faceta *)ctx)->valores[id].texto;
+}
+
+static IndiceHash indice_usuarios = { .clave = clave_usuario };
+
+#define SIN_LIMITE (-1)         /* existencias de un producto sin esa columna en el CSV */
+
+/* ---------- Lectura de CSV ---------- */
+
+/*
+ * Los archivos se mapean con mmap y se recorren en bloques de 64 bytes:
+ * una máscara de bits (SSE2, o AVX2 si se compila con -mavx2) marca cada
+ * ';', '\n' y '\r', y el recorrido salta de separador en separador sin
+ * mirar los bytes de en medio. Las celdas quedan como tramos dentro del
+ * mapeo y se copian una sola vez, a su destino final. Se conservan las
+ * reglas del lector anterior (fgets + strtok): lo que sigue a un '\r' se
+ * ignora hasta el fin de línea, varios ';' seguidos no dan celdas vacías,
+ * las celdas de más se ignoran y una línea con menos de las obligatorias
+ * se salta. Un archivo grande se parte en trozos, siempre tras un '\n',
+ * que se analizan en paralelo.
+ */
+#define CSV_MAX_CAMPOS 8
+#define CSV_MAX_HILOS  8
+#define CSV_TROZO_MIN  (1 << 20)    /* bytes mínimos por hilo */
+
+typedef struct {
+    const char *p;              /* NULL: la celda no vino */
+    size_t n;
+} Campo;
+
+typedef struct {
+    const char *ini, *fin;
+    int campos;                 /* celdas que se guardan por fila */
+    int minimo;                 /* celdas obligatorias */
+    int col_precio;             /* columna que además se convierte a número, o -1 */
+    bool recortar;              /* quitar espacios a cada celda */
+    Campo *celdas;              /* 'campos' por fila */
+    double *precios;
+    size_t filas, cap;
+    bool sin_memoria;
+} TrozoCsv;
+
+static bool archivo_mapear(const char *ruta, MapaArchivo *m) {
+    int fd = open(ruta, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    m->tam = (size_t)st.st_size;
+    m->datos = "";
+    if (m->tam > 0) {
+        void *p = mmap(NULL, m->tam, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(p, m->tam, MADV_SEQUENTIAL);
+        m->datos = p;
+    }
+    close(fd);
+    return true;
+}
+
+static void archivo_desmapear(MapaArchivo *m) {
+    if (m->tam > 0) munmap((void *)m->datos, m->tam);
+}
+
+static bool es_separador_csv(char ch) {
+    return ch == ';' || ch == '\n' || ch == '\r';
+}
+
+/* Bit i encendido si p[i] es separador, para los primeros 'n' (<= 64) bytes */
+static uint64_t csv_mascara_escalar(const char *p, size_t n) {
+    uint64_t m = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (es_separador_csv(p[i])) m |= (uint64_t)1 << i;
+    return m;
+}
+
+static uint64_t csv_mascara(const char *p) {
+#if defined(__AVX2__)
+    const __m256i pc = _mm256_set1_epi8(';'), nl = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+    uint64_t m = 0;
+    for (int i = 0; i < 2; ++i) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + 32 * i));
+        __m256i s = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, pc), _mm256_cmpeq_epi8(v, nl)),
+                                    _mm256_cmpeq_epi8(v, cr));
+        m |= (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << (32 * i);
+    }
+    return m;
+#elif defined(__SSE2__)
+    const __m128i pc = _mm_set1_epi8(';'), nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+    uint64_t m = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        __m128i s = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, pc), _mm_cmpeq_epi8(v, nl)),
+                                 _mm_cmpeq_epi8(v, cr));
+        m |= (uint64_t)(uint32_t)_mm_movemask_epi8(s) << (16 * i);
+    }
+    return m;
+#else
+    return csv_mascara_escalar(p, 64);
+#endif
+}
+
+/* Quita los espacios de los extremos (isspace, como el trim de antes) */
+static Campo campo_recortar(Campo c) {
+    while (c.n > 0 && isspace((unsigned char)c.p[0])) {
+        c.p++;
+        c.n--;
+    }
+    while (c.n > 0 && isspace((unsigned char)c.p[c.n - 1])) c.n--;
+    return c;
+}
+
+/* Existencias: sin la celda no hay límite; lo que no sea un número cuenta como 0 */
+static int campo_existencias(Campo c) {
+    if (!c.p) return SIN_LIMITE;
+    long v = 0;
+    for (size_t i = 0; i < c.n; ++i) {
+        if (c.p[i] < '0' || c.p[i] > '9') return 0;
+        if (v < INT_MAX) v = v * 10 + (c.p[i] - '0');
+    }
+    return v > INT_MAX ? INT_MAX : (int)v;
+}
+
+/* Precio sin separadores de miles: "12,999.00" -> 12999.0 */
+static double campo_precio(Campo c) {
+    char num[128];
+    size_t k = 0;
+    for (size_t i = 0; i < c.n && k < sizeof(num) - 1; ++i)
+        if (c.p[i] != ',') num[k++] = c.p[i];
+    num[k] = '\0';
+    return atof(num);
+}
+
+static void csv_fila(TrozoCsv *t, Campo *fila, int n) {
+    if (n < t->minimo || t->sin_memoria) return;
+    if (t->filas == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 1024;
+        Campo *celdas = realloc(t->celdas, cap * (size_t)t->campos * sizeof(*celdas));
+        if (celdas) t->celdas = celdas;
+        double *precios = t->col_precio < 0 ? NULL : realloc(t->precios, cap * sizeof(*precios));
+        if (precios) t->precios = precios;
+        if (!celdas || (t->col_precio >= 0 && !precios)) {
+            t->sin_memoria = true;
+            return;
+        }
+        t->cap = cap;
+    }
+    for (int k = n; k < t->campos; ++k) fila[k] = (Campo){ NULL, 0 };
+    if (t->recortar) {
+        for (int k = 0; k < n; ++k) fila[k] = campo_recortar(fila[k]);
+    }
+    if (t->col_precio >= 0) t->precios[t->filas] = campo_precio(fila[t->col_precio]);
+    memcpy(t->celdas + t->filas * (size_t)t->campos, fila, (size_t)t->campos * sizeof(*fila));
+    t->filas++;
+}
+
+static void *csv_analizar(void *arg) {
+    TrozoCsv *t = arg;
+    Campo fila[CSV_MAX_CAMPOS];
+    int n = 0;
+    const char *tok = t->ini;
+    bool ignorar = false;       /* tras un '\r', hasta el '\n' */
+    for (const char *blq = t->ini; blq < t->fin; blq += 64) {
+        size_t largo = (size_t)(t->fin - blq);
+        uint64_t m = largo >= 64 ? csv_mascara(blq) : csv_mascara_escalar(blq, largo);
+        while (m) {
+            const char *d = blq + __builtin_ctzll(m);
+            m &= m - 1;
+            if (!ignorar) {
+                /* strtok: las celdas vacías no cuentan */
+                if (d > tok && n < t->campos) fila[n++] = (Campo){ tok, (size_t)(d - tok) };
+                if (*d == '\r') ignorar = true;
+            }
+            if (*d == '\n') {
+                csv_fila(t, fila, n);
+                n = 0;
+                ignorar = false;
+            }
+            tok = d + 1;
+        }
+    }
+    /* última línea sin '\n' */
+    if (!ignorar && t->fin > tok && n < t->campos) fila[n++] = (Campo){ tok, (size_t)(t->fin - tok) };
+    csv_fila(t, fila, n);
+    return NULL;
+}
+
+/*
+ * Analiza el archivo mapeado con la configuración de 'base', en paralelo si
+ * es grande. Devuelve cuántos trozos quedaron en 't', en orden de archivo.
+ */
+static int csv_leer(const MapaArchivo *mapa, const TrozoCsv *base, TrozoCsv t[CSV_MAX_HILOS]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t hilos = mapa->tam / CSV_TROZO_MIN;
+    if (hilos > CSV_MAX_HILOS) hilos = CSV_MAX_HILOS;
+    if (cpus > 0 && hilos > (size_t)cpus) hilos = (size_t)cpus;
+    if (hilos < 1) hilos = 1;
+
+    const char *ini = mapa->datos, *fin = mapa->datos + mapa->tam;
+    int n = 0;
+    for (size_t k = 0; k < hilos; ++k) {
+        /* cada trozo termina justo después de un '\n' */
+        const char *corte = fin;
+        if (k + 1 < hilos) {
+            const char *meta = mapa->datos + mapa->tam / hilos * (k + 1);
+            if (meta < ini) meta = ini;
+            const char *nl = memchr(meta, '\n', (size_t)(fin - meta));
+            if (nl) corte = nl + 1;
+        }
+        t[n] = *base;
+        t[n].ini = ini;
+        t[n].fin = corte;
+        n++;
+        ini = corte;
+        if (ini == fin) break;
+    }
+
+    pthread_t tid[CSV_MAX_HILOS];
+    bool lanzado[CSV_MAX_HILOS] = { false };
+    for (int i = 1; i < n; ++i) lanzado[i] = pthread_create(&tid[i], NULL, csv_analizar, &t[i]) == 0;
+    csv_analizar(&t[0]);
+    for (int i = 1; i < n; ++i) {
+        if (lanzado[i]) pthread_join(tid[i], NULL);
+        else csv_analizar(&t[i]);
+    }
+    return n;
+}
+
+static void csv_liberar(TrozoCsv *t, int n) {
+    for (int i = 0; i < n; ++i) {
+        free(t[i].celdas);
+        free(t[i].precios);
+    }
+}
+
+static double segundos_desde(const struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (double)(t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static bool marca_agregar_producto(Marca *m, int id) {
+    if (m->n == m->cap) {
+        int cap = m->cap ? m->cap * 2 : 8;
+        int *p = realloc(m->productos, (size_t)cap * sizeof(*p));
+        if (!p) return false;
+        m->productos = p;
+        m->cap = cap;
+    }
+    m->productos[m->n++] = id;
+    return true;
+}
+
+/* Da número a una marca que aún no está; 'nombre' debe vivir tanto como el almacén */
+static int marca_registrar(Almacen *a, const char *nombre) {
+    if (a->n_marcas == a->cap_marcas) {
+        int cap = a->cap_marcas ? a->cap_marcas * 2 : 16;
+        Marca *p = realloc(a->marcas, (size_t)cap * sizeof(*p));
+        if (!p) return -1;
+        a->marcas = p;
+        a->cap_marcas = cap;
+    }
+    if (!indice_reservar(&a->por_marca)) return -1;
+    a->marcas[a->n_marcas] = (Marca){ .nombre = nombre };
+    indice_insertar(&a->por_marca, a->n_marcas);    /* ya reservado */
+    return a->n_marcas++;
+}
+
+/* Número de la marca 'nombre', registrándola (copia en la arena) si es nueva; -1 sin memoria */
+static int marca_interna(Almacen *a, Campo nombre) {
+    int m = indice_buscar_n(&a->por_marca, nombre.p, nombre.n);
+    if (m >= 0) return m;
+    char *copia = arena_copiar(&a->arena, nombre.p, nombre.n);
+    return copia ? marca_registrar(a, copia) : -1;
+}
+
+/* Capacidad para 'n' productos en total, arreglo e índice de modelos */
+static bool almacen_reservar(Almacen *a, size_t n) {
+    if (n > INT_MAX) return false;
+    if (n > (size_t)a->cap) {
+        Producto *p = realloc(a->productos, n * sizeof(*p));
+        if (!p) return false;
+        a->productos = p;
+        uint32_t *m = realloc(a->col_marca, n * sizeof(*m));
+        if (!m) return false;
+        a->col_marca = m;
+        double *pr = realloc(a->col_precio, n * sizeof(*pr));
+        if (!pr) return false;
+        a->col_precio = pr;
+        atomic_int *e = realloc(a->existencias, n * sizeof(*e));
+        if (!e) return false;
+        a->existencias = e;
+        a->cap = (int)n;
+    }
+    size_t cap = 16;
+    while (n * 10 > cap * 7) cap *= 2;
+    return cap <= a->por_modelo.cap || indice_crecer(&a->por_modelo, cap);
+}
+
+static bool producto_indexar(Almacen *a, int m);
+
+/* Agrega un producto (celdas marca, modelo, specs, precio, imagen, existencias) al almacén y a los índices */
+static bool almacen_agregar(Almacen *a, const Campo *celdas, double precio) {
+    if (a->n == a->cap && !almacen_reservar(a, (size_t)a->cap * 2 + 64)) return false;
+    int m = marca_interna(a, celdas[0]);
+    if (m < 0) return false;
+    Producto *p = &a->productos[a->n];
+    p->modelo = arena_copiar(&a->arena, celdas[1].p, celdas[1].n);
+    p->specs = arena_copiar(&a->arena, celdas[2].p, celdas[2].n);
+    p->imagen = arena_copiar(&a->arena, celdas[4].p, celdas[4].n);
+    if (!p->modelo || !p->specs || !p->imagen) return false;
+    a->col_precio[a->n] = precio;
+    atomic_init(&a->existencias[a->n], campo_existencias(celdas[5]));
+    return producto_indexar(a, m);
+}
+
+/*
+ * Cierra el alta de a->productos[a->n], con sus textos y precio ya
+ * puestos: lo asocia a la marca 'm' y lo agrega al índice de modelos.
+ */
+static bool producto_indexar(Almacen *a, int m) {
+    Producto *p = &a->productos[a->n];
+    if (!indice_reservar(&a->por_modelo) || !marca_agregar_producto(&a->marcas[m], a->n)) return false;
+    a->col_marca[a->n] = (uint32_t)m;
+    p->mismo_modelo = -1;
+
+    int primero = indice_buscar(&a->por_modelo, p->modelo);
+    if (primero < 0) {
+        indice_insertar(&a->por_modelo, a->n);  /* ya reservado */
+    } else {
+        /* los repetidos se encadenan en orden de aparición */
+        while (a->productos[primero].mismo_modelo >= 0) primero = a->productos[primero].mismo_modelo;
+        a->productos[primero].mismo_modelo = a->n;
+    }
+    a->n++;
+    return true;
+}
+
+/* ---------- Recorridos por columnas ---------- */
+
+/*
+ * Condiciones de marca y de rango de precio evaluadas sobre col_marca y
+ * col_precio de 64 en 64 productos: cada bloque da una máscara (bit i =
+ * producto base + i) que se junta con la palabra del mapa de activos. Con
+ * AVX2 (-mavx2) se comparan 8 marcas o 4 precios por instrucción, con
+ * SSE2 la mitad; el último bloque incompleto va por la versión escalar.
+ */
+typedef struct {
+    int marca;                  /* -1: cualquiera */
+    bool por_precio;
+    double min, max;            /* precio en [min, max] */
+} Escaneo;
+
+static bool escaneo_sin_simd;   /* solo para comparar en --medir-escaneo */
+
+static uint64_t escaneo_marca_escalar(const uint32_t *col, size_t n, uint32_t m) {
+    uint64_t r = 0;
+    for (size_t i = 0; i < n; ++i) r |= (uint64_t)(col[i] == m) << i;
+    return r;
+}
+
+static uint64_t escaneo_precio_escalar(const double *col, size_t n, double min, double max) {
+    uint64_t r = 0;
+    for (size_t i = 0; i < n; ++i) r |= (uint64_t)(col[i] >= min && col[i] <= max) << i;
+    return r;
+}
+
+static uint64_t escaneo_marca_64(const uint32_t *col, uint32_t m) {
+#if defined(__AVX2__)
+    const __m256i x = _mm256_set1_epi32((int)m);
+    uint64_t r = 0;
+    for (int i = 0; i < 8; ++i) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(col + 8 * i));
+        r |= (uint64_t)(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, x))) << (8 * i);
+    }
+    return r;
+#elif defined(__SSE2__)
+    const __m128i x = _mm_set1_epi32((int)m);
+    uint64_t r = 0;
+    for (int i = 0; i < 16; ++i) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(col + 4 * i));
+        r |= (uint64_t)(uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, x))) << (4 * i);
+    }
+    return r;
+#else
+    return escaneo_marca_escalar(col, 64, m);
+#endif
+}
+
+static uint64_t escaneo_precio_64(const double *col, double min, double max) {
+#if defined(__AVX2__)
+    const __m256d lo = _mm256_set1_pd(min), hi = _mm256_set1_pd(max);
+    uint64_t r = 0;
+    for (int i = 0; i < 16; ++i) {
+        __m256d v = _mm256_loadu_pd(col + 4 * i);
+        __m256d c = _mm256_and_pd(_mm256_cmp_pd(v, lo, _CMP_GE_OQ), _mm256_cmp_pd(v, hi, _CMP_LE_OQ));
+        r |= (uint64_t)(uint32_t)_mm256_movemask_pd(c) << (4 * i);
+    }
+    return r;
+#elif defined(__SSE2__)
+    const __m128d lo = _mm_set1_pd(min), hi = _mm_set1_pd(max);
+    uint64_t r = 0;
+    for (int i = 0; i < 32; ++i) {
+        __m128d v = _mm_loadu_pd(col + 2 * i);
+        __m128d c = _mm_and_pd(_mm_cmpge_pd(v, lo), _mm_cmple_pd(v, hi));
+        r |= (uint64_t)(uint32_t)_mm_movemask_pd(c) << (2 * i);
+    }
+    return r;
+#else
+    return escaneo_precio_escalar(col, 64, min, max);
+#endif
+}
+
+/*
+ * Deja en 'out' (mapa_palabras(n) palabras) los productos de 'activo'
+ * que cumplen 'q' y devuelve cuántos son; 'activo' NULL: todos.
+ */
+static long escanear(const uint32_t *col_marca, const double *col_precio, int n,
+                     const uint64_t *activo, const Escaneo *q, uint64_t *out) {
+    long total = 0;
+    for (size_t w = 0, base = 0; base < (size_t)n; ++w, base += 64) {
+        size_t k = (size_t)n - base < 64 ? (size_t)n - base : 64;
+        uint64_t m = activo ? activo[w] : k == 64 ? ~0ull : (1ull << k) - 1;
+        bool simd = k == 64 && !escaneo_sin_simd;
+        if (m && q->marca >= 0) {
+            m &= simd ? escaneo_marca_64(col_marca + base, (uint32_t)q->marca)
+                      : escaneo_marca_escalar(col_marca + base, k, (uint32_t)q->marca);
+        }
+        if (m && q->por_precio) {
+            m &= simd ? escaneo_precio_64(col_precio + base, q->min, q->max)
+                      : escaneo_precio_escalar(col_precio + base, k, q->min, q->max);
+        }
+        out[w] = m;
+        total += __builtin_popcountll(m);
+    }
+    return total;
+}
+
+/*
+ * --medir-escaneo FILAS: columnas sintéticas (16 marcas, precios de 1000 a
+ * 40000, 1% dados de baja) recorridas con y sin SIMD; imprime filas/s.
+ */
+static int medir_escaneo(int filas) {
+    uint32_t *marcas = malloc((size_t)filas * sizeof(*marcas));
+    double *precios = malloc((size_t)filas * sizeof(*precios));
+    uint64_t *activo = malloc(mapa_palabras(filas) * sizeof(uint64_t));
+    uint64_t *out = malloc(mapa_palabras(filas) * sizeof(uint64_t));
+    if (!marcas || !precios || !activo || !out) {
+        perror("medir_escaneo");
+        return 1;
+    }
+    uint64_t x = 88172645463325252ull;
+    memset(activo, 0, mapa_palabras(filas) * sizeof(uint64_t));
+    for (int i = 0; i < filas; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        marcas[i] = (uint32_t)(x % 16);
+        precios[i] = 1000 + (double)(x >> 20 & 0xfffff) * 39000.0 / 0xfffff;
+        if ((x >> 45) % 100 != 0) activo[i >> 6] |= 1ull << (i & 63);
+    }
+    static const struct { const char *nombre; Escaneo q; } casos[] = {
+        { "marca=3", { 3, false, 0, 0 } },
+        { "precio 10000-20000", { -1, true, 10000, 20000 } },
+        { "marca=3 y precio", { 3, true, 10000, 20000 } },
+    };
+#if defined(__AVX2__)
+    const char *simd = "AVX2";
+#elif defined(__SSE2__)
+    const char *simd = "SSE2";
+#else
+    const char *simd = "sin SIMD";
+#endif
+    printf("Recorrido de %d filas (%s)\n", filas, simd);
+    for (size_t c = 0; c < sizeof(casos) / sizeof(casos[0]); ++c) {
+        double filas_s[2];
+        long halladas[2];
+        for (int v = 0; v < 2; ++v) {
+            escaneo_sin_simd = v == 0;
+            int vueltas = 0;
+            struct timespec t0;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            double t;
+            do {
+                halladas[v] = escanear(marcas, precios, filas, activo, &casos[c].q, out);
+                vueltas++;
+            } while ((t = segundos_desde(&t0)) < 0.5);
+            filas_s[v] = (double)filas * vueltas / t;
+        }
+        printf("  %-20s %8ld filas | escalar %7.0f Mfilas/s | %s %7.0f Mfilas/s | x%.1f%s\n",
+               casos[c].nombre, halladas[1], filas_s[0] / 1e6, simd, filas_s[1] / 1e6,
+               filas_s[1] / filas_s[0], halladas[0] == halladas[1] ? "" : " (NO COINCIDEN)");
+    }
+    escaneo_sin_simd = false;
+    free(marcas);
+    free(precios);
+    free(activo);
+    free(out);
+    return 0;
+}
+
+/* ---------- Búsqueda por texto ---------- */
+
+#define TERMINO_MAX   32        /* bytes; lo que pase se corta */
+#define SALTO_CADA    32        /* entradas entre saltos de una lista */
+#define BUSQUEDA_MAX  50        /* resultados de un SEARCH */
+#define BUSQUEDA_TERMINOS 16
+#define PESO_MODELO 3           /* el peso de un término en un producto suma el de cada aparición */
+#define PESO_MARCA  2
+#define PESO_SPECS  1
+
+/*
+ * Siguiente término de '*p' en 't' (letras y dígitos ASCII en minúsculas;
+ * los bytes de UTF-8 cuentan como letras). Devuelve su largo, 0 al final.
+ */
+static size_t termino_siguiente(const char **p, char t[TERMINO_MAX + 1]) {
+    const unsigned char *s = (const unsigned char *)*p;
+    while (*s && !isalnum(*s) && *s < 0x80) s++;
+    size_t n = 0;
+    for (; *s && (isalnum(*s) || *s >= 0x80); ++s) {
+        if (n < TERMINO_MAX) t[n++] = (char)tolower(*s);
+    }
+    t[n] = '\0';
+    *p = (const char *)s;
+    return n;
+}
+
+/* Listas sin comprimir mientras se arma el índice */
+typedef struct {
+    int *ids;
+    uint8_t *pesos;
+    int n;
+    int cap;
+} ListaTemporal;
+
+static bool lista_sumar(ListaTemporal *l, int id, int peso) {
+    if (l->n > 0 && l->ids[l->n - 1] == id) {
+        int p = l->pesos[l->n - 1] + peso;
+        l->pesos[l->n - 1] = (uint8_t)(p > 255 ? 255 : p);
+        return true;
+    }
+    if (l->n == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 4;
+        int *ids = realloc(l->ids, (size_t)cap * sizeof(*ids));
+        if (ids) l->ids = ids;
+        uint8_t *pesos = realloc(l->pesos, (size_t)cap);
+        if (pesos) l->pesos = pesos;
+        if (!ids || !pesos) return false;
+        l->cap = cap;
+    }
+    l->ids[l->n] = id;
+    l->pesos[l->n++] = (uint8_t)peso;
+    return true;
+}
+
+/* Capacidad para 'n' elementos de 'tam' bytes en '*arr' */
+static bool arreglo_crecer(void **arr, size_t *cap, size_t n, size_t tam) {
+    if (n <= *cap) return true;
+    size_t nuevo = *cap ? *cap : 256;
+    while (nuevo < n) nuevo *= 2;
+    void *p = realloc(*arr, nuevo * tam);
+    if (!p) return false;
+    *arr = p;
+    *cap = nuevo;
+    return true;
+}
+
+/* Suma los términos de 'texto' al producto 'id' */
+static bool busqueda_texto(Almacen *a, ListaTemporal **listas, int id, const char *texto, int peso) {
+    IndiceBusqueda *b = &a->busqueda;
+    char t[TERMINO_MAX + 1];
+    for (size_t n; (n = termino_siguiente(&texto, t)) > 0;) {
+        int k = indice_buscar_n(&b->por_texto, t, n);
+        if (k < 0) {
+            if (b->n_terminos == b->cap_terminos) {
+                int cap = b->cap_terminos ? b->cap_terminos * 2 : 256;
+                const char **textos = realloc(b->textos, (size_t)cap * sizeof(*textos));
+                if (textos) b->textos = textos;
+                ListaTemporal *l = realloc(*listas, (size_t)cap * sizeof(*l));
+                if (l) *listas = l;
+                if (!textos || !l) return false;
+                b->cap_terminos = cap;
+            }
+            k = b->n_terminos;
+            b->textos[k] = arena_copiar(&a->arena, t, n);
+            (*listas)[k] = (ListaTemporal){0};
+            if (!b->textos[k] || !indice_insertar(&b->por_texto, k)) return false;
+            b->n_terminos++;
+        }
+        if (!lista_sumar(&(*listas)[k], id, peso)) return false;
+    }
+    return true;
+}
+
+/* Pasa cada lista a diferencias en varint y pone sus saltos */
+static bool busqueda_comprimir(IndiceBusqueda *b, const ListaTemporal *listas) {
+    b->terminos = malloc((size_t)(b->n_terminos ? b->n_terminos : 1) * sizeof(*b->terminos));
+    if (!b->terminos) return false;
+    for (int k = 0; k < b->n_terminos; ++k) {
+        const ListaTemporal *l = &listas[k];
+        Termino *t = &b->terminos[k];
+        t->inicio = (uint32_t)b->n_datos;
+        t->n = l->n;
+        t->primer_salto = (int)b->n_saltos;
+        int previo = -1;
+        for (int i = 0; i < l->n; ++i) {
+            if (i > 0 && i % SALTO_CADA == 0) {
+                if (!arreglo_crecer((void **)&b->saltos, &b->cap_saltos, b->n_saltos + 1, sizeof(*b->saltos)))
+                    return false;
+                b->saltos[b->n_saltos++] = (SaltoLista){ previo, (uint32_t)b->n_datos };
+            }
+            /* hasta 5 bytes de varint y el peso */
+            if (b->n_datos > UINT32_MAX - 6 || !arreglo_crecer((void **)&b->datos, &b->cap_datos, b->n_datos + 6, 1))
+                return false;
+            uint32_t d = (uint32_t)(l->ids[i] - previo);
+            while (d >= 0x80) {
+                b->datos[b->n_datos++] = (uint8_t)(d | 0x80);
+                d >>= 7;
+            }
+            b->datos[b->n_datos++] = (uint8_t)d;
+            b->datos[b->n_datos++] = l->pesos[i];
+            previo = l->ids[i];
+        }
+        t->fin = (uint32_t)b->n_datos;
+    }
+    return true;
+}
+
+static void busqueda_liberar(IndiceBusqueda *b) {
+    indice_liberar(&b->por_texto);
+    free(b->textos);
+    free(b->terminos);
+    free(b->datos);
+    free(b->saltos);
+    *b = (IndiceBusqueda){0};
+}
+
+/*
+ * Arma el índice de todos los productos del almacén (activos o no: las
+ * bajas se filtran al buscar con la versión vigente). Los términos se
+ * copian a la arena. Si no hay memoria SEARCH queda sin índice.
+ */
+static void busqueda_construir(Almacen *a) {
+    IndiceBusqueda *b = &a->busqueda;
+    b->por_texto = (IndiceHash){ .clave = clave_termino, .ctx = b };
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ListaTemporal *listas = NULL;
+    bool ok = true;
+    for (int i = 0; i < a->n && ok; ++i) {
+        const Producto *p = &a->productos[i];
+        ok = busqueda_texto(a, &listas, i, p->modelo, PESO_MODELO)
+             && busqueda_texto(a, &listas, i, producto_marca(a, i), PESO_MARCA)
+             && busqueda_texto(a, &listas, i, p->specs, PESO_SPECS);
+    }
+    ok = ok && busqueda_comprimir(b, listas);
+    for (int k = 0; k < b->n_terminos; ++k) {
+        free(listas[k].ids);
+        free(listas[k].pesos);
+    }
+    free(listas);
+    if (!ok) {
+        fprintf(stderr, "[SERVIDOR] Sin memoria para el índice de búsqueda\n");
+        busqueda_liberar(b);
+        return;
+    }
+    b->listo = true;
+    printf("[SERVIDOR] Índice de búsqueda: %d términos, %zu KB de listas en %.3f s\n",
+           b->n_terminos, (b->n_datos + b->n_saltos * sizeof(*b->saltos)) / 1024, segundos_desde(&t0));
+}
+
+/* Recorre la lista de un término; id INT_MAX al terminar */
+typedef struct {
+    const uint8_t *p, *fin, *base;
+    const SaltoLista *saltos;
+    int n_saltos;
+    int n;                      /* largo de la lista */
+    int k;                      /* siguiente salto por considerar */
+    int id;
+    int peso;
+    int idf;
+} CursorLista;
+
+static void cursor_siguiente(CursorLista *c) {
+    if (c->p >= c->fin) {
+        c->id = INT_MAX;
+        return;
+    }
+    uint32_t d = 0;
+    for (int sh = 0;; sh += 7) {
+        uint8_t x = *c->p++;
+        d |= (uint32_t)(x & 0x7f) << sh;
+        if (!(x & 0x80)) break;
+    }
+    c->id += (int)d;
+    c->peso = *c->p++;
+}
+
+/* Primer id >= 'objetivo'; los saltos evitan decodificar los bloques anteriores */
+static void cursor_avanzar(CursorLista *c, int objetivo) {
+    for (; c->k < c->n_saltos && c->saltos[c->k].previo < objetivo; c->k++) {
+        const uint8_t *q = c->base + c->saltos[c->k].pos;
+        if (q > c->p) {
+            c->p = q;
+            c->id = c->saltos[c->k].previo;
+        }
+    }
+    while (c->id < objetivo) cursor_siguiente(c);
+}
+
+static int comparar_cursor(const void *x, const void *y) {
+    const CursorLista *a = x, *b = y;
+    return (a->n > b->n) - (a->n < b->n);
+}
+
+/* Resultado con su puntaje; el montículo deja arriba el peor */
+typedef struct {
+    int puntaje;
+    int id;
+} Acierto;
+
+static bool acierto_peor(Acierto a, Acierto b) {
+    return a.puntaje < b.puntaje || (a.puntaje == b.puntaje && a.id > b.id);
+}
+
+static void monticulo_bajar(Acierto *h, int n, int i) {
+    for (;;) {
+        int m = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && acierto_peor(h[l], h[m])) m = l;
+        if (r < n && acierto_peor(h[r], h[m])) m = r;
+        if (m == i) return;
+        Acierto t = h[i];
+        h[i] = h[m];
+        h[m] = t;
+        i = m;
+    }
+}
+
+static int comparar_acierto(const void *x, const void *y) {
+    Acierto a = *(const Acierto *)x, b = *(const Acierto *)y;
+    return acierto_peor(a, b) - acierto_peor(b, a);
+}
+
+/*
+ * Productos activos con todos los términos de 'consulta', de mayor a
+ * menor puntaje (suma de peso por rareza del término; empates en orden
+ * del almacén). Las listas se intersecan empezando por la más corta, así
+ * que el costo depende de los productos que coinciden, no del catálogo.
+ * Devuelve cuántos dejó en 'ids' (hasta BUSQUEDA_MAX), o -1 si la
+ * consulta no tiene términos.
+ */
+static int busqueda_consultar(const Almacen *a, const uint64_t *activo, const char *consulta, int ids[BUSQUEDA_MAX]) {
+    const IndiceBusqueda *b = &a->busqueda;
+    CursorLista c[BUSQUEDA_TERMINOS];
+    int vistos[BUSQUEDA_TERMINOS];
+    int n = 0;
+    char t[TERMINO_MAX + 1];
+    bool alguno = false;
+    for (size_t largo; n < BUSQUEDA_TERMINOS && (largo = termino_siguiente(&consulta, t)) > 0;) {
+        alguno = true;
+        int k = b->listo ? indice_buscar_n(&b->por_texto, t, largo) : -1;
+        if (k < 0) return 0;
+        bool repetido = false;
+        for (int i = 0; i < n; ++i) repetido = repetido || vistos[i] == k;
+        if (repetido) continue;
+        const Termino *tm = &b->terminos[k];
+        int n_saltos = (k + 1 < b->n_terminos ? b->terminos[k + 1].primer_salto : (int)b->n_saltos) - tm->primer_salto;
+        /* rareza: 1 + log2(productos / productos con el término) */
+        int idf = 1;
+        for (int q = a->n / tm->n; q > 1; q >>= 1) idf++;
+        vistos[n] = k;
+        c[n++] = (CursorLista){ .p = b->datos + tm->inicio, .fin = b->datos + tm->fin, .base = b->datos,
+                                .saltos = b->saltos + tm->primer_salto, .n_saltos = n_saltos, .n = tm->n,
+                                .id = -1, .idf = idf };
+    }
+    if (!alguno) return -1;
+    /* la más corta manda: las demás solo avanzan hasta sus candidatos */
+    qsort(c, (size_t)n, sizeof(*c), comparar_cursor);
+    Acierto mejores[BUSQUEDA_MAX];
+    int m = 0;
+    cursor_siguiente(&c[0]);
+    while (c[0].id != INT_MAX) {
+        int candidato = c[0].id;
+        int i = 1;
+        for (; i < n; ++i) {
+            cursor_avanzar(&c[i], candidato);
+            if (c[i].id != candidato) break;
+        }
+        if (i < n) {
+            /* alguna lista no lo tiene: la más corta salta hasta donde sigue esa */
+            if (c[i].id == INT_MAX) break;
+            cursor_avanzar(&c[0], c[i].id);
+            continue;
+        }
+        if (mapa_bit(activo, candidato)) {
+            Acierto x = { 0, candidato };
+            for (i = 0; i < n; ++i) x.puntaje += c[i].idf * c[i].peso;
+            if (m < BUSQUEDA_MAX) {
+                mejores[m++] = x;
+                if (m == BUSQUEDA_MAX) {
+                    for (int j = m / 2 - 1; j >= 0; --j) monticulo_bajar(mejores, m, j);
+                }
+            } else if (acierto_peor(mejores[0], x)) {
+                mejores[0] = x;
+                monticulo_bajar(mejores, m, 0);
+            }
+        }
+        cursor_siguiente(&c[0]);
+    }
+    qsort(mejores, (size_t)m, sizeof(*mejores), comparar_acierto);
+    for (int i = 0; i < m; ++i) ids[i] = mejores[i].id;
+    return m;
+}
+
+/* ---------- Conjuntos roaring ---------- */
+
+#define ROARING_ARREGLO_MAX 4096
+#define ROARING_PALABRAS    (65536 / 64)
+
+static void bloque_liberar(BloqueRoaring *c) {
+    if (c->es_mapa) free(c->mapa);
+    else free(c->arreglo);
+}
+
+static void roaring_liberar(Roaring *r) {
+    for (int i = 0; i < r->n; ++i) bloque_liberar(&r->b[i]);
+    free(r->b);
+    *r = (Roaring){0};
+}
+
+/* Agrega 'c' al final de 'r', que se queda con su memoria */
+static bool roaring_poner(Roaring *r, BloqueRoaring c) {
+    if (r->n == r->cap) {
+        int cap = r->cap ? r->cap * 2 : 4;
+        BloqueRoaring *b = realloc(r->b, (size_t)cap * sizeof(*b));
+        if (!b) {
+            bloque_liberar(&c);
+            return false;
+        }
+        r->b = b;
+        r->cap = cap;
+    }
+    r->b[r->n++] = c;
+    return true;
+}
+
+static bool bloque_contiene(const BloqueRoaring *c, uint16_t x) {
+    if (c->es_mapa) return c->mapa[x >> 6] >> (x & 63) & 1;
+    uint32_t lo = 0, hi = c->n;
+    while (lo < hi) {
+        uint32_t m = (lo + hi) / 2;
+        if (c->arreglo[m] < x) lo = m + 1;
+        else hi = m;
+    }
+    return lo < c->n && c->arreglo[lo] == x;
+}
+
+/* Con pocos ids un mapa vuelve a arreglo */
+static bool bloque_compactar(BloqueRoaring *c) {
+    if (!c->es_mapa || c->n > ROARING_ARREGLO_MAX) return true;
+    uint16_t *a = malloc((c->n ? c->n : 1) * sizeof(*a));
+    if (!a) return false;
+    uint32_t k = 0;
+    for (int w = 0; w < ROARING_PALABRAS; ++w) {
+        for (uint64_t m = c->mapa[w]; m; m &= m - 1) a[k++] = (uint16_t)(w * 64 + __builtin_ctzll(m));
+    }
+    free(c->mapa);
+    c->arreglo = a;
+    c->cap = c->n;
+    c->es_mapa = false;
+    return true;
+}
+
+static bool bloque_a_mapa(BloqueRoaring *c) {
+    uint64_t *m = calloc(ROARING_PALABRAS, sizeof(*m));
+    if (!m) return false;
+    for (uint32_t i = 0; i < c->n; ++i) m[c->arreglo[i] >> 6] |= 1ull << (c->arreglo[i] & 63);
+    free(c->arreglo);
+    c->mapa = m;
+    c->es_mapa = true;
+    return true;
+}
+
+/* Los ids se agregan en orden creciente */
+static bool roaring_agregar(Roaring *r, int id) {
+    uint16_t alto = (uint16_t)(id >> 16), x = (uint16_t)id;
+    if ((r->n == 0 || r->b[r->n - 1].alto != alto) && !roaring_poner(r, (BloqueRoaring){ .alto = alto }))
+        return false;
+    BloqueRoaring *c = &r->b[r->n - 1];
+    if (!c->es_mapa && c->n == ROARING_ARREGLO_MAX && !bloque_a_mapa(c)) return false;
+    if (c->es_mapa) {
+        c->mapa[x >> 6] |= 1ull << (x & 63);
+    } else {
+        if (c->n == c->cap) {
+            uint32_t cap = c->cap ? c->cap * 2 : 4;
+            uint16_t *a = realloc(c->arreglo, cap * sizeof(*a));
+            if (!a) return false;
+            c->arreglo = a;
+            c->cap = cap;
+        }
+        c->arreglo[c->n] = x;
+    }
+    c->n++;
+    return true;
+}
+
+/* Bloques con el mismo 'alto' */
+static bool bloque_y(const BloqueRoaring *a, const BloqueRoaring *b, BloqueRoaring *out) {
+    *out = (BloqueRoaring){ .alto = a->alto };
+    if (a->es_mapa && b->es_mapa) {
+        if (!(out->mapa = malloc(ROARING_PALABRAS * sizeof(uint64_t)))) return false;
+        out->es_mapa = true;
+        for (int w = 0; w < ROARING_PALABRAS; ++w) {
+            out->mapa[w] = a->mapa[w] & b->mapa[w];
+            out->n += (uint32_t)__builtin_popcountll(out->mapa[w]);
+        }
+        return bloque_compactar(out);
+    }
+    if (a->es_mapa || (!b->es_mapa && b->n < a->n)) {
+        const BloqueRoaring *t = a;
+        a = b;
+        b = t;
+    }
+    /* 'a' es el arreglo más corto: se buscan sus ids en 'b' */
+    if (!(out->arreglo = malloc((a->n ? a->n : 1) * sizeof(uint16_t)))) return false;
+    out->cap = a->n;
+    for (uint32_t i = 0; i < a->n; ++i) {
+        if (bloque_contiene(b, a->arreglo[i])) out->arreglo[out->n++] = a->arreglo[i];
+    }
+    return true;
+}
+
+static uint32_t bloque_contar_y(const BloqueRoaring *a, const BloqueRoaring *b) {
+    uint32_t n = 0;
+    if (a->es_mapa && b->es_mapa) {
+        for (int w = 0; w < ROARING_PALABRAS; ++w) n += (uint32_t)__builtin_popcountll(a->mapa[w] & b->mapa[w]);
+        return n;
+    }
+    if (a->es_mapa || (!b->es_mapa && b->n < a->n)) {
+        const BloqueRoaring *t = a;
+        a = b;
+        b = t;
+    }
+    for (uint32_t i = 0; i < a->n; ++i) n += bloque_contiene(b, a->arreglo[i]);
+    return n;
+}
+
+static bool bloque_o(const BloqueRoaring *a, const BloqueRoaring *b, BloqueRoaring *out) {
+    *out = (BloqueRoaring){ .alto = a->alto };
+    if (!a->es_mapa && !b->es_mapa && a->n + b->n <= ROARING_ARREGLO_MAX) {
+        if (!(out->arreglo = malloc((a->n + b->n) * sizeof(uint16_t)))) return false;
+        out->cap = a->n + b->n;
+        uint32_t i = 0, j = 0;
+        while (i < a->n || j < b->n) {
+            uint16_t x;
+            if (j == b->n || (i < a->n && a->arreglo[i] < b->arreglo[j])) x = a->arreglo[i++];
+            else if (i == a->n || b->arreglo[j] < a->arreglo[i]) x = b->arreglo[j++];
+            else {
+                x = a->arreglo[i++];
+                j++;
+            }
+            out->arreglo[out->n++] = x;
+        }
+        return true;
+    }
+    if (!(out->mapa = calloc(ROARING_PALABRAS, sizeof(uint64_t)))) return false;
+    out->es_mapa = true;
+    const BloqueRoaring *lados[2] = { a, b };
+    for (int k = 0; k < 2; ++k) {
+        const BloqueRoaring *c = lados[k];
+        if (c->es_mapa) {
+            for (int w = 0; w < ROARING_PALABRAS; ++w) out->mapa[w] |= c->mapa[w];
+        } else {
+            for (uint32_t i = 0; i < c->n; ++i) out->mapa[c->arreglo[i] >> 6] |= 1ull << (c->arreglo[i] & 63);
+        }
+    }
+    for (int w = 0; w < ROARING_PALABRAS; ++w) out->n += (uint32_t)__builtin_popcountll(out->mapa[w]);
+    return bloque_compactar(out);
+}
+
+static bool bloque_copiar(const BloqueRoaring *c, BloqueRoaring *out) {
+    *out = *c;
+    size_t bytes = c->es_mapa ? ROARING_PALABRAS * sizeof(uint64_t) : (c->n ? c->n : 1) * sizeof(uint16_t);
+    void *d = malloc(bytes);
+    if (!d) return false;
+    memcpy(d, c->es_mapa ? (void *)c->mapa : (void *)c->arreglo, c->es_mapa ? bytes : c->n * sizeof(uint16_t));
+    if (c->es_mapa) out->mapa = d;
+    else {
+        out->arreglo = d;
+        out->cap = c->n;
+    }
+    return true;
+}
+
+/* 'out' = 'a' y 'b' (o 'a' o 'b'); 'out' empieza vacío */
+static bool roaring_combinar(const Roaring *a, const Roaring *b, bool union_, Roaring *out) {
+    int i = 0, j = 0;
+    while (i < a->n || j < b->n) {
+        BloqueRoaring c;
+        bool ok;
+        if (i < a->n && j < b->n && a->b[i].alto == b->b[j].alto) {
+            ok = union_ ? bloque_o(&a->b[i], &b->b[j], &c) : bloque_y(&a->b[i], &b->b[j], &c);
+            i++;
+            j++;
+        } else {
+            bool de_a = j == b->n || (i < a->n && a->b[i].alto < b->b[j].alto);
+            const BloqueRoaring *solo = de_a ? &a->b[i++] : &b->b[j++];
+            if (!union_) continue;
+            ok = bloque_copiar(solo, &c);
+        }
+        if (!ok) {
+            roaring_liberar(out);
+            return false;
+        }
+        if (c.n == 0) bloque_liberar(&c);
+        else if (!roaring_poner(out, c)) {
+            roaring_liberar(out);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Cuántos ids tienen en común, sin armar la intersección */
+static long roaring_contar_y(const Roaring *a, const Roaring *b) {
+    long n = 0;
+    for (int i = 0, j = 0; i < a->n && j < b->n;) {
+        if (a->b[i].alto < b->b[j].alto) i++;
+        else if (a->b[i].alto > b->b[j].alto) j++;
+        else n += bloque_contar_y(&a->b[i++], &b->b[j++]);
+    }
+    return n;
+}
+
+static long roaring_cuantos(const Roaring *r) {
+    long n = 0;
+    for (int i = 0; i < r->n; ++i) n += r->b[i].n;
+    return n;
+}
+
+/* Llama a 'f' con cada id en orden mientras devuelva true */
+static void roaring_recorrer(const Roaring *r, bool (*f)(void *ctx, int id), void *ctx) {
+    for (int i = 0; i < r->n; ++i) {
+        const BloqueRoaring *c = &r->b[i];
+        int base = (int)c->alto << 16;
+        if (c->es_mapa) {
+            for (int w = 0; w < ROARING_PALABRAS; ++w) {
+                for (uint64_t m = c->mapa[w]; m; m &= m - 1)
+                    if (!f(ctx, base + w * 64 + __builtin_ctzll(m))) return;
+            }
+        } else {
+            for (uint32_t k = 0; k < c->n; ++k)
+                if (!f(ctx, base + c->arreglo[k])) return;
+        }
+    }
+}
+
+/* Conjunto con los bits encendidos de 'mapa' ('palabras' palabras de 64 ids) */
+static bool roaring_desde_mapa(const uint64_t *mapa, size_t palabras, Roaring *out) {
+    *out = (Roaring){0};
+    for (size_t w0 = 0; w0 < palabras; w0 += ROARING_PALABRAS) {
+        size_t nw = palabras - w0 < ROARING_PALABRAS ? palabras - w0 : ROARING_PALABRAS;
+        uint32_t n = 0;
+        for (size_t w = 0; w < nw; ++w) n += (uint32_t)__builtin_popcountll(mapa[w0 + w]);
+        if (n == 0) continue;
+        BloqueRoaring c = { .alto = (uint16_t)(w0 / ROARING_PALABRAS), .n = n };
+        if (n > ROARING_ARREGLO_MAX) {
+            c.es_mapa = true;
+            if ((c.mapa = calloc(ROARING_PALABRAS, sizeof(uint64_t))))
+                memcpy(c.mapa, mapa + w0, nw * sizeof(uint64_t));
+        } else if ((c.arreglo = malloc(n * sizeof(uint16_t)))) {
+            c.cap = n;
+            uint32_t k = 0;
+            for (size_t w = 0; w < nw; ++w) {
+                for (uint64_t m = mapa[w0 + w]; m; m &= m - 1)
+                    c.arreglo[k++] = (uint16_t)(w * 64 + (size_t)__builtin_ctzll(m));
+            }
+        }
+        if (!(c.es_mapa ? (void *)c.mapa : (void *)c.arreglo) || !roaring_poner(out, c)) {
+            roaring_liberar(out);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* ---------- Facetas de FILTER ---------- */
+
+/*
+ * Al armar el almacén se sacan de cada producto la marca, el chipset, la
+ * RAM y el almacenamiento (de specs, p. ej. "Snapdragon 8 Gen 3 8GB RAM
+ * 256GB") y la banda de precio. Cada valor de cada faceta tiene el
+ * conjunto roaring de sus productos; FILTER une los valores que cumplen
+ * cada condición e interseca las condiciones, y los conteos por valor
+ * salen de intersecciones (o de las columnas si quedan pocos productos).
+ */
+#define FILTRO_MAX       100    /* productos listados; el total va en OK|n */
+#define FILTRO_CONDICIONES 8
+#define FACETA_VALORES   20     /* valores con más productos por faceta en la respuesta */
+#define FACETA_POR_CONJUNTOS 64 /* hasta estos valores los conteos salen de intersecciones */
+#define CHIPSET_MAX      64
+
+static const char *const facetas_nombre[N_FACETAS] = { "brand", "chipset", "ram", "storage", "price" };
+static const double bandas_precio[] = { 0, 5000, 10000, 15000, 20000, 30000 };
+#define N_BANDAS ((int)(sizeof(bandas_precio) / sizeof(bandas_precio[0])))
+
+/* Número al inicio de 's' (o -1) y dónde termina */
+static long numero_inicial(const char *s, const char **fin) {
+    if (!isdigit((unsigned char)*s)) return -1;
+    long v = 0;
+    for (; isdigit((unsigned char)*s); ++s) v = v < 1000000 ? v * 10 + (*s - '0') : v;
+    *fin = s;
+    return v;
+}
+
+/* "256GB", "1TB", "512" o "12GM" (sic) en GB; -1 si no es un tamaño */
+static long tamano_gb(const char *pal, const char *sig_pal) {
+    const char *u;
+    long v = numero_inicial(pal, &u);
+    if (v < 0) return -1;
+    if (!*u && sig_pal) u = sig_pal;        /* "512 GB" */
+    if (strcasecmp(u, "TB") == 0) return v * 1024;
+    if (!*u || strcasecmp(u, "GB") == 0 || strcasecmp(u, "GM") == 0 || strcasecmp(u, "G") == 0) return v;
+    return -1;
+}
+
+/*
+ * Saca chipset, RAM y almacenamiento de 'specs'. La RAM es el tamaño antes
+ * de "RAM" y el almacenamiento el que le sigue; el chipset, lo que va
+ * antes de la RAM sin la pantalla ("FHD+"), en minúsculas y con las
+ * variantes de escritura más comunes unificadas.
+ */
+static void specs_analizar(const char *specs, char chipset[CHIPSET_MAX], long *ram, long *almacenamiento) {
+    char copia[256];
+    char *pal[32];
+    int n = 0;
+    snprintf(copia, sizeof(copia), "%s", specs);
+    char *guardar;
+    for (char *t = strtok_r(copia, " \t", &guardar); t && n < 32; t = strtok_r(NULL, " \t", &guardar)) pal[n++] = t;
+    *ram = *almacenamiento = -1;
+    int r = -1;
+    for (int i = 0; i < n && r < 0; ++i) {
+        if (strcasecmp(pal[i], "RAM") == 0) r = i;
+    }
+    int fin_chip = n;
+    if (r > 0) {
+        /* "8GB RAM" o "8 GB RAM" */
+        int k = r - 1;
+        if (k > 0 && numero_inicial(pal[k], &(const char *){0}) < 0) k--;
+        *ram = tamano_gb(pal[k], k + 1 < r ? pal[k + 1] : NULL);
+        if (*ram >= 0) fin_chip = k;
+        if (r + 1 < n) *almacenamiento = tamano_gb(pal[r + 1], r + 2 < n ? pal[r + 2] : NULL);
+    } else {
+        for (int i = 0; i < n; ++i) {
+            long v = tamano_gb(pal[i], i + 1 < n ? pal[i + 1] : NULL);
+            if (v > *almacenamiento && numero_inicial(pal[i], &(const char *){0}) >= 0 && strpbrk(pal[i], "GgTt")) {
+                *almacenamiento = v;
+                if (i < fin_chip) fin_chip = i;
+            }
+        }
+    }
+    size_t largo = 0;
+    chipset[0] = '\0';
+    for (int i = 0; i < fin_chip; ++i) {
+        const char *p = pal[i];
+        if (i == 0 && (p[strlen(p) - 1] == '+' || strcasestr(p, "HD"))) continue;   /* pantalla */
+        char t[32];
+        size_t k = 0;
+        for (; p[k] && k < sizeof(t) - 1; ++k) t[k] = (char)tolower((unsigned char)p[k]);
+        t[k] = '\0';
+        if (strcmp(t, "sanpdragon") == 0) strcpy(t, "snapdragon");
+        /* "Gen3" como "gen 3" */
+        if (strncmp(t, "gen", 3) == 0 && isdigit((unsigned char)t[3])) {
+            memmove(t + 4, t + 3, strlen(t + 3) + 1);
+            t[3] = ' ';
+        }
+        int w = snprintf(chipset + largo, CHIPSET_MAX - largo, "%s%s", largo ? " " : "", t);
+        if (w < 0 || (size_t)w >= CHIPSET_MAX - largo) break;
+        largo += (size_t)w;
+    }
+}
+
+/* Valor 'texto' de la faceta, creándolo si es nuevo; -1 sin memoria */
+static int faceta_valor(Almacen *a, Faceta *f, const char *texto, double num) {
+    int v = indice_buscar(&f->por_texto, texto);
+    if (v < 0) {
+        if (f->n == f->cap) {
+            int cap = f->cap ? f->cap * 2 : 16;
+            ValorFaceta *p = realloc(f->valores, (size_t)cap * sizeof(*p));
+            if (!p) return -1;
+            f->valores = p;
+            f->cap = cap;
+        }
+        const char *copia = arena_copiar(&a->arena, texto, strlen(texto));
+        if (!copia) return -1;
+        f->valores[f->n] = (ValorFaceta){ .texto = copia, .min = num, .max = num };
+        if (!indice_insertar(&f->por_texto, f->n)) return -1;
+        v = f->n++;
+    }
+    ValorFaceta *x = &f->valores[v];
+    if (num < x->min) x->min = num;
+    if (num > x->max) x->max = num;
+    return v;
+}
+
+static void facetas_liberar(Facetas *fs) {
+    for (int k = 0; k < N_FACETAS; ++k) {
+        Faceta *f = &fs->faceta[k];
+        for (int i = 0; i < f->n; ++i) roaring_liberar(&f->valores[i].productos);
+        free(f->valores);
+        free(f->columna);
+        indice_liberar(&f->por_texto);
+    }
+    roaring_liberar(&fs->todos);
+    *fs = (Facetas){0};
+}
+
+/* Columnas y conjuntos de todas las facetas; sin memoria FILTER queda sin ellas */
+static void facetas_construir(Almacen *a) {
+    Facetas *fs = &a->facetas;
+    bool ok = true;
+    for (int k = 0; k < N_FACETAS; ++k) {
+        fs->faceta[k].por_texto = (IndiceHash){ .clave = clave_valor_faceta, .ctx = &fs->faceta[k] };
+        fs->faceta[k].columna = malloc((size_t)(a->n ? a->n : 1) * sizeof(int));
+        ok = ok && fs->faceta[k].columna;
+    }
+    for (int i = 0; i < a->n && ok; ++i) {
+        const Producto *p = &a->productos[i];
+        char chipset[CHIPSET_MAX], texto[32];
+        long ram, almacenamiento;
+        specs_analizar(p->specs, chipset, &ram, &almacenamiento);
+        int banda = N_BANDAS - 1;
+        while (banda > 0 && a->col_precio[i] < bandas_precio[banda]) banda--;
+        if (banda == N_BANDAS - 1) snprintf(texto, sizeof(texto), "%.0f+", bandas_precio[banda]);
+        else snprintf(texto, sizeof(texto), "%.0f-%.0f", bandas_precio[banda], bandas_precio[banda + 1]);
+
+        int v[N_FACETAS];
+        v[FACETA_MARCA] = faceta_valor(a, &fs->faceta[FACETA_MARCA], producto_marca(a, i), 0);
+        v[FACETA_CHIPSET] = chipset[0] ? faceta_valor(a, &fs->faceta[FACETA_CHIPSET], chipset, 0) : -2;
+        v[FACETA_PRECIO] = faceta_valor(a, &fs->faceta[FACETA_PRECIO], texto, a->col_precio[i]);
+        long gb[2] = { ram, almacenamiento };
+        for (int k = 0; k < 2; ++k) {
+            snprintf(texto, sizeof(texto), "%ld", gb[k]);
+            v[FACETA_RAM + k] = gb[k] >= 0 ? faceta_valor(a, &fs->faceta[FACETA_RAM + k], texto, (double)gb[k]) : -2;
+        }
+        for (int k = 0; k < N_FACETAS && ok; ++k) {
+            /* -2: el producto no tiene ese dato */
+            ok = v[k] != -1 && (v[k] < 0 || roaring_agregar(&fs->faceta[k].valores[v[k]].productos, i));
+            fs->faceta[k].columna[i] = v[k] < 0 ? -1 : v[k];
+        }
+        ok = ok && roaring_agregar(&fs->todos, i);
+    }
+    if (!ok) {
+        fprintf(stderr, "[SERVIDOR] Sin memoria para las facetas de FILTER\n");
+        facetas_liberar(fs);
+        return;
+    }
+    fs->listo = true;
+}
+
+typedef enum { OP_IGUAL, OP_MENOR, OP_MENOR_IGUAL, OP_MAYOR, OP_MAYOR_IGUAL } OperadorFiltro;
+
+static bool filtro_cumple(double v, OperadorFiltro op, double x) {
+    switch (op) {
+    case OP_IGUAL: return v == x;
+    case OP_MENOR: return v < x;
+    case OP_MENOR_IGUAL: return v <= x;
+    case OP_MAYOR: return v > x;
+    case OP_MAYOR_IGUAL: return v >= x;
+    }
+    return false;
+}
+
+/*
+ * Productos que cumplen una condición de chipset, RAM o almacenamiento:
+ * la unión de los valores de la faceta que la cumplen (marca y precio van
+ * por escanear(), ver filtro_evaluar).
+ */
+static bool filtro_condicion(const Almacen *a, int k, OperadorFiltro op, const char *valor, Roaring *out) {
+    const Faceta *f = &a->facetas.faceta[k];
+    *out = (Roaring){0};
+    if (k == FACETA_CHIPSET) {
+        char norm[CHIPSET_MAX];
+        long ram, almacenamiento;
+        specs_analizar(valor, norm, &ram, &almacenamiento);
+        int v = indice_buscar(&f->por_texto, norm);
+        return v < 0 || roaring_combinar(&f->valores[v].productos, &(Roaring){0}, true, out);
+    }
+    char *fin;
+    double x = strtod(valor, &fin);
+    if (fin == valor) return true;      /* nada lo cumple */
+    for (int v = 0; v < f->n; ++v) {
+        /* cada valor de RAM o almacenamiento es un solo número (min == max) */
+        const ValorFaceta *vf = &f->valores[v];
+        if (!filtro_cumple(vf->min, op, x)) continue;
+        Roaring parte = {0};
+        bool ok = roaring_combinar(out, &vf->productos, true, &parte);
+        roaring_liberar(out);
+        if (!ok) return false;
+        *out = parte;
+    }
+    return true;
+}
+
+/* Faceta por nombre de FILTER (inglés, como en el ejemplo, o español) */
+static int faceta_por_nombre(const char *s, size_t n) {
+    static const char *const sinonimos[N_FACETAS] = { "marca", "procesador", "ram", "almacenamiento", "precio" };
+    for (int k = 0; k < N_FACETAS; ++k) {
+        if ((strlen(facetas_nombre[k]) == n && strncasecmp(s, facetas_nombre[k], n) == 0)
+            || (strlen(sinonimos[k]) == n && strncasecmp(s, sinonimos[k], n) == 0))
+            return k;
+    }
+    return -1;
+}
+
+typedef struct {
+    const uint64_t *activo;
+    Roaring *out;
+    bool ok;
+} FiltroActivos;
+
+static bool filtro_activo_uno(void *ctx, int id) {
+    FiltroActivos *fa = ctx;
+    if (mapa_bit(fa->activo, id)) fa->ok = roaring_agregar(fa->out, id);
+    return fa->ok;
+}
+
+/* El double contiguo a 'x' hacia arriba o hacia abajo: precio<x es precio<=vecino */
+static double precio_vecino(double x, bool arriba) {
+    uint64_t b;
+    memcpy(&b, &x, sizeof(b));
+    if (x == 0) b = arriba ? 1 : 0x8000000000000001ull;
+    else if ((x > 0) == arriba) b++;
+    else b--;
+    memcpy(&x, &b, sizeof(x));
+    return x;
+}
+
+/* Agrega a 'q' una condición de marca o de precio; false si ya nada la cumple */
+static bool escaneo_condicion(const Almacen *a, Escaneo *q, int k, OperadorFiltro op, const char *valor) {
+    if (k == FACETA_MARCA) {
+        int m = indice_buscar(&a->por_marca, valor);
+        if (m < 0 || (q->marca >= 0 && q->marca != m)) return false;
+        q->marca = m;
+        return true;
+    }
+    char *fin;
+    double x = strtod(valor, &fin);
+    if (fin == valor) return false;
+    if (!q->por_precio) {
+        q->por_precio = true;
+        q->min = -INFINITY;
+        q->max = INFINITY;
+    }
+    double min = -INFINITY, max = INFINITY;
+    switch (op) {
+    case OP_IGUAL: min = max = x; break;
+    case OP_MENOR: max = precio_vecino(x, false); break;
+    case OP_MENOR_IGUAL: max = x; break;
+    case OP_MAYOR: min = precio_vecino(x, true); break;
+    case OP_MAYOR_IGUAL: min = x; break;
+    }
+    if (min > q->min) q->min = min;
+    if (max < q->max) q->max = max;
+    return q->min <= q->max;
+}
+
+/* 'actual' pasa a ser 'actual' y 'cond' ('cond' si es la primera); se queda con 'cond' */
+static bool filtro_juntar(Roaring *actual, bool *primero, Roaring *cond) {
+    Roaring y = *cond;
+    bool ok = true;
+    if (!*primero) {
+        y = (Roaring){0};
+        ok = roaring_combinar(actual, cond, false, &y);
+        roaring_liberar(cond);
+    }
+    roaring_liberar(actual);
+    *actual = y;
+    *primero = false;
+    return ok;
+}
+
+/*
+ * Evalúa "campo<op>valor;..." (op: = < <= > >=) y deja en 'out' los
+ * productos activos que cumplen todo. Marca y precio se evalúan juntos en
+ * un solo recorrido de las columnas; el resto, con los conjuntos de cada
+ * valor de faceta. Devuelve NULL o el mensaje de error.
+ */
+static const char *filtro_evaluar(const Almacen *a, const uint64_t *activo, const char *consulta, Roaring *out) {
+    *out = (Roaring){0};
+    if (!a->facetas.listo) return "Sin facetas";
+    Roaring actual = {0};
+    bool primero = true;
+    Escaneo q = { .marca = -1 };
+    bool escanear_columnas = false, nada = false;
+    char copia[512];
+    snprintf(copia, sizeof(copia), "%s", consulta);
+    char *guardar;
+    int n = 0;
+    for (char *c = strtok_r(copia, ";", &guardar); c; c = strtok_r(NULL, ";", &guardar)) {
+        while (*c == ' ') c++;
+        if (!*c) continue;
+        if (++n > FILTRO_CONDICIONES) {
+            roaring_liberar(&actual);
+            return "Demasiadas condiciones";
+        }
+        size_t largo = strcspn(c, "<>=");
+        int k = faceta_por_nombre(c, largo);
+        const char *p = c + largo;
+        OperadorFiltro op;
+        if (p[0] == '=') op = OP_IGUAL, p += 1;
+        else if (p[0] == '<' && p[1] == '=') op = OP_MENOR_IGUAL, p += 2;
+        else if (p[0] == '>' && p[1] == '=') op = OP_MAYOR_IGUAL, p += 2;
+        else if (p[0] == '<') op = OP_MENOR, p += 1;
+        else if (p[0] == '>') op = OP_MAYOR, p += 1;
+        else k = -1;
+        if (k < 0 || ((k == FACETA_MARCA || k == FACETA_CHIPSET) && op != OP_IGUAL)) {
+            roaring_liberar(&actual);
+            return "Filtro invalido";
+        }
+        if (k == FACETA_MARCA || k == FACETA_PRECIO) {
+            escanear_columnas = true;
+            nada = nada || !escaneo_condicion(a, &q, k, op, p);
+            continue;
+        }
+        Roaring cond;
+        if (!filtro_condicion(a, k, op, p, &cond)) {
+            roaring_liberar(&cond);
+            roaring_liberar(&actual);
+            return "Sin memoria";
+        }
+        if (!filtro_juntar(&actual, &primero, &cond)) return "Sin memoria";
+    }
+    if (escanear_columnas) {
+        Roaring cond = {0};
+        bool ok = true;
+        if (!nada) {
+            uint64_t *mapa = malloc(mapa_palabras(a->n) * sizeof(uint64_t) + 1);
+            if ((ok = mapa != NULL)) {
+                escanear(a->col_marca, a->col_precio, a->n, activo, &q, mapa);
+                ok = roaring_desde_mapa(mapa, mapa_palabras(a->n), &cond);
+            }
+            free(mapa);
+        }
+        if (!ok) {
+            roaring_liberar(&actual);
+            return "Sin memoria";
+        }
+        if (!filtro_juntar(&actual, &primero, &cond)) return "Sin memoria";
+    }
+    FiltroActivos fa = { activo, out, true };
+    roaring_recorrer(primero ? &a->facetas.todos : &actual, filtro_activo_uno, &fa);
+    roaring_liberar(&actual);
+    if (!fa.ok) {
+        roaring_liberar(out);
+        return "Sin memoria";
+    }
+    return NULL;
+}
+
+/* Conteo de un valor de faceta en el resultado */
+typedef struct {
+    int valor;
+    long n;
+} ConteoFaceta;
+
+static int comparar_conteo(const void *x, const void *y) {
+    const ConteoFaceta *a = x, *b = y;
+    if (a->n != b->n) return a->n < b->n ? 1 : -1;
+    return (a->valor > b->valor) - (a->valor < b->valor);
+}
+
+typedef struct {
+    const int *columna;
+    long *cuenta;
+} ContarColumna;
+
+static bool contar_columna_uno(void *ctx, int id) {
+    ContarColumna *cc = ctx;
+    if (cc->columna[id] >= 0) cc->cuenta[cc->columna[id]]++;
+    return true;
+}
+
+/*
+ * Hasta FACETA_VALORES valores de la faceta 'k' con más productos en
+ * 'resultado'. Con pocos valores (marca, RAM, precio...) se interseca el
+ * resultado con el conjunto de cada uno; con muchos (chipset) sale más
+ * barato pasar una vez por la columna.
+ */
+static int faceta_contar(const Almacen *a, int k, const Roaring *resultado, ConteoFaceta out[FACETA_VALORES]) {
+    const Faceta *f = &a->facetas.faceta[k];
+    ConteoFaceta *todos = malloc((size_t)(f->n ? f->n : 1) * sizeof(*todos));
+    if (!todos) return 0;
+    int m = 0;
+    if (f->n > FACETA_POR_CONJUNTOS) {
+        ContarColumna cc = { f->columna, calloc((size_t)f->n, sizeof(long)) };
+        if (cc.cuenta) {
+            roaring_recorrer(resultado, contar_columna_uno, &cc);
+            for (int v = 0; v < f->n; ++v)
+                if (cc.cuenta[v] > 0) todos[m++] = (ConteoFaceta){ v, cc.cuenta[v] };
+            free(cc.cuenta);
+        }
+    } else {
+        for (int v = 0; v < f->n; ++v) {
+            long n = roaring_contar_y(resultado, &f->valores[v].productos);
+            if (n > 0) todos[m++] = (ConteoFaceta){ v, n };
+        }
+    }
+    qsort(todos, (size_t)m, sizeof(*todos), comparar_conteo);
+    if (m > FACETA_VALORES) m = FACETA_VALORES;
+    memcpy(out, todos, (size_t)m * sizeof(*out));
+    free(todos);
+    return m;
+}
+
+/* ---------- Órdenes de GET_MODELS ---------- */
+
+/* Antes o después en el orden 'orden'; el id desempata, así no hay dos iguales */
+static int orden_comparar(const Almacen *a, int orden, int x, int y) {
+    int c = 0;
+    if (orden == ORDEN_PRECIO) {
+        c = (a->col_precio[x] > a->col_precio[y]) - (a->col_precio[x] < a->col_precio[y]);
+    } else if (orden == ORDEN_NOMBRE) {
+        c = strcmp(a->productos[x].modelo, a->productos[y].modelo);
+    }
+    return c ? c : (x > y) - (x < y);
+}
+
+typedef struct {
+    const Almacen *a;
+    int orden;
+} CtxOrden;
+
+static int orden_comparar_qsort(const void *x, const void *y, void *ctx) {
+    const CtxOrden *o = ctx;
+    return orden_comparar(o->a, o->orden, *(const int *)x, *(const int *)y);
+}
+
+/* Permutaciones por precio y por nombre de cada marca; sin memoria quedan en NULL */
+static void marcas_ordenar(Almacen *a) {
+    for (int m = 0; m < a->n_marcas; ++m) {
+        Marca *mc = &a->marcas[m];
+        mc->orden[ORDEN_ARCHIVO] = mc->productos;
+        for (int o = ORDEN_PRECIO; o < N_ORDENES; ++o) {
+            int *p = malloc((size_t)(mc->n ? mc->n : 1) * sizeof(int));
+            if (!p) continue;
+            memcpy(p, mc->productos, (size_t)mc->n * sizeof(int));
+            qsort_r(p, (size_t)mc->n, sizeof(int), orden_comparar_qsort, &(CtxOrden){ a, o });
+            mc->orden[o] = p;
+        }
+    }
+}
+
+/* Almacén vacío con una referencia */
+static Almacen *almacen_nuevo(void) {
+    Almacen *a = calloc(1, sizeof(*a));
+    if (!a) return NULL;
+    a->por_modelo = (IndiceHash){ .clave = clave_modelo, .ctx = a };
+    a->por_marca = (IndiceHash){ .clave = clave_marca, .ctx = a };
+    atomic_init(&a->refs, 1);
+    return a;
+}
+
+static Almacen *almacen_tomar(Almacen *a) {
+    atomic_fetch_add(&a->refs, 1);
+    return a;
+}
+
+/* Con la última referencia libera todo: arena (o snapshot), arreglos e índices */
+static void almacen_soltar(Almacen *a) {
+    if (!a || atomic_fetch_sub(&a->refs, 1) != 1) return;
+    indice_liberar(&a->por_modelo);
+    indice_liberar(&a->por_marca);
+    busqueda_liberar(&a->busqueda);
+    facetas_liberar(&a->facetas);
+    for (int i = 0; i < a->n_marcas; ++i) {
+        free(a->marcas[i].productos);
+        free(a->marcas[i].orden[ORDEN_PRECIO]);
+        free(a->marcas[i].orden[ORDEN_NOMBRE]);
+    }
+    free(a->marcas);
+    free(a->productos);
+    free(a->col_marca);
+    free(a->col_precio);
+    free(a->existencias);
+    arena_liberar(&a->arena);
+    archivo_desmapear(&a->mapa);
+    free(a);
+}
+
+/* Almacén nuevo con el contenido del CSV; NULL si no se pudo leer o no hubo memoria */
+static Almacen *cargar_inventario(const char* filename) {
+    MapaArchivo mapa;
+    if (!archivo_mapear(filename, &mapa)) {
+        perror("inventario");
+        return NULL;
+    }
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    /* marca;modelo;specs;precio;imagen[;existencias] */
+    TrozoCsv trozos[CSV_MAX_HILOS];
+    int n = csv_leer(&mapa, &(TrozoCsv){ .campos = 6, .minimo = 5, .col_precio = 3, .recortar = true }, trozos);
+
+    Almacen *a = almacen_nuevo();
+    size_t filas = 0;
+    bool ok = a != NULL;
+    for (int i = 0; i < n; ++i) {
+        filas += trozos[i].filas;
+        ok = ok && !trozos[i].sin_memoria;
+    }
+    ok = ok && almacen_reservar(a, filas);
+    for (int i = 0; ok && i < n; ++i) {
+        for (size_t r = 0; ok && r < trozos[i].filas; ++r)
+            ok = almacen_agregar(a, trozos[i].celdas + r * 6, trozos[i].precios[r]);
+    }
+    csv_liberar(trozos, n);
+    archivo_desmapear(&mapa);
+    if (!ok) {
+        fprintf(stderr, "inventario: sin memoria\n");
+        almacen_soltar(a);
+        return NULL;
+    }
+    double seg = segundos_desde(&t0);
+    printf("[SERVIDOR] Inventario cargado: %d productos, %d marcas (%zu KB de texto en %zu bloques)\n",
+           a->n, a->n_marcas, a->arena.bytes / 1024, a->arena.bloques);
+    printf("[SERVIDOR] %zu bytes en %.3f s con %d hilo(s): %.0f filas/s\n",
+           mapa.tam, seg, n, seg > 0 ? a->n / seg : 0.0);
+    return a;
+}
+
+/* ---------- CRC32C ---------- */
+
+static uint32_t crc32c_tabla[8][256];
+static pthread_once_t crc32c_una_vez = PTHREAD_ONCE_INIT;
+
+static void crc32c_iniciar(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+        crc32c_tabla[0][i] = c;
+    }
+    for (int t = 1; t < 8; ++t) {
+        for (int i = 0; i < 256; ++i) {
+            uint32_t c = crc32c_tabla[t - 1][i];
+            crc32c_tabla[t][i] = (c >> 8) ^ crc32c_tabla[0][c & 0xff];
+        }
+    }
+}
+
+/* Continúa el CRC32C 'crc' (0 al empezar) con 'n' bytes; ocho bytes por paso */
+static uint32_t crc32c(uint32_t crc, const void *datos, size_t n) {
+    pthread_once(&crc32c_una_vez, crc32c_iniciar);
+    const unsigned char *p = datos;
+    crc = ~crc;
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;               /* little-endian */
+        crc = crc32c_tabla[7][v & 0xff] ^ crc32c_tabla[6][(v >> 8) & 0xff]
+            ^ crc32c_tabla[5][(v >> 16) & 0xff] ^ crc32c_tabla[4][(v >> 24) & 0xff]
+            ^ crc32c_tabla[3][(v >> 32) & 0xff] ^ crc32c_tabla[2][(v >> 40) & 0xff]
+            ^ crc32c_tabla[1][(v >> 48) & 0xff] ^ crc32c_tabla[0][v >> 56];
+        p += 8;
+        n -= 8;
+    }
+    while (n--) crc = crc32c_tabla[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* ---------- Claves (yescrypt) y pool de autenticación ---------- */
+
+/*
+ * Las claves se guardan como hash yescrypt de libcrypt ("$y$..."), caro en
+ * CPU y memoria a propósito (unos 20 ms por verificación). Ese trabajo
+ * corre solo en un pool aparte de --hilos-auth hilos con una cola acotada
+ * (--cola-auth): una ola de LOGIN ocupa esos hilos y no los que atienden
+ * GET_MODELS o CHECKOUT, y con la cola llena la respuesta es "ERROR|BUSY"
+ * al momento. Las filas viejas en texto plano siguen sirviendo para entrar
+ * mientras un hilo de prioridad baja las pasa a hash.
+ */
+#define CLAVE_PREFIJO "$y$"
+#define CLAVE_COSTO   0             /* 0: el que recomienda libcrypt */
+#define CLAVE_MAX     CRYPT_OUTPUT_SIZE
+#define AUTH_COLA     256           /* trabajos en espera por omisión */
+#define AUTH_NICE     5             /* con CPU escasa, los demás comandos pasan primero */
+#define MIGRAR_NICE   19
+
+typedef struct {
+    void (*fn)(void *);
+    void *arg;
+    struct timespec encolado;
+} TrabajoAuth;
+
+static struct {
+    int hilos;
+    int cap;                        /* --cola-auth */
+    TrabajoAuth *cola;              /* anillo de 'cap' trabajos */
+    int ini, len;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /* métricas para STATS, sin el mutex */
+    atomic_int en_cola;
+    atomic_int max_en_cola;
+    atomic_ulong rechazados;
+    atomic_ulong atendidos;
+    atomic_ulong espera_ns;         /* suma del tiempo en cola */
+    atomic_ulong verificaciones;
+    atomic_ulong verif_ns;          /* suma */
+    atomic_ulong verif_ns_max;
+} auth = { .cap = AUTH_COLA, .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static __thread bool hilo_auth;
+static char clave_ficticia[CLAVE_MAX];      /* usuarios inexistentes: misma demora que uno real */
+
+static uint64_t ns_desde(const struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (uint64_t)((t1.tv_sec - t0->tv_sec) * 1000000000LL + (t1.tv_nsec - t0->tv_nsec));
+}
+
+static void maximo_atomico(atomic_ulong *m, unsigned long v) {
+    unsigned long actual = atomic_load(m);
+    while (v > actual && !atomic_compare_exchange_weak(m, &actual, v)) {}
+}
+
+static bool clave_es_hash(const char *guardada) {
+    return strncmp(guardada, CLAVE_PREFIJO, strlen(CLAVE_PREFIJO)) == 0
+           && crypt_checksalt(guardada) == CRYPT_SALT_OK;
+}
+
+/* Sin salida anticipada: la demora no dice cuántos bytes coinciden */
+static bool igual_tiempo_fijo(const char *a, const char *b) {
+    size_t na = strlen(a), nb = strlen(b);
+    unsigned char d = na != nb;
+    for (size_t i = 0; i < na; ++i) d |= (unsigned char)(a[i] ^ b[nb ? i % nb : 0]);
+    return d == 0;
+}
+
+/* 32 KB de trabajo de libcrypt; solo los hilos que calculan hashes lo piden */
+static struct crypt_data *clave_area(void) {
+    static __thread struct crypt_data *datos;
+    if (!datos) datos = calloc(1, sizeof(*datos));
+    return datos;
+}
+
+/* Hash con sal aleatoria en 'out' (CLAVE_MAX bytes) */
+static bool clave_hash(const char *clave, char *out) {
+    char sal[CRYPT_GENSALT_OUTPUT_SIZE];
+    struct crypt_data *d = clave_area();
+    if (!d || !crypt_gensalt_rn(CLAVE_PREFIJO, CLAVE_COSTO, NULL, 0, sal, sizeof(sal))) return false;
+    const char *h = crypt_rn(clave, sal, d, sizeof(*d));
+    size_t n = h ? strlen(h) : 0;
+    if (n == 0 || n >= CLAVE_MAX || h[0] == '*') return false;
+    memcpy(out, h, n + 1);
+    return true;
+}
+
+/* 'clave' contra lo guardado: un hash o, en filas aún sin migrar, el texto plano */
+static bool clave_verificar(const char *guardada, const char *clave) {
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    bool ok;
+    if (clave_es_hash(guardada)) {
+        struct crypt_data *d = clave_area();
+        const char *h = d ? crypt_rn(clave, guardada, d, sizeof(*d)) : NULL;
+        ok = h && igual_tiempo_fijo(h, guardada);
+    } else {
+        ok = igual_tiempo_fijo(guardada, clave);
+    }
+    uint64_t ns = ns_desde(&t0);
+    atomic_fetch_add(&auth.verificaciones, 1);
+    atomic_fetch_add(&auth.verif_ns, ns);
+    maximo_atomico(&auth.verif_ns_max, ns);
+    return ok;
+}
+
+static void *hilo_auth_main(void *arg) {
+    (void)arg;
+    hilo_auth = true;
+    if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), AUTH_NICE) != 0) perror("[SERVIDOR] setpriority");
+    for (;;) {
+        pthread_mutex_lock(&auth.mutex);
+        while (auth.len == 0) pthread_cond_wait(&auth.cond, &auth.mutex);
+        TrabajoAuth t = auth.cola[auth.ini];
+        auth.ini = (auth.ini + 1) % auth.cap;
+        auth.len--;
+        atomic_store(&auth.en_cola, auth.len);
+        pthread_mutex_unlock(&auth.mutex);
+        atomic_fetch_add(&auth.atendidos, 1);
+        atomic_fetch_add(&auth.espera_ns, ns_desde(&t.encolado));
+        t.fn(t.arg);
+    }
+    return NULL;
+}
+
+/* Encola sin esperar; false con la cola llena (quien llama responde BUSY) */
+static bool auth_enviar(void (*fn)(void *), void *arg) {
+    TrabajoAuth t = { .fn = fn, .arg = arg };
+    clock_gettime(CLOCK_MONOTONIC, &t.encolado);
+    pthread_mutex_lock(&auth.mutex);
+    bool ok = auth.len < auth.cap;
+    if (ok) {
+        auth.cola[(auth.ini + auth.len) % auth.cap] = t;
+        auth.len++;
+        atomic_store(&auth.en_cola, auth.len);
+        if (auth.len > atomic_load(&auth.max_en_cola)) atomic_store(&auth.max_en_cola, auth.len);
+        pthread_cond_signal(&auth.cond);
+    }
+    pthread_mutex_unlock(&auth.mutex);
+    if (!ok) atomic_fetch_add(&auth.rechazados, 1);
+    return ok;
+}
+
+/* Verificación (guardada != NULL) o hash nuevo en 'hash', resuelto por el pool */
+typedef struct {
+    const char *clave;
+    const char *guardada;
+    char *hash;
+    bool ok;
+    sem_t listo;
+} PedidoClave;
+
+static bool pedido_resolver(PedidoClave *p) {
+    return p->guardada ? clave_verificar(p->guardada, p->clave) : clave_hash(p->clave, p->hash);
+}
+
+static void pedido_clave_ejecutar(void *arg) {
+    PedidoClave *p = arg;
+    p->ok = pedido_resolver(p);
+    sem_post(&p->listo);
+}
+
+/*
+ * Pasa el pedido al pool y espera el resultado (en un hilo del pool se
+ * resuelve aquí mismo). Devuelve 1 si la clave coincide o el hash quedó
+ * listo, 0 si no y -1 con la cola llena.
+ */
+static int auth_pedir(const char *clave, const char *guardada, char *hash) {
+    PedidoClave p = { .clave = clave, .guardada = guardada, .hash = hash };
+    if (hilo_auth) return pedido_resolver(&p);
+    sem_init(&p.listo, 0, 0);
+    int res = -1;
+    if (auth_enviar(pedido_clave_ejecutar, &p)) {
+        while (sem_wait(&p.listo) != 0 && errno == EINTR) {}
+        res = p.ok;
+    }
+    sem_destroy(&p.listo);
+    return res;
+}
+
+static void auth_iniciar(int hilos, int cola) {
+    auth.hilos = hilos;
+    auth.cap = cola;
+    auth.cola = calloc((size_t)cola, sizeof(*auth.cola));
+    /* una clave que nadie conoce: LOGIN de un usuario inexistente cuesta lo mismo */
+    unsigned char azar[16];
+    char texto[2 * sizeof(azar) + 1];
+    if (!auth.cola || getrandom(azar, sizeof(azar), 0) != (ssize_t)sizeof(azar)) {
+        perror("auth");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < sizeof(azar); ++i) sprintf(texto + 2 * i, "%02x", azar[i]);
+    if (!clave_hash(texto, clave_ficticia)) {
+        perror("[SERVIDOR] yescrypt");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < hilos; ++i) {
+        pthread_t h;
+        if (pthread_create(&h, NULL, hilo_auth_main, NULL) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(h);
+    }
+    printf("[SERVIDOR] Pool de autenticación: %d hilos, cola de %d\n", hilos, cola);
+}
+
+static bool es_credencial(const char *cmd) {
+    return strncmp(cmd, "LOGIN:", 6) == 0 || strncmp(cmd, "REGISTER:", 9) == 0;
+}
+
+/* ---------- Registro de escritura anticipada (WAL) ---------- */
+
+/*
+ * Cada cambio (REMOVE_PRODUCT, REGISTER, rol de admin) se agrega a
+ * Tienda.wal como un registro con CRC32C en vez de reescribir el CSV. Los
+ * registros se encolan sin locks y un hilo escritor los saca por lotes:
+ * un writev() y un fdatasync por lote, no por cambio. Cada cliente espera
+ * a que su lote quede en disco antes de responder; REGISTER espera fuera
+ * de datos_lock para que las altas concurrentes caigan en el mismo lote.
+ * Con --espera-lote el escritor deja pasar unos microsegundos antes de
+ * cada lote para juntar más registros (más latencia, menos fsyncs); con
+ * --durabilidad diferida responde apenas el lote se escribió y sincroniza
+ * cada WAL_DIFERIDA_MS (una caída del sistema puede perder ese intervalo,
+ * una caída del proceso no).
+ * Un checkpoint periódico pasa el estado a los CSV: escribe temporales,
+ * agrega un registro CHECKPOINT, los renombra encima y vacía el WAL. Al
+ * arrancar, si el último CHECKPOINT quedó sin renombrar se completa, y los
+ * registros que lo siguen se vuelven a aplicar sobre los CSV.
+ */
+#define WAL_CHECKPOINT_BYTES (1 << 20)  /* checkpoint al pasar este tamaño */
+#define WAL_CHECKPOINT_SEG   60         /* o cada tanto si hay algo pendiente */
+#define WAL_LOTE_MAX         64         /* registros por writev() */
+#define WAL_DIFERIDA_MS      100        /* fsync periódico con --durabilidad diferida */
+#define INVENTARIO_TMP INVENTARIO_FILE ".tmp"
+#define USUARIOS_TMP   USUARIOS_FILE ".tmp"
+
+typedef enum {
+    WAL_QUITAR_PRODUCTO = 1,    /* modelo */
+    WAL_ALTA_USUARIO,           /* usuario, clave, rol */
+    WAL_ROL_USUARIO,            /* usuario, rol */
+    WAL_CHECKPOINT,             /* los temporales ya están completos */
+    WAL_RECARGA_INVENTARIO,     /* se publicó un CSV nuevo: las bajas previas ya no cuentan */
+    WAL_VENTA,                  /* modelo, cantidad...: ventas de antes de WAL_PEDIDO */
+    WAL_CLAVE_USUARIO,          /* usuario, hash que reemplaza a la clave en texto plano */
+    WAL_PEDIDO,                 /* pedido, fecha, usuario, método, marca, modelo, precio... */
+} TipoWal;
+
+typedef struct {
+    uint32_t crc;               /* de lo que sigue: largo, tipo y datos */
+    uint32_t largo;             /* bytes de datos: cadenas terminadas en '\0' */
+    uint32_t tipo;
+    uint32_t reservado;
+} CabeceraWal;
+
+enum { WAL_PENDIENTE, WAL_CONFIRMADO, WAL_FALLIDO };
+
+/* Registro encolado para el escritor; lo libera quien lo espera */
+typedef struct NodoWal {
+    _Atomic(struct NodoWal *) sig;
+    int estado;                 /* WAL_PENDIENTE/...; con wal.mutex */
+    bool forzar;                /* durable aunque la durabilidad sea diferida */
+    size_t largo;
+    char *datos;                /* CabeceraWal y cadenas, a continuación del nodo */
+} NodoWal;
+
+static struct {
+    int fd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;            /* lotes confirmados */
+    pthread_cond_t cond_escritor;   /* hay registros en cola */
+    /* cola MPSC intrusiva: los productores solo hacen un exchange */
+    _Atomic(NodoWal *) cola_fin;
+    NodoWal *cola_ini;              /* solo el escritor */
+    NodoWal tapon;
+    atomic_long en_cola;
+    atomic_int escritor_dormido;
+    uint64_t escrito;           /* bytes agregados desde el arranque (no vuelve a 0) */
+    uint64_t durable;           /* de ellos, cubiertos por un fdatasync */
+    uint64_t tam;               /* tamaño actual del archivo */
+    atomic_bool error;          /* falló una escritura o un fsync: no se aceptan más cambios */
+    bool diferida;              /* --durabilidad diferida */
+    int espera_lote_us;         /* --espera-lote */
+    atomic_ulong registros;
+    atomic_ulong fsyncs;
+    atomic_ulong lotes;
+} wal = { .fd = -1, .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER,
+          .cond_escritor = PTHREAD_COND_INITIALIZER };
+
+static uint32_t wal_crc(const CabeceraWal *h, const void *datos) {
+    return crc32c(crc32c(0, &h->largo, sizeof(*h) - sizeof(h->crc)), datos, h->largo);
+}
+
+/* Valida el registro en *p; lo deja en 'h'/'datos' y avanza *p. false al final o si está dañado */
+static bool wal_siguiente(const char **p, const char *fin, CabeceraWal *h, const char **datos) {
+    if ((size_t)(fin - *p) < sizeof(*h)) return false;
+    memcpy(h, *p, sizeof(*h));
+    if (h->largo > (size_t)(fin - *p) - sizeof(*h)) return false;
+    *datos = *p + sizeof(*h);
+    if (wal_crc(h, *datos) != h->crc) return false;
+    if (h->largo > 0 && (*datos)[h->largo - 1] != '\0') return false;
+    *p = *datos + h->largo;
+    return true;
+}
+
+static void wal_encolar(NodoWal *n) {
+    atomic_store_explicit(&n->sig, NULL, memory_order_relaxed);
+    NodoWal *previo = atomic_exchange(&wal.cola_fin, n);
+    /* hasta este store el nodo no es visible desde cola_ini */
+    atomic_store_explicit(&previo->sig, n, memory_order_release);
+}
+
+/* Saca el nodo más antiguo; solo el escritor, y sabiendo por en_cola que hay uno */
+static NodoWal *wal_desencolar(void) {
+    for (;;) {
+        NodoWal *ini = wal.cola_ini;
+        NodoWal *sig = atomic_load_explicit(&ini->sig, memory_order_acquire);
+        if (ini == &wal.tapon) {
+            if (sig) {
+                wal.cola_ini = ini = sig;
+                sig = atomic_load_explicit(&ini->sig, memory_order_acquire);
+            }
+        }
+        if (ini != &wal.tapon) {
+            if (sig) {
+                wal.cola_ini = sig;
+                return ini;
+            }
+            if (ini == atomic_load(&wal.cola_fin)) {
+                /* el último no se puede soltar sin otro detrás: se reencola el tapón */
+                wal_encolar(&wal.tapon);
+                sig = atomic_load_explicit(&ini->sig, memory_order_acquire);
+                if (sig) {
+                    wal.cola_ini = sig;
+                    return ini;
+                }
+            }
+        }
+        /* un productor ya hizo el exchange pero aún no enlazó su nodo */
+        sched_yield();
+    }
+}
+
+/* Arma un registro con 'n' cadenas y lo encola sin esperar; NULL si no se puede */
+static NodoWal *wal_agregar(TipoWal tipo, const char *const *campos, int n) {
+    if (atomic_load(&wal.error) || wal.fd < 0) return NULL;
+    CabeceraWal h = { .tipo = (uint32_t)tipo };
+    size_t largo = 0;
+    for (int i = 0; i < n; ++i) largo += strlen(campos[i]) + 1;
+    if (largo > UINT32_MAX) return NULL;
+    NodoWal *nodo = malloc(sizeof(*nodo) + sizeof(h) + largo);
+    if (!nodo) return NULL;
+    nodo->estado = WAL_PENDIENTE;
+    nodo->forzar = tipo == WAL_CHECKPOINT;
+    nodo->largo = sizeof(h) + largo;
+    nodo->datos = (char *)(nodo + 1);
+    char *q = nodo->datos + sizeof(h);
+    for (int i = 0; i < n; ++i) {
+        size_t k = strlen(campos[i]) + 1;
+        memcpy(q, campos[i], k);
+        q += k;
+    }
+    h.largo = (uint32_t)largo;
+    h.crc = wal_crc(&h, nodo->datos + sizeof(h));
+    memcpy(nodo->datos, &h, sizeof(h));
+
+    wal_encolar(nodo);
+    atomic_fetch_add(&wal.en_cola, 1);
+    if (atomic_load(&wal.escritor_dormido)) {
+        pthread_mutex_lock(&wal.mutex);
+        pthread_cond_signal(&wal.cond_escritor);
+        pthread_mutex_unlock(&wal.mutex);
+    }
+    return nodo;
+}
+
+/* Espera la confirmación de su lote y libera el nodo */
+static bool wal_esperar(NodoWal *nodo) {
+    pthread_mutex_lock(&wal.mutex);
+    while (nodo->estado == WAL_PENDIENTE) pthread_cond_wait(&wal.cond, &wal.mutex);
+    bool ok = nodo->estado == WAL_CONFIRMADO;
+    pthread_mutex_unlock(&wal.mutex);
+    free(nodo);
+    return ok;
+}
+
+/* Agrega un registro y vuelve cuando está confirmado (la marca de checkpoint, siempre en disco) */
+static bool wal_registrar(TipoWal tipo, const char *const *campos, int n) {
+    NodoWal *nodo = wal_agregar(tipo, campos, n);
+    return nodo && wal_esperar(nodo);
+}
+
+static bool wal_fdatasync(void) {
+    atomic_fetch_add(&wal.fsyncs, 1);
+    if (fdatasync(wal.fd) == 0) return true;
+    perror("[SERVIDOR] wal fdatasync");
+    atomic_store(&wal.error, true);
+    return false;
+}
+
+/* Un writev() y, salvo durabilidad diferida, un fdatasync para todo el lote */
+static void wal_escribir_lote(NodoWal **lote, struct iovec *iov, int n) {
+    bool ok = !atomic_load(&wal.error);
+    bool forzar = !wal.diferida;
+    size_t hecho = 0;
+    for (int i = 0; i < n; ++i) forzar |= lote[i]->forzar;
+    int k = 0;
+    while (ok && k < n) {
+        ssize_t w = writev(wal.fd, iov + k, n - k > IOV_MAX ? IOV_MAX : n - k);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            perror("[SERVIDOR] wal writev");
+            /* un registro a medias quedaría antes de los siguientes */
+            atomic_store(&wal.error, true);
+            ok = false;
+            break;
+        }
+        hecho += (size_t)w;
+        for (size_t resto = (size_t)w; resto > 0;) {
+            if (resto >= iov[k].iov_len) {
+                resto -= iov[k].iov_len;
+                k++;
+            } else {
+                iov[k].iov_base = (char *)iov[k].iov_base + resto;
+                iov[k].iov_len -= resto;
+                resto = 0;
+            }
+        }
+    }
+    if (ok && forzar) ok = wal_fdatasync();
+    atomic_fetch_add(&wal.lotes, 1);
+    if (ok) atomic_fetch_add(&wal.registros, (unsigned long)n);
+
+    pthread_mutex_lock(&wal.mutex);
+    wal.tam += hecho;
+    wal.escrito += hecho;
+    if (ok && forzar) wal.durable = wal.escrito;
+    for (int i = 0; i < n; ++i) lote[i]->estado = ok ? WAL_CONFIRMADO : WAL_FALLIDO;
+    pthread_cond_broadcast(&wal.cond);
+    pthread_mutex_unlock(&wal.mutex);
+}
+
+/* Duerme hasta que haya registros; en modo diferido despierta para el fsync pendiente */
+static void wal_escritor_esperar(struct timespec *ultimo_fsync) {
+    pthread_mutex_lock(&wal.mutex);
+    atomic_store(&wal.escritor_dormido, 1);
+    while (atomic_load(&wal.en_cola) == 0) {
+        if (wal.durable == wal.escrito || atomic_load(&wal.error)) {
+            pthread_cond_wait(&wal.cond_escritor, &wal.mutex);
+            continue;
+        }
+        struct timespec limite;
+        clock_gettime(CLOCK_REALTIME, &limite);
+        long ms = WAL_DIFERIDA_MS - (long)(segundos_desde(ultimo_fsync) * 1000);
+        if (ms > 0) {
+            limite.tv_sec += ms / 1000;
+            limite.tv_nsec += (ms % 1000) * 1000000L;
+            if (limite.tv_nsec >= 1000000000L) {
+                limite.tv_sec++;
+                limite.tv_nsec -= 1000000000L;
+            }
+            if (pthread_cond_timedwait(&wal.cond_escritor, &wal.mutex, &limite) != ETIMEDOUT) continue;
+        }
+        uint64_t objetivo = wal.escrito;
+        pthread_mutex_unlock(&wal.mutex);
+        bool ok = wal_fdatasync();
+        clock_gettime(CLOCK_MONOTONIC, ultimo_fsync);
+        pthread_mutex_lock(&wal.mutex);
+        if (ok) wal.durable = objetivo;
+    }
+    atomic_store(&wal.escritor_dormido, 0);
+    pthread_mutex_unlock(&wal.mutex);
+}
+
+static void *wal_escritor(void *arg) {
+    (void)arg;
+    NodoWal *lote[WAL_LOTE_MAX];
+    struct iovec iov[WAL_LOTE_MAX];
+    struct timespec ultimo_fsync;
+    clock_gettime(CLOCK_MONOTONIC, &ultimo_fsync);
+    for (;;) {
+        if (atomic_load(&wal.en_cola) == 0) wal_escritor_esperar(&ultimo_fsync);
+        /* ventana para que más registros entren en este lote */
+        if (wal.espera_lote_us > 0) usleep((useconds_t)wal.espera_lote_us);
+        int n = 0;
+        while (n < WAL_LOTE_MAX && atomic_load(&wal.en_cola) > 0) {
+            lote[n] = wal_desencolar();
+            atomic_fetch_sub(&wal.en_cola, 1);
+            iov[n].iov_base = lote[n]->datos;
+            iov[n].iov_len = lote[n]->largo;
+            n++;
+        }
+        wal_escribir_lote(lote, iov, n);
+        if (wal.diferida && segundos_desde(&ultimo_fsync) * 1000 >= WAL_DIFERIDA_MS) {
+            pthread_mutex_lock(&wal.mutex);
+            uint64_t objetivo = wal.escrito;
+            bool pendiente = wal.durable < objetivo && !atomic_load(&wal.error);
+            pthread_mutex_unlock(&wal.mutex);
+            if (pendiente && wal_fdatasync()) {
+                pthread_mutex_lock(&wal.mutex);
+                wal.durable = objetivo;
+                pthread_mutex_unlock(&wal.mutex);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &ultimo_fsync);
+        }
+    }
+    return NULL;
+}
+
+static void wal_iniciar_escritor(void) {
+    wal.cola_ini = &wal.tapon;
+    atomic_store(&wal.tapon.sig, NULL);
+    atomic_store(&wal.cola_fin, &wal.tapon);
+    pthread_t hilo;
+    if (pthread_create(&hilo, NULL, wal_escritor, NULL) != 0) {
+        perror("[SERVIDOR] escritor del WAL");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(hilo);
+}
+
+static bool sincronizar_directorio(void) {
+    int fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+/*
+ * Abre el WAL y lo deja consistente con los CSV: completa un checkpoint
+ * interrumpido o descarta sus temporales, y corta una cola dañada. Va antes
+ * de cargar los CSV.
+ */
+static void wal_abrir(void) {
+    wal.fd = open(WAL_FILE, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    MapaArchivo m;
+    if (wal.fd < 0 || !archivo_mapear(WAL_FILE, &m)) {
+        perror("[SERVIDOR] " WAL_FILE);
+        exit(EXIT_FAILURE);
+    }
+    const char *p = m.datos, *fin = m.datos + m.tam, *datos;
+    const char *tras_checkpoint = NULL;
+    CabeceraWal h;
+    while (wal_siguiente(&p, fin, &h, &datos)) {
+        if (h.tipo == WAL_CHECKPOINT) tras_checkpoint = p;
+    }
+    uint64_t valido = (uint64_t)(p - m.datos);
+    if (tras_checkpoint) {
+        /* los temporales estaban completos: si no se alcanzaron a renombrar, se hace ahora */
+        bool renombrado = false;
+        if (access(INVENTARIO_TMP, F_OK) == 0) renombrado |= rename(INVENTARIO_TMP, INVENTARIO_FILE) == 0;
+        if (access(USUARIOS_TMP, F_OK) == 0) renombrado |= rename(USUARIOS_TMP, USUARIOS_FILE) == 0;
+        if (renombrado) printf("[SERVIDOR] Checkpoint interrumpido completado\n");
+        /* sin la marca, para que un checkpoint posterior a medias no parezca completo */
+        const char *tmp = WAL_FILE ".tmp";
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        size_t resto = (size_t)(p - tras_checkpoint);
+        if (fd < 0 || write(fd, tras_checkpoint, resto) != (ssize_t)resto || fsync(fd) != 0
+            || rename(tmp, WAL_FILE) != 0 || !sincronizar_directorio()) {
+            perror("[SERVIDOR] " WAL_FILE);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        close(wal.fd);
+        wal.fd = open(WAL_FILE, O_RDWR | O_APPEND | O_CLOEXEC);
+        if (wal.fd < 0) {
+            perror("[SERVIDOR] " WAL_FILE);
+            exit(EXIT_FAILURE);
+        }
+        archivo_desmapear(&m);
+        wal.escrito = wal.durable = wal.tam = resto;
+        return;
+    } else {
+        unlink(INVENTARIO_TMP);
+        unlink(USUARIOS_TMP);
+    }
+    if (valido < m.tam) {
+        fprintf(stderr, "[SERVIDOR] %s: se descartan %llu bytes dañados al final\n",
+                WAL_FILE, (unsigned long long)(m.tam - valido));
+        if (ftruncate(wal.fd, (off_t)valido) != 0 || fsync(wal.fd) != 0) {
+            perror("[SERVIDOR] " WAL_FILE);
+            exit(EXIT_FAILURE);
+        }
+    }
+    archivo_desmapear(&m);
+    wal.escrito = wal.durable = wal.tam = valido;
+}
+
+/* Vacía el WAL tras un checkpoint; con todos los que escriben detenidos */
+static bool wal_truncar(void) {
+    pthread_mutex_lock(&wal.mutex);
+    bool ok = ftruncate(wal.fd, 0) == 0 && fsync(wal.fd) == 0;
+    if (ok) wal.tam = 0;
+    else atomic_store(&wal.error, true);    /* la marca de checkpoint seguiría en el archivo */
+    pthread_mutex_unlock(&wal.mutex);
+    return ok;
+}
+
+typedef struct Inventario Inventario;
+static bool producto_activo(const Inventario *inv, int id);
+static const Almacen *inventario_almacen(const Inventario *inv);
+
+/* Productos activos de 'inv' en formato CSV (checkpoint del WAL) */
+static void escribir_inventario(FILE *f, const void *arg) {
+    const Inventario *inv = arg;
+    const Almacen *a = inventario_almacen(inv);
+    for (int i = 0; i < a->n; ++i) {
+        if (!producto_activo(inv, i)) continue;
+        fprintf(f, "%s;%s;%s;%.2f;%s",
+                producto_marca(a, i),
+                a->productos[i].modelo,
+                a->productos[i].specs,
+                a->col_precio[i],
+                a->productos[i].imagen);
+        int e = atomic_load(&a->existencias[i]);
+        if (e == SIN_LIMITE) fputc('\n', f);
+        else fprintf(f, ";%d\n", e);
+    }
+}
+
+/* Espacio para un usuario más */
+static bool usuarios_reservar(void) {
+    if (usuarios_size < usuarios_cap) return true;
+    int cap = usuarios_cap ? usuarios_cap * 2 : 128;
+    Usuario *p = realloc(usuarios, (size_t)cap * sizeof(*p));
+    if (!p) return false;
+    usuarios = p;
+    usuarios_cap = cap;
+    return true;
+}
+
+/* Agrega un usuario leído de disco; toma posesión de las cadenas (liberadas si falla) */
+static bool usuario_cargar(char *user, char *pass, char *role) {
+    if (!user || !pass || !role || !usuarios_reservar()) {
+        free(user);
+        free(pass);
+        free(role);
+        return false;
+    }
+    usuarios[usuarios_size].username = user;
+    usuarios[usuarios_size].password = pass;
+    usuarios[usuarios_size].role = role;
+    usuarios[usuarios_size].is_admin = (strcmp(role, "admin") == 0);
+    /* con nombres repetidos gana la primera línea, como antes */
+    if (indice_buscar(&indice_usuarios, user) < 0) indice_insertar(&indice_usuarios, usuarios_size);
+    usuarios_size++;
+    return true;
+}
+
+static char *campo_dup(Campo c) {
+    c = campo_recortar(c);
+    return strndup(c.p ? c.p : "", c.n);
+}
+
+static bool campo_es(Campo c, const char *s) {
+    return c.p && strlen(s) == c.n && memcmp(c.p, s, c.n) == 0;
+}
+
+static void cargar_usuarios(const char *filename) {
+    MapaArchivo mapa;
+    usuarios_size = 0;
+    if (!archivo_mapear(filename, &mapa)) {
+        fprintf(stderr, "[SERVIDOR] Advertencia: no se pudo abrir %s; sin usuarios precargados.\n", filename);
+        return;
+    }
+    /* usuario;clave[;rol] */
+    TrozoCsv trozos[CSV_MAX_HILOS];
+    int n = csv_leer(&mapa, &(TrozoCsv){ .campos = 3, .minimo = 2, .col_precio = -1 }, trozos);
+    for (int i = 0; i < n; ++i) {
+        for (size_t r = 0; r < trozos[i].filas; ++r) {
+            const Campo *c = trozos[i].celdas + r * 3;
+            char *user_dup = campo_dup(c[0]);
+            char *pass_dup = campo_dup(c[1]);
+            char *role_dup = NULL;
+            if (c[2].p) {
+                role_dup = campo_dup(c[2]);
+            } else {
+                const char *fallback = campo_es(c[0], "admin") ? "admin" : "cliente";
+                role_dup = strdup(fallback);
+            }
+            if (!user_dup || !pass_dup || !role_dup) {
+                free(user_dup);
+                free(pass_dup);
+                free(role_dup);
+                continue;
+            }
+
+            if (*role_dup == '\0' && strcmp(user_dup, "admin") == 0) {
+                free(role_dup);
+                role_dup = strdup("admin");
+            } else if (*role_dup == '\0') {
+                free(role_dup);
+                role_dup = strdup("cliente");
+            }
+
+            if (!usuario_cargar(user_dup, pass_dup, role_dup)) break;
+        }
+    }
+    csv_liberar(trozos, n);
+    archivo_desmapear(&mapa);
+    printf("[SERVIDOR] Usuarios cargados: %d\n", usuarios_size);
+}
+
+static Usuario *find_usuario(const char *username) {
+    int id = indice_buscar(&indice_usuarios, username);
+    return id >= 0 ? &usuarios[id] : NULL;
+}
+
+/* 'password' es lo que se guarda: el hash (o el texto plano de un WAL viejo). Solo en memoria. */
+static bool add_user(const char *username, const char *password, const char *role) {
+    if (find_usuario(username)) return false;
+    if (!usuarios_reservar() || !indice_reservar(&indice_usuarios)) return false;
+
+    char *user_dup = strdup(username);
+    char *pass_dup = strdup(password);
+    char *role_dup = strdup(role);
+    if (!user_dup || !pass_dup || !role_dup) {
+        free(user_dup);
+        free(pass_dup);
+        free(role_dup);
+        return false;
+    }
+
+    usuarios[usuarios_size].username = user_dup;
+    usuarios[usuarios_size].password = pass_dup;
+    usuarios[usuarios_size].role = role_dup;
+    usuarios[usuarios_size].is_admin = (strcmp(role_dup, "admin") == 0);
+    indice_insertar(&indice_usuarios, usuarios_size);   /* ya reservado */
+    usuarios_size++;
+    return true;
+}
+
+/*
+ * Altas cuyo registro está en el WAL esperando su lote. El nombre queda
+ * apartado (nadie más lo registra) pero la cuenta no se publica: LOGIN y
+ * RESUME no la ven hasta que el lote está en disco. El checkpoint las
+ * escribe en el CSV, porque su registro va antes que la marca. Con
+ * datos_lock; cada nodo vive en la pila de quien da el alta.
+ */
+typedef struct AltaEnCurso {
+    const char *usuario, *clave, *rol;
+    struct AltaEnCurso *sig;
+} AltaEnCurso;
+
+static AltaEnCurso *altas_en_curso;
+
+static bool alta_en_curso(const char *username) {
+    for (const AltaEnCurso *a = altas_en_curso; a; a = a->sig) {
+        if (strcmp(a->usuario, username) == 0) return true;
+    }
+    return false;
+}
+
+enum { ALTA_OK, ALTA_EXISTE, ALTA_ERROR };
+
+/* Alta durable: WAL, espera del lote fuera de datos_lock y recién entonces a memoria */
+static int usuario_alta(const char *username, const char *password, const char *role) {
+    AltaEnCurso alta = { username, password, role, NULL };
+    pthread_rwlock_wrlock(&datos_lock);
+    if (find_usuario(username) || alta_en_curso(username)) {
+        pthread_rwlock_unlock(&datos_lock);
+        return ALTA_EXISTE;
+    }
+    /* lo que falle por memoria, que falle antes de escribir el registro */
+    NodoWal *nodo = usuarios_reservar() && indice_reservar(&indice_usuarios)
+                    ? wal_agregar(WAL_ALTA_USUARIO, (const char *[]){ username, password, role }, 3) : NULL;
+    if (nodo) {
+        alta.sig = altas_en_curso;
+        altas_en_curso = &alta;
+    }
+    pthread_rwlock_unlock(&datos_lock);
+    if (!nodo) return ALTA_ERROR;
+
+    /* las altas concurrentes caen en el mismo lote */
+    bool durable = wal_esperar(nodo);
+    pthread_rwlock_wrlock(&datos_lock);
+    AltaEnCurso **q = &altas_en_curso;
+    while (*q != &alta) q = &(*q)->sig;
+    *q = alta.sig;
+    bool publicada = durable && add_user(username, password, role);
+    pthread_rwlock_unlock(&datos_lock);
+    if (durable && !publicada)
+        fprintf(stderr, "[SERVIDOR] Alta de %s en el WAL sin memoria para publicarla; se verá al reiniciar\n", username);
+    return publicada ? ALTA_OK : ALTA_ERROR;
+}
+
+/* Todos los usuarios en formato CSV (checkpoint del WAL) */
+static void escribir_usuarios(FILE *f, const void *arg) {
+    (void)arg;
+    for (int i = 0; i < usuarios_size; ++i) {
+        fprintf(f, "%s;%s;%s\n",
+                usuarios[i].username,
+                usuarios[i].password,
+                usuarios[i].role ? usuarios[i].role : "cliente");
+    }
+    for (const AltaEnCurso *a = altas_en_curso; a; a = a->sig) fprintf(f, "%s;%s;%s\n", a->usuario, a->clave, a->rol);
+}
+
+/* Cambia el rol guardado en memoria; 'rol' se copia */
+static bool usuario_cambiar_rol(Usuario *u, const char *rol) {
+    char *new_role = strdup(rol);
+    if (!new_role) return false;
+    free(u->role);
+    u->role = new_role;
+    u->is_admin = strcmp(rol, "admin") == 0;
+    return true;
+}
+
+static void ensure_default_admin(void) {
+    Usuario *admin = find_usuario("admin");
+    if (admin) {
+        if (!admin->is_admin) {
+            if (!wal_registrar(WAL_ROL_USUARIO, (const char *[]){ "admin", "admin" }, 2)
+                || !usuario_cambiar_rol(admin, "admin"))
+                return;
+            printf("[SERVIDOR] Cuenta admin actualizada con privilegios.\n");
+        }
+        return;
+    }
+    char hash[CLAVE_MAX];
+    if (!clave_hash("admin123", hash) || usuario_alta("admin", hash, "admin") != ALTA_OK) {
+        fprintf(stderr, "[SERVIDOR] No se pudo crear cuenta admin por defecto.\n");
+    } else {
+        printf("[SERVIDOR] Cuenta admin por defecto generada.\n");
+    }
+}
+
+/* ---------- Snapshot binario ---------- */
+
+/*
+ * Tienda.snap guarda el almacén y los usuarios por columnas: precios,
+ * números de marca y desplazamientos a una tabla de cadenas terminadas en
+ * '\0'. Al arrancar se mapea y los productos apuntan directo a esa tabla,
+ * sin analizar texto ni copiar. Cada sección recuerda el tamaño y mtime
+ * del CSV del que salió: si el CSV cambió después, esa sección se vuelve a
+ * leer del CSV y el snapshot se reescribe (temporal + rename). Un CRC32C
+ * de todo lo que sigue a la cabecera descarta archivos truncados o dañados.
+ */
+#define SNAPSHOT_VERSION 2
+
+static const char snapshot_magia[8] = "TIENDASN";
+
+typedef struct {
+    int64_t mtime_ns;           /* -1: el archivo no existía */
+    uint64_t tam;
+} FirmaArchivo;
+
+typedef struct {
+    char magia[8];
+    uint32_t version;
+    uint32_t crc;               /* de los bytes tras la cabecera */
+    uint64_t tam;               /* del archivo completo */
+    FirmaArchivo fuente_inventario;
+    FirmaArchivo fuente_usuarios;
+    uint64_t n_productos;
+    uint64_t n_marcas;
+    uint64_t n_usuarios;
+    /* desplazamientos desde el inicio del archivo, alineados a 8 */
+    uint64_t col_precio;        /* double[n_productos] */
+    uint64_t col_marca;         /* uint32_t[n_productos] */
+    uint64_t col_existencias;   /* int32_t[n_productos] */
+    uint64_t col_modelo;        /* uint64_t[n_productos], dentro de 'cadenas' */
+    uint64_t col_specs;
+    uint64_t col_imagen;
+    uint64_t col_nombre_marca;  /* uint64_t[n_marcas] */
+    uint64_t col_usuario;       /* uint64_t[n_usuarios] */
+    uint64_t col_clave;
+    uint64_t col_rol;
+    uint64_t cadenas;
+    uint64_t tam_cadenas;
+} CabeceraSnapshot;
+
+/* Fuentes registradas en el snapshot cargado */
+static FirmaArchivo snapshot_fuentes[2] = { { -2, 0 }, { -2, 0 } };
+
+static FirmaArchivo firma_archivo(const char *ruta) {
+    struct stat st;
+    if (stat(ruta, &st) < 0) return (FirmaArchivo){ -1, 0 };
+    return (FirmaArchivo){ (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec, (uint64_t)st.st_size };
+}
+
+static bool firma_igual(FirmaArchivo a, FirmaArchivo b) {
+    return a.mtime_ns == b.mtime_ns && a.tam == b.tam;
+}
+
+static const char *texto_specs(const void *a, int i) { return ((const Almacen *)a)->productos[i].specs; }
+static const char *texto_imagen(const void *a, int i) { return ((const Almacen *)a)->productos[i].imagen; }
+static const char *texto_clave(const void *ctx, int i) { (void)ctx; return usuarios[i].password; }
+static const char *texto_rol(const void *ctx, int i) { (void)ctx; return usuarios[i].role ? usuarios[i].role : "cliente"; }
+
+typedef struct {
+    FILE *f;
+    uint64_t pos;
+    uint32_t crc;
+    bool error;
+} SalidaSnapshot;
+
+static void snap_poner(SalidaSnapshot *s, const void *p, size_t n) {
+    if (fwrite(p, 1, n, s->f) != n) s->error = true;
+    s->crc = crc32c(s->crc, p, n);
+    s->pos += n;
+}
+
+/* Rellena hasta múltiplo de 8 y devuelve la posición */
+static uint64_t snap_alinear(SalidaSnapshot *s) {
+    static const char ceros[8];
+    snap_poner(s, ceros, (8 - s->pos % 8) % 8);
+    return s->pos;
+}
+
+/* Columna de desplazamientos; las cadenas se escriben después en el mismo orden */
+static uint64_t snap_columna_textos(SalidaSnapshot *s, uint64_t *cad, ClaveIndice texto, const void *ctx, int n) {
+    uint64_t col = snap_alinear(s);
+    for (int i = 0; i < n; ++i) {
+        snap_poner(s, cad, sizeof(*cad));
+        *cad += strlen(texto(ctx, i)) + 1;
+    }
+    return col;
+}
+
+static void snap_textos(SalidaSnapshot *s, ClaveIndice texto, const void *ctx, int n) {
+    for (int i = 0; i < n; ++i) {
+        const char *t = texto(ctx, i);
+        snap_poner(s, t, strlen(t) + 1);
+    }
+}
+
+/* Vuelca el almacén 'a' y los usuarios; el anterior sigue valiendo hasta el rename */
+static void snapshot_escribir(const Almacen *a) {
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    const char *tmp = SNAPSHOT_FILE ".tmp";
+    SalidaSnapshot s = { .f = fopen(tmp, "wb") };
+    if (!s.f) {
+        perror("snapshot");
+        return;
+    }
+    CabeceraSnapshot h = {
+        .version = SNAPSHOT_VERSION,
+        .fuente_inventario = firma_archivo(INVENTARIO_FILE),
+        .fuente_usuarios = firma_archivo(USUARIOS_FILE),
+        .n_productos = (uint64_t)a->n,
+        .n_marcas = (uint64_t)a->n_marcas,
+        .n_usuarios = (uint64_t)usuarios_size,
+    };
+    memcpy(h.magia, snapshot_magia, sizeof(h.magia));
+    /* la cabecera real se escribe al final, fuera del CRC */
+    if (fwrite(&h, sizeof(h), 1, s.f) != 1) s.error = true;
+    s.pos = sizeof(h);
+
+    h.col_precio = snap_alinear(&s);
+    snap_poner(&s, a->col_precio, (size_t)a->n * sizeof(double));
+    h.col_marca = snap_alinear(&s);
+    snap_poner(&s, a->col_marca, (size_t)a->n * sizeof(uint32_t));
+    h.col_existencias = snap_alinear(&s);
+    for (int i = 0; i < a->n; ++i) {
+        int32_t e = atomic_load(&a->existencias[i]);
+        snap_poner(&s, &e, sizeof(e));
+    }
+    uint64_t cad = 0;
+    h.col_nombre_marca = snap_columna_textos(&s, &cad, clave_marca, a, a->n_marcas);
+    h.col_modelo = snap_columna_textos(&s, &cad, clave_modelo, a, a->n);
+    h.col_specs = snap_columna_textos(&s, &cad, texto_specs, a, a->n);
+    h.col_imagen = snap_columna_textos(&s, &cad, texto_imagen, a, a->n);
+    h.col_usuario = snap_columna_textos(&s, &cad, clave_usuario, NULL, usuarios_size);
+    h.col_clave = snap_columna_textos(&s, &cad, texto_clave, NULL, usuarios_size);
+    h.col_rol = snap_columna_textos(&s, &cad, texto_rol, NULL, usuarios_size);
+    h.cadenas = snap_alinear(&s);
+    h.tam_cadenas = cad;
+    snap_textos(&s, clave_marca, a, a->n_marcas);
+    snap_textos(&s, clave_modelo, a, a->n);
+    snap_textos(&s, texto_specs, a, a->n);
+    snap_textos(&s, texto_imagen, a, a->n);
+    snap_textos(&s, clave_usuario, NULL, usuarios_size);
+    snap_textos(&s, texto_clave, NULL, usuarios_size);
+    snap_textos(&s, texto_rol, NULL, usuarios_size);
+    h.tam = s.pos;
+    h.crc = s.crc;
+
+    if (fseek(s.f, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, s.f) != 1) s.error = true;
+    if (fflush(s.f) != 0 || fsync(fileno(s.f)) != 0) s.error = true;
+    if (fclose(s.f) != 0) s.error = true;
+    if (s.error || rename(tmp, SNAPSHOT_FILE) != 0) {
+        perror("snapshot");
+        unlink(tmp);
+        return;
+    }
+    snapshot_fuentes[0] = h.fuente_inventario;
+    snapshot_fuentes[1] = h.fuente_usuarios;
+    printf("[SERVIDOR] Snapshot %s escrito: %llu bytes en %.3f s\n",
+           SNAPSHOT_FILE, (unsigned long long)h.tam, segundos_desde(&t0));
+}
+
+/* La columna [off, off + n * tam_elem) cabe en el archivo y está alineada */
+static bool snap_columna_valida(const CabeceraSnapshot *h, uint64_t off, uint64_t n, size_t tam_elem) {
+    return off % 8 == 0 && off >= sizeof(*h) && off <= h->tam && n <= (h->tam - off) / tam_elem;
+}
+
+static const char *snap_texto(const MapaArchivo *m, const CabeceraSnapshot *h, uint64_t col, uint64_t i) {
+    uint64_t off;
+    memcpy(&off, m->datos + col + i * sizeof(off), sizeof(off));
+    /* la tabla termina en '\0', así que cualquier inicio válido es una cadena completa */
+    return off < h->tam_cadenas ? m->datos + h->cadenas + off : NULL;
+}
+
+/* Almacén que apunta a las cadenas del mapeo, que pasa a ser suyo; NULL si no cuadra */
+static Almacen *snapshot_cargar_inventario(const MapaArchivo *m, const CabeceraSnapshot *h) {
+    Almacen *a = almacen_nuevo();
+    if (!a || h->n_productos > INT_MAX || h->n_marcas > INT_MAX || !almacen_reservar(a, h->n_productos)) goto error;
+    for (uint64_t i = 0; i < h->n_marcas; ++i) {
+        const char *nombre = snap_texto(m, h, h->col_nombre_marca, i);
+        if (!nombre || indice_buscar(&a->por_marca, nombre) >= 0 || marca_registrar(a, nombre) < 0) goto error;
+    }
+    const double *precios = (const double *)(m->datos + h->col_precio);
+    const uint32_t *num_marca = (const uint32_t *)(m->datos + h->col_marca);
+    const int32_t *existencias = (const int32_t *)(m->datos + h->col_existencias);
+    for (uint64_t i = 0; i < h->n_productos; ++i) {
+        Producto *p = &a->productos[a->n];
+        /* el contador cambia: va en memoria propia, no en el mapeo */
+        atomic_init(&a->existencias[a->n], existencias[i] < SIN_LIMITE ? 0 : existencias[i]);
+        p->modelo = (char *)snap_texto(m, h, h->col_modelo, i);
+        p->specs = (char *)snap_texto(m, h, h->col_specs, i);
+        p->imagen = (char *)snap_texto(m, h, h->col_imagen, i);
+        a->col_precio[a->n] = precios[i];
+        if (!p->modelo || !p->specs || !p->imagen || num_marca[i] >= h->n_marcas) goto error;
+        if (!producto_indexar(a, (int)num_marca[i])) goto error;
+    }
+    a->mapa = *m;
+    return a;
+error:
+    almacen_soltar(a);
+    return NULL;
+}
+
+static bool snapshot_cargar_usuarios(const MapaArchivo *m, const CabeceraSnapshot *h) {
+    usuarios_size = 0;
+    for (uint64_t i = 0; i < h->n_usuarios; ++i) {
+        const char *user = snap_texto(m, h, h->col_usuario, i);
+        const char *pass = snap_texto(m, h, h->col_clave, i);
+        const char *role = snap_texto(m, h, h->col_rol, i);
+        if (!user || !pass || !role || !usuario_cargar(strdup(user), strdup(pass), strdup(role))) goto error;
+    }
+    return true;
+error:
+    for (int i = 0; i < usuarios_size; ++i) {
+        free(usuarios[i].username);
+        free(usuarios[i].password);
+        free(usuarios[i].role);
+    }
+    usuarios_size = 0;
+    indice_liberar(&indice_usuarios);
+    return false;
+}
+
+/*
+ * Carga del snapshot las secciones cuyo CSV no cambió desde que se escribió:
+ * deja el almacén en *alm (NULL si no) y dice en *usuarios_ok si cargó los
+ * usuarios. El resto se lee del CSV.
+ */
+static void snapshot_cargar(Almacen **alm, bool *usuarios_ok) {
+    *alm = NULL;
+    *usuarios_ok = false;
+    MapaArchivo m;
+    if (!archivo_mapear(SNAPSHOT_FILE, &m)) return;
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    const CabeceraSnapshot *h = (const CabeceraSnapshot *)m.datos;
+    const char *motivo = NULL;
+    if (m.tam < sizeof(*h) || memcmp(h->magia, snapshot_magia, sizeof(h->magia)) != 0) motivo = "formato desconocido";
+    else if (h->version != SNAPSHOT_VERSION) motivo = "otra versión";
+    else if (h->tam != m.tam || crc32c(0, m.datos + sizeof(*h), m.tam - sizeof(*h)) != h->crc) motivo = "CRC no coincide";
+    else if (!snap_columna_valida(h, h->col_precio, h->n_productos, sizeof(double))
+             || !snap_columna_valida(h, h->col_marca, h->n_productos, sizeof(uint32_t))
+             || !snap_columna_valida(h, h->col_existencias, h->n_productos, sizeof(int32_t))
+             || !snap_columna_valida(h, h->col_modelo, h->n_productos, sizeof(uint64_t))
+             || !snap_columna_valida(h, h->col_specs, h->n_productos, sizeof(uint64_t))
+             || !snap_columna_valida(h, h->col_imagen, h->n_productos, sizeof(uint64_t))
+             || !snap_columna_valida(h, h->col_nombre_marca, h->n_marcas, sizeof(uint64_t))
+             || !snap_columna_valida(h, h->col_usuario, h->n_usuarios, sizeof(uint64_t))
+             || !snap_columna_valida(h, h->col_clave, h->n_usuarios, sizeof(uint64_t))
+             || !snap_columna_valida(h, h->col_rol, h->n_usuarios, sizeof(uint64_t))
+             || !snap_columna_valida(h, h->cadenas, h->tam_cadenas, 1)
+             || (h->tam_cadenas > 0 && m.datos[h->cadenas + h->tam_cadenas - 1] != '\0'))
+        motivo = "columnas inválidas";
+    if (motivo) {
+        fprintf(stderr, "[SERVIDOR] Se ignora %s: %s\n", SNAPSHOT_FILE, motivo);
+        archivo_desmapear(&m);
+        return;
+    }
+
+    if (firma_igual(h->fuente_usuarios, firma_archivo(USUARIOS_FILE)))
+        *usuarios_ok = snapshot_cargar_usuarios(&m, h);
+    /* el almacén se queda con el mapeo; si no lo usa, se suelta aquí */
+    if (firma_igual(h->fuente_inventario, firma_archivo(INVENTARIO_FILE)))
+        *alm = snapshot_cargar_inventario(&m, h);
+    if (*alm) {
+        snapshot_fuentes[0] = h->fuente_inventario;
+    }
+    if (*usuarios_ok) snapshot_fuentes[1] = h->fuente_usuarios;
+    if (*alm || *usuarios_ok) {
+        printf("[SERVIDOR] Snapshot %s: %s%s%s en %.3f s\n", SNAPSHOT_FILE,
+               *alm ? "inventario" : "",
+               *alm && *usuarios_ok ? " y " : "",
+               *usuarios_ok ? "usuarios" : "", segundos_desde(&t0));
+    }
+    if (!*alm) archivo_desmapear(&m);
+}
+
+/* El snapshot en disco refleja los CSV actuales */
+static bool snapshot_vigente(void) {
+    return firma_igual(snapshot_fuentes[0], firma_archivo(INVENTARIO_FILE))
+        && firma_igual(snapshot_fuentes[1], firma_archivo(USUARIOS_FILE));
+}
+
+typedef struct TareaComando TareaComando;
+
+/* ---------- Contenido compartido entre respuestas ---------- */
+
+/*
+ * Bytes inmutables con contador de referencias que una respuesta puede
+ * encolar sin copiarlos: un archivo de images/ o una respuesta del
+ * catálogo ya serializada. Se destruyen al soltar la última referencia,
+ * aunque quien los creó ya los haya reemplazado.
+ */
+typedef struct Contenido {
+    atomic_int refs;
+    int fd;                     /* >= 0: se puede enviar con sendfile() */
+    const char *datos;          /* en memoria o mapeo del archivo */
+    size_t tam;
+    void (*destruir)(struct Contenido *);
+} Contenido;
+
+static Contenido *contenido_tomar(Contenido *ct) {
+    atomic_fetch_add(&ct->refs, 1);
+    return ct;
+}
+
+static void contenido_soltar(Contenido *ct) {
+    if (atomic_fetch_sub(&ct->refs, 1) == 1) ct->destruir(ct);
+}
+
+/* ---------- Imágenes servidas con sendfile ---------- */
+
+/*
+ * GET_IMAGE manda el archivo desde images/ sin copiarlo a memoria de
+ * usuario: sendfile() en los modos hilos y epoll, y en io_uring una
+ * sendmsg sobre el mapeo del archivo. Los descriptores quedan abiertos en
+ * una caché pequeña; una entrada se reemplaza si cambian mtime o tamaño y
+ * se cierra cuando la suelta el último envío que la usa.
+ */
+#define CACHE_IMAGENES 64
+
+typedef struct Imagen {
+    Contenido base;             /* datos: mapeo para io_uring; la caché es una referencia */
+    char nombre[128];
+    time_t mtime;
+    long uso;                   /* para desalojar la menos usada */
+} Imagen;
+
+static int imagenes_dir = -1;
+static Imagen *cache_imagenes[CACHE_IMAGENES];
+static long cache_imagenes_reloj;
+static pthread_mutex_t cache_imagenes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void imagen_destruir(Contenido *ct) {
+    if (ct->datos) munmap((void *)ct->datos, ct->tam);
+    close(ct->fd);
+    free(ct);
+}
+
+static void imagen_soltar(Imagen *img) {
+    contenido_soltar(&img->base);
+}
+
+/* Acepta "images/x.jpg" o "x.jpg"; sin subdirectorios, "..", ni ocultos */
+static const char *imagen_nombre_valido(const char *ruta) {
+    if (strncmp(ruta, IMAGENES_DIR "/", sizeof(IMAGENES_DIR)) == 0) ruta += sizeof(IMAGENES_DIR);
+    size_t n = strlen(ruta);
+    if (n == 0 || n >= sizeof(((Imagen *)0)->nombre)) return NULL;
+    if (ruta[0] == '.' || strpbrk(ruta, "/\\")) return NULL;
+    return ruta;
+}
+
+static Imagen *imagen_abrir(const char *nombre) {
+    int fd = openat(imagenes_dir, nombre, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) return NULL;
+    struct stat st;
+    Imagen *img = NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !(img = calloc(1, sizeof(*img)))) {
+        close(fd);
+        return NULL;
+    }
+    img->base.fd = fd;
+    img->base.tam = (size_t)st.st_size;
+    img->base.destruir = imagen_destruir;
+    img->mtime = st.st_mtime;
+    strcpy(img->nombre, nombre);
+    if (img->base.tam > 0) {
+        void *mapa = mmap(NULL, img->base.tam, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapa == MAP_FAILED) {
+            close(fd);
+            free(img);
+            return NULL;
+        }
+        img->base.datos = mapa;
+    }
+    atomic_init(&img->base.refs, 2);    /* la caché y quien la pidió */
+    return img;
+}
+
+/* Devuelve una referencia que el llamador suelta con imagen_soltar */
+static Imagen *imagen_obtener(const char *nombre) {
+    struct stat st;
+    if (imagenes_dir < 0 || fstatat(imagenes_dir, nombre, &st, AT_SYMLINK_NOFOLLOW) < 0
+        || !S_ISREG(st.st_mode)) return NULL;
+
+    pthread_mutex_lock(&cache_imagenes_mutex);
+    for (int i = 0; i < CACHE_IMAGENES; ++i) {
+        Imagen *img = cache_imagenes[i];
+        if (img && strcmp(img->nombre, nombre) == 0
+            && img->mtime == st.st_mtime && img->base.tam == (size_t)st.st_size) {
+            contenido_tomar(&img->base);
+            img->uso = ++cache_imagenes_reloj;
+            pthread_mutex_unlock(&cache_imagenes_mutex);
+            return img;
+        }
+    }
+    pthread_mutex_unlock(&cache_imagenes_mutex);
+
+    Imagen *img = imagen_abrir(nombre);
+    if (!img) return NULL;
+    pthread_mutex_lock(&cache_imagenes_mutex);
+    /* misma imagen desactualizada, hueco libre o la menos usada */
+    int slot = -1;
+    for (int i = 0; i < CACHE_IMAGENES; ++i) {
+        Imagen *e = cache_imagenes[i];
+        if (e && strcmp(e->nombre, nombre) == 0) {
+            slot = i;
+            break;
+        }
+        if (slot < 0 || (cache_imagenes[slot] && (!e || e->uso < cache_imagenes[slot]->uso))) slot = i;
+    }
+    if (cache_imagenes[slot]) imagen_soltar(cache_imagenes[slot]);
+    img->uso = ++cache_imagenes_reloj;
+    cache_imagenes[slot] = img;
+    pthread_mutex_unlock(&cache_imagenes_mutex);
+    return img;
+}
+
+static void imagenes_cerrar(void) {
+    for (int i = 0; i < CACHE_IMAGENES; ++i) {
+        if (cache_imagenes[i]) imagen_soltar(cache_imagenes[i]);
+        cache_imagenes[i] = NULL;
+    }
+    if (imagenes_dir >= 0) close(imagenes_dir);
+    imagenes_dir = -1;
+}
+
+/* ---------- Caché de respuestas del catálogo ---------- */
+
+/*
+ * GET_BRANDS y GET_MODELS:<marca> solo cambian cuando cambia el
+ * inventario, así que sus respuestas se guardan ya serializadas y se
+ * encolan sin copiarse. Cada versión del inventario trae su propio
+ * catálogo, construido antes de publicarla.
+ */
+typedef struct {
+    Contenido base;
+    char *buf;
+} ContenidoTexto;
+
+/* Productos activos de una marca en cada orden, para las páginas de GET_MODELS */
+typedef struct {
+    int *orden[N_ORDENES];
+    int n;
+} PaginasMarca;
+
+typedef struct {
+    Contenido *marcas;          /* respuesta de GET_BRANDS */
+    int n_marcas;
+    const char **nombres;       /* marcas activas en orden de aparición */
+    int n_modelos;
+    Contenido **modelos;        /* GET_MODELS por número de marca; NULL sin activos */
+    PaginasMarca *paginas;      /* por número de marca */
+} Catalogo;
+
+static void contenido_texto_destruir(Contenido *ct) {
+    free(((ContenidoTexto *)ct)->buf);
+    free(ct);
+}
+
+/* Toma posesión de 'buf' (malloc) */
+static Contenido *contenido_texto(char *buf, size_t len) {
+    ContenidoTexto *t = calloc(1, sizeof(*t));
+    if (!t) {
+        free(buf);
+        return NULL;
+    }
+    t->buf = buf;
+    t->base.fd = -1;
+    t->base.datos = buf;
+    t->base.tam = len;
+    t->base.destruir = contenido_texto_destruir;
+    atomic_init(&t->base.refs, 1);
+    return &t->base;
+}
+
+static void catalogo_liberar(Catalogo *cat) {
+    if (!cat) return;
+    if (cat->marcas) contenido_soltar(cat->marcas);
+    for (int i = 0; i < cat->n_modelos; ++i) {
+        if (cat->modelos[i]) contenido_soltar(cat->modelos[i]);
+        for (int o = 0; cat->paginas && o < N_ORDENES; ++o) free(cat->paginas[i].orden[o]);
+    }
+    free(cat->nombres);
+    free(cat->modelos);
+    free(cat->paginas);
+    free(cat);
+}
+
+static Contenido *catalogo_serializar_marca(const Inventario *inv, int marca) {
+    const Almacen *a = inventario_almacen(inv);
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    if (!f) return NULL;
+    for (int k = 0; k < a->marcas[marca].n; ++k) {
+        int i = a->marcas[marca].productos[k];
+        if (!producto_activo(inv, i)) continue;
+        fprintf(f, "%s|%s|%.2f|%s\n",
+                a->productos[i].modelo,
+                a->productos[i].specs,
+                a->col_precio[i],
+                a->productos[i].imagen);
+    }
+    if (fclose(f) != 0) {
+        free(buf);
+        return NULL;
+    }
+    return contenido_texto(buf, len);
+}
+
+/*
+ * Los órdenes del almacén sin los productos dados de baja: con cada baja
+ * la versión nueva los vuelve a filtrar, y una página es solo un tramo.
+ */
+static bool catalogo_paginas_marca(const Inventario *inv, int marca, PaginasMarca *pm) {
+    const Marca *mc = &inventario_almacen(inv)->marcas[marca];
+    for (int o = 0; o < N_ORDENES; ++o) {
+        const int *fuente = mc->orden[o] ? mc->orden[o] : mc->productos;
+        if (!(pm->orden[o] = malloc((size_t)(mc->n ? mc->n : 1) * sizeof(int)))) return false;
+        pm->n = 0;
+        for (int k = 0; k < mc->n; ++k) {
+            if (producto_activo(inv, fuente[k])) pm->orden[o][pm->n++] = fuente[k];
+        }
+        /* sin su permutación (no hubo memoria) se ordena aquí */
+        if (!mc->orden[o])
+            qsort_r(pm->orden[o], (size_t)pm->n, sizeof(int), orden_comparar_qsort,
+                    &(CtxOrden){ inventario_almacen(inv), o });
+    }
+    return true;
+}
+
+/* NULL si no hay memoria: los lectores generan la respuesta en el momento */
+static Catalogo *catalogo_construir(const Inventario *inv) {
+    const Almacen *a = inventario_almacen(inv);
+    Catalogo *cat = calloc(1, sizeof(*cat));
+    if (!cat) return NULL;
+    cat->nombres = calloc((size_t)a->n_marcas + 1, sizeof(*cat->nombres));
+    cat->modelos = calloc((size_t)a->n_marcas + 1, sizeof(*cat->modelos));
+    cat->paginas = calloc((size_t)a->n_marcas + 1, sizeof(*cat->paginas));
+    if (!cat->nombres || !cat->modelos || !cat->paginas) goto error;
+    cat->n_modelos = a->n_marcas;
+    /* una marca aparece al ver su primer producto activo */
+    for (int i = 0; i < a->n; ++i) {
+        int m = (int)a->col_marca[i];
+        if (!producto_activo(inv, i) || cat->modelos[m]) continue;
+        cat->nombres[cat->n_marcas++] = a->marcas[m].nombre;
+        if (!(cat->modelos[m] = catalogo_serializar_marca(inv, m))) goto error;
+        if (!catalogo_paginas_marca(inv, m, &cat->paginas[m])) goto error;
+    }
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    if (!f) goto error;
+    /* marcas únicas unidas con '|' sin '|' final */
+    for (int i = 0; i < cat->n_marcas; ++i) fprintf(f, "%s%s", i ? "|" : "", cat->nombres[i]);
+    fputc('\n', f);
+    if (fclose(f) != 0) {
+        free(buf);
+        goto error;
+    }
+    if (!(cat->marcas = contenido_texto(buf, len))) goto error;
+    return cat;
+error:
+    catalogo_liberar(cat);
+    return NULL;
+}
+
+/* Respuesta de GET_MODELS para 'marca' en el catálogo de 'inv'; NULL si no tiene modelos activos */
+static Contenido *catalogo_modelos(const Inventario *inv, const Catalogo *cat, const char *marca) {
+    int m = indice_buscar(&inventario_almacen(inv)->por_marca, marca);
+    return m >= 0 && m < cat->n_modelos ? cat->modelos[m] : NULL;
+}
+
+/* ---------- Versiones del inventario con reclamación por épocas ---------- */
+
+/*
+ * El inventario que ven los comandos es una versión inmutable publicada
+ * en un puntero atómico. Los lectores no toman locks: anuncian la época
+ * global en su ranura, cargan el puntero y al terminar vuelven a 0. Un
+ * cambio (REMOVE_PRODUCT) copia la versión actual, aplica el cambio,
+ * construye su catálogo y la publica; la anterior se retira con la época
+ * del momento y se libera cuando ningún lector activo anunció una época
+ * menor o igual. Los productos viven en un almacén que no cambia, así que
+ * los carritos guardan índices que siguen valiendo tras cada baja; solo una
+ * recarga del CSV trae un almacén nuevo (ver carrito_actualizar).
+ */
+struct Inventario {
+    unsigned long gen;          /* número de versión */
+    Almacen *alm;               /* con una referencia de esta versión */
+    Catalogo *catalogo;         /* NULL si no hubo memoria para construirlo */
+    struct Inventario *sig_retirado;
+    unsigned long epoca_retiro;
+    uint64_t activo[];          /* mapa de bits, uno por producto del almacén */
+};
+
+typedef struct LectorEpoca {
+    atomic_ulong epoca;         /* 0: fuera de una lectura */
+    atomic_bool en_uso;         /* ranura tomada por un hilo vivo */
+    atomic_bool vendiendo;      /* entre venta_entrar() y venta_salir() */
+    struct LectorEpoca *sig;
+} LectorEpoca;
+
+static _Atomic(Inventario *) inventario_actual;
+static atomic_ulong epoca_global = 1;
+static _Atomic(LectorEpoca *) lectores;     /* solo crece; las ranuras se reciclan */
+static __thread LectorEpoca *lector_propio;
+static pthread_key_t lector_clave;
+static pthread_mutex_t inventario_mutex = PTHREAD_MUTEX_INITIALIZER;  /* un escritor a la vez */
+static Inventario *inventario_retirados;    /* protegido por inventario_mutex */
+
+static const Almacen *inventario_almacen(const Inventario *inv) {
+    return inv->alm;
+}
+
+static bool producto_activo(const Inventario *inv, int id) {
+    return id >= 0 && id < inv->alm->n && mapa_bit(inv->activo, id);
+}
+
+/* Solo en una versión que todavía no se publica */
+static void inventario_desactivar(Inventario *inv, int id) {
+    inv->activo[id >> 6] &= ~(1ull << (id & 63));
+}
+
+/* find by modelo exact match: primer producto activo con ese modelo */
+static int find_model(const Inventario *inv, const char* modelo) {
+    const Almacen *a = inv->alm;
+    for (int i = indice_buscar(&a->por_modelo, modelo); i >= 0; i = a->productos[i].mismo_modelo)
+        if (mapa_bit(inv->activo, i)) return i;
+    return -1;
+}
+
+/* Primer producto activo de la marca 'm', o -1 */
+static int primer_activo_marca(const Inventario *inv, int m) {
+    const Marca *marca = &inv->alm->marcas[m];
+    for (int k = 0; k < marca->n; ++k)
+        if (mapa_bit(inv->activo, marca->productos[k])) return marca->productos[k];
+    return -1;
+}
+
+static void inventario_liberar(Inventario *inv) {
+    catalogo_liberar(inv->catalogo);
+    almacen_soltar(inv->alm);
+    free(inv);
+}
+
+/*
+ * Copia de 'base' con el producto 'quitar' inactivo; sin 'base', la
+ * primera versión del almacén 'alm' con todo activo (y entonces también
+ * se arman su índice de búsqueda, sus facetas y los órdenes de cada
+ * marca, antes de que nadie más lo vea).
+ */
+static Inventario *inventario_version(Almacen *alm, const Inventario *base, int quitar) {
+    if (base) alm = base->alm;
+    else if (!alm->derivados) {
+        alm->derivados = true;
+        busqueda_construir(alm);
+        facetas_construir(alm);
+        marcas_ordenar(alm);
+    }
+    size_t palabras = mapa_palabras(alm->n);
+    Inventario *inv = calloc(1, sizeof(*inv) + palabras * sizeof(uint64_t));
+    if (!inv) return NULL;
+    inv->gen = base ? base->gen + 1 : 1;
+    inv->alm = almacen_tomar(alm);
+    if (base) {
+        memcpy(inv->activo, base->activo, palabras * sizeof(uint64_t));
+    } else {
+        /* los bits después del último producto quedan en 0: los recorridos no los miran */
+        memset(inv->activo, 0xff, palabras * sizeof(uint64_t));
+        if (alm->n % 64) inv->activo[palabras - 1] = (1ull << (alm->n % 64)) - 1;
+    }
+    if (quitar >= 0) inventario_desactivar(inv, quitar);
+    inv->catalogo = catalogo_construir(inv);
+    return inv;
+}
+
+static void lector_liberar_ranura(void *arg) {
+    LectorEpoca *l = arg;
+    atomic_store(&l->epoca, 0);
+    atomic_store(&l->en_uso, false);
+}
+
+static void epocas_iniciar(void) {
+    pthread_key_create(&lector_clave, lector_liberar_ranura);
+}
+
+/* Ranura del hilo: reutiliza una libre o agrega una nueva a la lista */
+static LectorEpoca *lector_registrar(void) {
+    LectorEpoca *l;
+    for (l = atomic_load(&lectores); l; l = l->sig) {
+        bool libre = false;
+        if (atomic_compare_exchange_strong(&l->en_uso, &libre, true)) break;
+    }
+    if (!l) {
+        l = calloc(1, sizeof(*l));
+        if (!l) {
+            perror("lector_epoca");
+            exit(EXIT_FAILURE);
+        }
+        atomic_init(&l->en_uso, true);
+        l->sig = atomic_load(&lectores);
+        while (!atomic_compare_exchange_weak(&lectores, &l->sig, l)) {}
+    }
+    pthread_setspecific(lector_clave, l);
+    lector_propio = l;
+    return l;
+}
+
+/* Versión vigente; válida hasta inventario_salir() */
+static const Inventario *inventario_entrar(void) {
+    LectorEpoca *l = lector_propio ? lector_propio : lector_registrar();
+    atomic_store(&l->epoca, atomic_load(&epoca_global));
+    return atomic_load(&inventario_actual);
+}
+
+static void inventario_salir(void) {
+    atomic_store(&lector_propio->epoca, 0);
+}
+
+/*
+ * Una venta descuenta existencias y encola su registro en el WAL; un
+ * checkpoint o una recarga no pueden caer entre las dos cosas, o el
+ * descuento quedaría en el CSV y también en el WAL (o en ninguno). Cada
+ * venta marca la ranura de su hilo, así que no comparten ninguna línea de
+ * caché; quien necesita el corte pausa las ventas nuevas y espera a que
+ * las ranuras queden libres.
+ */
+static atomic_bool ventas_pausadas;
+static pthread_mutex_t ventas_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ventas_cond = PTHREAD_COND_INITIALIZER;
+
+/* Dentro de inventario_entrar()/inventario_salir() */
+static void venta_entrar(void) {
+    LectorEpoca *l = lector_propio;
+    for (;;) {
+        atomic_store(&l->vendiendo, true);
+        if (!atomic_load(&ventas_pausadas)) return;
+        atomic_store(&l->vendiendo, false);
+        pthread_mutex_lock(&ventas_mutex);
+        while (atomic_load(&ventas_pausadas)) pthread_cond_wait(&ventas_cond, &ventas_mutex);
+        pthread_mutex_unlock(&ventas_mutex);
+    }
+}
+
+static void venta_salir(void) {
+    atomic_store(&lector_propio->vendiendo, false);
+}
+
+static void ventas_pausar(void) {
+    atomic_store(&ventas_pausadas, true);
+    for (LectorEpoca *l = atomic_load(&lectores); l; l = l->sig) {
+        while (atomic_load(&l->vendiendo)) sched_yield();
+    }
+}
+
+static void ventas_reanudar(void) {
+    pthread_mutex_lock(&ventas_mutex);
+    atomic_store(&ventas_pausadas, false);
+    pthread_cond_broadcast(&ventas_cond);
+    pthread_mutex_unlock(&ventas_mutex);
+}
+
+/*
+ * Aparta 'cant[i]' unidades de cada producto 'ids[i]', todo o nada: cada
+ * contador se descuenta con compare-and-swap, sin locks, y si uno no
+ * alcanza se devuelve lo ya apartado. Devuelve la posición del que faltó,
+ * o -1 si se apartó todo.
+ */
+static int existencias_apartar(const Almacen *a, const int *ids, const int *cant, int n) {
+    for (int i = 0; i < n; ++i) {
+        atomic_int *e = &a->existencias[ids[i]];
+        int v = atomic_load_explicit(e, memory_order_relaxed);
+        do {
+            if (v == SIN_LIMITE) break;
+            if (v < cant[i]) {
+                for (int k = 0; k < i; ++k) {
+                    if (atomic_load_explicit(&a->existencias[ids[k]], memory_order_relaxed) != SIN_LIMITE)
+                        atomic_fetch_add(&a->existencias[ids[k]], cant[k]);
+                }
+                return i;
+            }
+        } while (!atomic_compare_exchange_weak(e, &v, v - cant[i]));
+    }
+    return -1;
+}
+
+/* Libera las versiones retiradas que ya nadie puede estar leyendo */
+static void inventario_reclamar(void) {
+    unsigned long minima = ULONG_MAX;
+    for (LectorEpoca *l = atomic_load(&lectores); l; l = l->sig) {
+        unsigned long e = atomic_load(&l->epoca);
+        if (e && e < minima) minima = e;
+    }
+    Inventario **pp = &inventario_retirados;
+    while (*pp) {
+        Inventario *v = *pp;
+        if (v->epoca_retiro < minima) {
+            *pp = v->sig_retirado;
+            inventario_liberar(v);
+        } else {
+            pp = &v->sig_retirado;
+        }
+    }
+}
+
+/* Con inventario_mutex tomado */
+static void inventario_publicar(Inventario *nuevo) {
+    Inventario *viejo = atomic_exchange(&inventario_actual, nuevo);
+    if (viejo) {
+        /* quien anunció esta época o una anterior pudo ver 'viejo' */
+        viejo->epoca_retiro = atomic_fetch_add(&epoca_global, 1);
+        viejo->sig_retirado = inventario_retirados;
+        inventario_retirados = viejo;
+    }
+    inventario_reclamar();
+}
+
+/* Marca un producto como eliminado; NULL si se pudo, o el código de error */
+static const char *inventario_quitar(const char *modelo) {
+    const char *error = NULL;
+    pthread_mutex_lock(&inventario_mutex);
+    Inventario *base = atomic_load(&inventario_actual);
+    int id = find_model(base, modelo);
+    Inventario *nuevo = id >= 0 ? inventario_version(NULL, base, id) : NULL;
+    if (id < 0) {
+        error = "NO_ENCONTRADO";
+    } else if (!nuevo) {
+        error = "SIN_MEMORIA";
+    } else if (!wal_registrar(WAL_QUITAR_PRODUCTO, &modelo, 1)) {
+        /* sin registro durable el cambio no se publica */
+        inventario_liberar(nuevo);
+        error = "SIN_DISCO";
+    } else {
+        inventario_publicar(nuevo);
+    }
+    pthread_mutex_unlock(&inventario_mutex);
+    return error;
+}
+
+static void inventario_cerrar(void) {
+    Inventario *inv = atomic_exchange(&inventario_actual, NULL);
+    if (inv) inventario_liberar(inv);
+    while (inventario_retirados) {
+        Inventario *v = inventario_retirados;
+        inventario_retirados = v->sig_retirado;
+        inventario_liberar(v);
+    }
+}
+
+/* ---------- Respuestas de tamaño arbitrario ---------- */
+
+/*
+ * Una respuesta se arma en bloques encadenados: agregar cuesta lo que se
+ * escribe (sin strlen/strcat repetidos) y nada se trunca. Los bloques pasan
+ * tal cual a la cola de salida de la conexión y se envían con writev().
+ * Cada bloque deja MARCO_RESERVA bytes libres al inicio para anteponer su
+ * encabezado de trozo sin copiar los datos. Un segmento con 'cont' no tiene
+ * datos propios: ini/fin son posiciones dentro del contenido compartido.
+ */
+#define MARCO_RESERVA 24
+#define SALIDA_IOV 16           /* segmentos por writev() */
+
+typedef struct Segmento {
+    struct Segmento *sig;
+    Contenido *cont;            /* NULL: datos propios en 'datos' */
+    size_t ini;                 /* primer byte aún no enviado */
+    size_t fin;
+    size_t cap;
+    char datos[];
+} Segmento;
+
+typedef struct {
+    Segmento *ini;
+    Segmento *fin;
+    size_t len;                 /* bytes de contenido, sin encabezados */
+    bool sin_memoria;           /* quedó incompleta: hay que cerrar la conexión */
+} Respuesta;
+
+static Segmento *segmento_de(size_t cap) {
+    Segmento *s = malloc(sizeof(*s) + cap);
+    if (!s) return NULL;
+    s->sig = NULL;
+    s->cont = NULL;
+    s->ini = s->fin = MARCO_RESERVA < cap ? MARCO_RESERVA : 0;
+    s->cap = cap;
+    return s;
+}
+
+static Segmento *segmento_nuevo(size_t minimo) {
+    return segmento_de(MARCO_RESERVA + (minimo > BUFFER_SIZE ? minimo : BUFFER_SIZE));
+}
+
+/* Un segmento admite más datos al final si es de memoria y le cabe 'n' */
+static bool segmento_cabe(const Segmento *s, size_t n) {
+    return s && !s->cont && s->cap - s->fin >= n;
+}
+
+static const char *segmento_datos(const Segmento *s) {
+    return s->cont ? s->cont->datos : s->datos;
+}
+
+static void segmentos_liberar(Segmento *s) {
+    while (s) {
+        Segmento *sig = s->sig;
+        if (s->cont) contenido_soltar(s->cont);
+        free(s);
+        s = sig;
+    }
+}
+
+static void resp_liberar(Respuesta *r) {
+    segmentos_liberar(r->ini);
+    memset(r, 0, sizeof(*r));
+}
+
+/* Deja la respuesta vacía conservando el primer bloque */
+static void resp_vaciar(Respuesta *r) {
+    if (!r->ini || r->ini->cont) {
+        resp_liberar(r);
+        return;
+    }
+    segmentos_liberar(r->ini->sig);
+    r->ini->sig = NULL;
+    r->ini->ini = r->ini->fin = MARCO_RESERVA;
+    r->fin = r->ini;
+    r->len = 0;
+    r->sin_memoria = false;
+}
+
+/* Al menos n bytes contiguos al final de la respuesta */
+static char *resp_espacio(Respuesta *r, size_t n) {
+    if (!segmento_cabe(r->fin, n)) {
+        Segmento *s = segmento_nuevo(n);
+        if (!s) {
+            r->sin_memoria = true;
+            return NULL;
+        }
+        if (r->fin) r->fin->sig = s;
+        else r->ini = s;
+        r->fin = s;
+    }
+    return r->fin->datos + r->fin->fin;
+}
+
+static void resp_agregar_n(Respuesta *r, const char *s, size_t n) {
+    char *p = resp_espacio(r, n);
+    if (!p) return;
+    memcpy(p, s, n);
+    r->fin->fin += n;
+    r->len += n;
+}
+
+static void resp_agregar(Respuesta *r, const char *s) {
+    resp_agregar_n(r, s, strlen(s));
+}
+
+__attribute__((format(printf, 2, 3)))
+static void resp_printf(Respuesta *r, const char *fmt, ...) {
+    va_list ap;
+    size_t libre = segmento_cabe(r->fin, 1) ? r->fin->cap - r->fin->fin : 0;
+    va_start(ap, fmt);
+    int n = vsnprintf(libre ? r->fin->datos + r->fin->fin : NULL, libre, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n >= libre) {
+        /* no cupo en el bloque actual: se formatea en uno nuevo */
+        char *p = resp_espacio(r, (size_t)n + 1);
+        if (!p) return;
+        va_start(ap, fmt);
+        vsnprintf(p, (size_t)n + 1, fmt, ap);
+        va_end(ap);
+    }
+    r->fin->fin += (size_t)n;
+    r->len += (size_t)n;
+}
+
+/* Encadena contenido compartido; la respuesta se queda con la referencia */
+static void resp_contenido(Respuesta *r, Contenido *ct) {
+    Segmento *s = ct->tam > 0 ? malloc(sizeof(*s)) : NULL;
+    if (!s) {
+        if (ct->tam > 0) r->sin_memoria = true;
+        contenido_soltar(ct);
+        return;
+    }
+    s->sig = NULL;
+    s->cont = ct;
+    s->ini = 0;
+    s->fin = ct->tam;
+    s->cap = 0;
+    if (r->fin) r->fin->sig = s;
+    else r->ini = s;
+    r->fin = s;
+    r->len += ct->tam;
+}
+
+/*
+ * Codificación por trozos del modo por líneas: cada bloque sale como
+ * "<bytes>\n<datos>" y la respuesta termina con "0\n".
+ */
+static void resp_enmarcar(Respuesta *r) {
+    Segmento **pp = &r->ini;
+    for (Segmento *s = r->ini; s; pp = &s->sig, s = s->sig) {
+        size_t len = s->fin - s->ini;
+        if (len == 0) continue;
+        char marco[MARCO_RESERVA];
+        int m = snprintf(marco, sizeof(marco), "%zu\n", len);
+        if (s->cont) {
+            /* el contenido compartido no tiene espacio reservado: el encabezado va aparte */
+            Segmento *h = segmento_de(MARCO_RESERVA);
+            if (!h) {
+                r->sin_memoria = true;
+                return;
+            }
+            memcpy(h->datos, marco, (size_t)m);
+            h->fin = (size_t)m;
+            h->sig = s;
+            *pp = h;
+            continue;
+        }
+        s->ini -= (size_t)m;
+        memcpy(s->datos + s->ini, marco, (size_t)m);
+    }
+    char *p = resp_espacio(r, 2);
+    if (!p) return;
+    memcpy(p, "0\n", 2);
+    r->fin->fin += 2;
+}
+
+#define SESION_TOKEN 32         /* hex de 16 bytes aleatorios */
+
+/* Un acceptor con su propio socket SO_REUSEPORT y su bucle de eventos */
+typedef struct {
+    int id;
+    int server_socket;
+    int cpu;                    /* -1: sin fijar */
+    atomic_long activas;
+    atomic_long aceptadas;
+    pthread_t hilo;
+} Shard;
+
+static Shard *shards;
+static int num_shards = 1;
+
+/* Estado de una conexión: carrito, sesión y buffers de E/S */
+typedef struct Conexion {
+    int sock;
+    Shard *shard;
+    uint32_t ip;                /* del cliente, para los límites por IP */
+    int carrito[MAX_CARRITO];   /* índices en 'carrito_alm' */
+    int carrito_size;
+    Almacen *carrito_alm;       /* con una referencia; NULL hasta el primer uso */
+    char current_user[128];
+    char current_role[16];
+    bool logged_in;
+    char sesion[SESION_TOKEN + 1];  /* "" sin sesión */
+
+    char in[BUFFER_SIZE];       /* último recv() en modo heredado */
+    size_t in_len;
+    bool enmarcado;             /* modo por líneas negociado con PROTO:LINEAS */
+    char *entrada;              /* anillo de entrada del modo por líneas */
+    size_t ent_ini;
+    size_t ent_len;
+    size_t ent_escaneado;       /* bytes ya revisados en busca de '\n' */
+    Segmento *sal_ini;          /* cola de salida pendiente de enviar */
+    Segmento *sal_fin;
+    size_t sal_pend;            /* bytes en la cola */
+    bool lectura_pendiente;     /* quedaron datos sin leer por backpressure */
+
+    TareaComando *pend_ini;     /* comandos leídos aún no enviados al pool */
+    TareaComando *pend_fin;
+    int pend_n;
+    bool en_vuelo;              /* un comando a la vez: respuestas en orden */
+    bool cerrada;
+    struct Conexion *sig_liberar;
+    bool uring_recv;            /* operaciones en vuelo en modo io_uring */
+    bool uring_send;
+    struct iovec uring_iov[SALIDA_IOV];     /* los lee el kernel durante la sendmsg */
+    struct msghdr uring_msg;
+} Conexion;
+
+/* ---------- Control de admisión ---------- */
+
+/*
+ * Tope de conexiones simultáneas (--max-conexiones) y, por IP, una cubeta
+ * de fichas para conexiones nuevas (--conexiones-ip) y otra para comandos
+ * (--comandos-ip). Lo que se pasa recibe "ERROR|BUSY" al momento: la
+ * conexión se cierra después de la respuesta y el comando no llega al pool.
+ * Cada cubeta es un solo atómico con la hora teórica de llegada (GCRA):
+ * tomar una ficha es un compare-and-swap, sin locks en el accept ni por
+ * comando. Las IPs van en una tabla fija; una cubeta que ya se recargó
+ * del todo no guarda nada, así que otra IP puede quedarse con la ranura.
+ */
+#define ADMISION_MAX_CONEXIONES 4096
+#define ADMISION_IPS            8192        /* potencia de 2 */
+#define ADMISION_SONDEO         8
+#define RESPUESTA_OCUPADO       "ERROR|BUSY\n"
+
+typedef struct {
+    uint64_t intervalo_ns;      /* 0: sin límite */
+    uint64_t tolerancia_ns;     /* ráfaga * intervalo */
+} Tasa;
+
+typedef struct {
+    _Atomic uint32_t ip;        /* en orden de red; 0: libre */
+    _Atomic uint64_t conexiones;    /* hora teórica de llegada, en ns */
+    _Atomic uint64_t comandos;
+} CubetaIp;
+
+static struct {
+    long max_conexiones;        /* 0: sin tope */
+    Tasa conexiones_ip;
+    Tasa comandos_ip;
+    atomic_long activas;
+    atomic_ulong rechazadas_max;
+    atomic_ulong rechazadas_ip;
+    atomic_ulong comandos_rechazados;
+    atomic_ulong sin_cubeta;    /* tramo de la tabla lleno: se dejó pasar */
+} admision = { .max_conexiones = ADMISION_MAX_CONEXIONES };
+
+static CubetaIp cubetas_ip[ADMISION_IPS];
+
+/* "TASA[:RÁFAGA]" por segundo; la ráfaga por omisión es la tasa */
+static bool tasa_leer(const char *texto, Tasa *t) {
+    char *fin;
+    double tasa = strtod(texto, &fin);
+    double rafaga = tasa;
+    if (*fin == ':') rafaga = strtod(fin + 1, &fin);
+    if (*fin || !(tasa > 0) || !(rafaga >= 1) || tasa > 1e9) return false;
+    t->intervalo_ns = (uint64_t)(1e9 / tasa);
+    if (t->intervalo_ns == 0) t->intervalo_ns = 1;
+    t->tolerancia_ns = (uint64_t)(rafaga * (double)t->intervalo_ns);
+    return true;
+}
+
+static uint64_t ahora_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+
+/* Toma una ficha si la hay */
+static bool cubeta_tomar(_Atomic uint64_t *llegada, const Tasa *t, uint64_t ahora) {
+    uint64_t vieja = atomic_load_explicit(llegada, memory_order_relaxed);
+    for (;;) {
+        uint64_t nueva = (vieja > ahora ? vieja : ahora) + t->intervalo_ns;
+        if (nueva - ahora > t->tolerancia_ns) return false;
+        if (atomic_compare_exchange_weak_explicit(llegada, &vieja, nueva, memory_order_relaxed,
+                                                  memory_order_relaxed))
+            return true;
+    }
+}
+
+static bool cubeta_llena(CubetaIp *x, uint64_t ahora) {
+    return atomic_load_explicit(&x->conexiones, memory_order_relaxed) <= ahora
+           && atomic_load_explicit(&x->comandos, memory_order_relaxed) <= ahora;
+}
+
+/* Cubeta de 'ip'; NULL si su tramo de la tabla está ocupado por IPs activas */
+static CubetaIp *cubeta_ip(uint32_t ip, uint64_t ahora) {
+    uint32_t h = (ip * 2654435761u) >> 19;      /* 13 bits: ADMISION_IPS */
+    CubetaIp *reciclable = NULL;
+    for (int k = 0; k < ADMISION_SONDEO; ++k) {
+        CubetaIp *x = &cubetas_ip[(h + (uint32_t)k) & (ADMISION_IPS - 1)];
+        uint32_t actual = atomic_load_explicit(&x->ip, memory_order_relaxed);
+        if (actual == ip) return x;
+        if (actual == 0) {
+            if (atomic_compare_exchange_strong(&x->ip, &actual, ip) || actual == ip) return x;
+        } else if (!reciclable && cubeta_llena(x, ahora)) {
+            reciclable = x;
+        }
+    }
+    if (reciclable) {
+        uint32_t actual = atomic_load(&reciclable->ip);
+        if (cubeta_llena(reciclable, ahora) && atomic_compare_exchange_strong(&reciclable->ip, &actual, ip))
+            return reciclable;
+    }
+    atomic_fetch_add(&admision.sin_cubeta, 1);
+    return NULL;
+}
+
+static void responder_ocupado(int sock) {
+    ssize_t w = send(sock, RESPUESTA_OCUPADO, strlen(RESPUESTA_OCUPADO), MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void)w;
+}
+
+/* IP del otro extremo, solo si hay límites por IP */
+static uint32_t ip_de(int sock) {
+    if (!admision.conexiones_ip.intervalo_ns && !admision.comandos_ip.intervalo_ns) return 0;
+    struct sockaddr_in dir;
+    socklen_t n = sizeof(dir);
+    if (getpeername(sock, (struct sockaddr *)&dir, &n) != 0 || dir.sin_family != AF_INET) return 0;
+    return dir.sin_addr.s_addr;
+}
+
+/* Cuenta la conexión si entra; si no, responde BUSY (quien llama cierra) */
+static bool admision_entrar(int sock, uint32_t ip) {
+    long antes = atomic_fetch_add_explicit(&admision.activas, 1, memory_order_relaxed);
+    if (admision.max_conexiones > 0 && antes >= admision.max_conexiones) {
+        atomic_fetch_sub_explicit(&admision.activas, 1, memory_order_relaxed);
+        atomic_fetch_add(&admision.rechazadas_max, 1);
+        responder_ocupado(sock);
+        return false;
+    }
+    if (ip && admision.conexiones_ip.intervalo_ns) {
+        uint64_t ahora = ahora_ns();
+        CubetaIp *x = cubeta_ip(ip, ahora);
+        if (x && !cubeta_tomar(&x->conexiones, &admision.conexiones_ip, ahora)) {
+            atomic_fetch_sub_explicit(&admision.activas, 1, memory_order_relaxed);
+            atomic_fetch_add(&admision.rechazadas_ip, 1);
+            responder_ocupado(sock);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void admision_salir(void) {
+    atomic_fetch_sub_explicit(&admision.activas, 1, memory_order_relaxed);
+}
+
+/* Ficha de comando para la IP de 'c'; false: se responde BUSY sin ejecutarlo */
+static bool admision_comando(const Conexion *c) {
+    if (!c->ip || !admision.comandos_ip.intervalo_ns) return true;
+    uint64_t ahora = ahora_ns();
+    CubetaIp *x = cubeta_ip(c->ip, ahora);
+    if (!x || cubeta_tomar(&x->comandos, &admision.comandos_ip, ahora)) return true;
+    atomic_fetch_add(&admision.comandos_rechazados, 1);
+    return false;
+}
+
+typedef enum { MODO_HILOS, MODO_EPOLL, MODO_URING } ModoServidor;
+
+/* NULL si no hay memoria o si la admisión la rechazó (ya respondió BUSY); quien llama cierra */
+static Conexion *conexion_nueva(int sock, Shard *shard, uint32_t ip) {
+    if (!admision_entrar(sock, ip)) return NULL;
+    Conexion *c = calloc(1, sizeof(*c));
+    if (!c) {
+        admision_salir();
+        return NULL;
+    }
+    c->sock = sock;
+    c->shard = shard;
+    c->ip = ip;
+    strcpy(c->current_role, "cliente");
+    atomic_fetch_add(&shard->activas, 1);
+    atomic_fetch_add(&shard->aceptadas, 1);
+    return c;
+}
+
+static void conexion_desconectada(Conexion *c) {
+    atomic_fetch_sub(&c->shard->activas, 1);
+    admision_salir();
+    printf("[SERVIDOR] Cliente desconectado FD=%d (shard %d)\n", c->sock, c->shard->id);
+}
+
+static void conexion_liberar(Conexion *c) {
+    if (!c) return;
+    almacen_soltar(c->carrito_alm);
+    free(c->entrada);
+    segmentos_liberar(c->sal_ini);
+    free(c);
+}
+
+/*
+ * Pasa el carrito al almacén de 'inv' si el CSV se recargó desde que se
+ * armó: cada producto se vuelve a buscar por modelo y los que ya no están
+ * se descartan. El almacén anterior vive hasta aquí por la referencia.
+ */
+static void carrito_actualizar(Conexion *c, const Inventario *inv) {
+    Almacen *viejo = c->carrito_alm;
+    if (viejo == inv->alm) return;
+    int n = 0;
+    for (int i = 0; i < c->carrito_size; ++i) {
+        int id = find_model(inv, viejo->productos[c->carrito[i]].modelo);
+        if (id >= 0) c->carrito[n++] = id;
+    }
+    c->carrito_size = n;
+    c->carrito_alm = almacen_tomar(inv->alm);
+    almacen_soltar(viejo);
+}
+
+/*
+ * GET_MODELS:<marca>;sort=price|name|-price|-name;offset=N;limit=M;cursor=C
+ * Responde las líneas de siempre y, si quedan más, "SIGUIENTE|<cursor>".
+ * El cursor es el último producto enviado: la página siguiente empieza
+ * justo después de él en el orden (búsqueda binaria), aunque entre tanto
+ * haya bajas. Cuesta O(limit) más O(log n) por el cursor.
+ */
+#define PAGINA_LIMITE     50
+#define PAGINA_LIMITE_MAX 1000
+
+/* Posición de la página que sigue a 'cursor' en el orden ascendente 'ids' */
+static int pagina_despues(const Almacen *a, int orden, const int *ids, int n, int cursor, bool desc) {
+    /* cuántos van antes que el cursor (lo < 0) y cuántos hasta él inclusive */
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int m = (lo + hi) / 2;
+        if (orden_comparar(a, orden, ids[m], cursor) < 0) lo = m + 1;
+        else hi = m;
+    }
+    int hasta = lo < n && ids[lo] == cursor ? lo + 1 : lo;
+    return desc ? n - lo : hasta;
+}
+
+static void catalogo_pagina(const Inventario *inv, const char *arg, Respuesta *r) {
+    const Almacen *a = inventario_almacen(inv);
+    char marca[256];
+    size_t largo = strcspn(arg, ";");
+    snprintf(marca, sizeof(marca), "%.*s", (int)largo, arg);
+    int orden = ORDEN_ARCHIVO, limite = PAGINA_LIMITE, cursor = -1;
+    long offset = 0;
+    bool desc = false;
+    for (const char *p = arg + largo; *p == ';';) {
+        const char *op = ++p;
+        size_t n = strcspn(p, ";");
+        p += n;
+        if (strncmp(op, "sort=", 5) == 0) {
+            const char *v = op + 5;
+            desc = *v == '-';
+            v += desc;
+            size_t k = (size_t)(p - v);
+            if (k == 5 && strncmp(v, "price", 5) == 0) orden = ORDEN_PRECIO;
+            else if (k == 4 && strncmp(v, "name", 4) == 0) orden = ORDEN_NOMBRE;
+            else if (!(k == 4 && strncmp(v, "file", 4) == 0)) goto invalido;
+        } else if (strncmp(op, "offset=", 7) == 0) {
+            offset = atol(op + 7);
+        } else if (strncmp(op, "limit=", 6) == 0) {
+            limite = atoi(op + 6);
+        } else if (strncmp(op, "cursor=", 7) == 0) {
+            cursor = atoi(op + 7);
+            if (cursor < 0 || cursor >= a->n) goto invalido;
+        } else if (n > 0) {
+            goto invalido;
+        }
+    }
+    if (offset < 0 || limite < 1) goto invalido;
+    if (limite > PAGINA_LIMITE_MAX) limite = PAGINA_LIMITE_MAX;
+    const Catalogo *cat = inv->catalogo;
+    int m = indice_buscar(&a->por_marca, marca);
+    const PaginasMarca *pm = m >= 0 && m < cat->n_modelos ? &cat->paginas[m] : NULL;
+    int n = pm ? pm->n : 0;
+    const int *ids = pm ? pm->orden[orden] : NULL;
+    long inicio = offset;
+    if (cursor >= 0 && n > 0) inicio += pagina_despues(a, orden, ids, n, cursor, desc);
+    long fin = inicio + limite < n ? inicio + limite : n;
+    for (long j = inicio; j < fin; ++j) {
+        int id = ids[desc ? n - 1 - j : j];
+        const Producto *p = &a->productos[id];
+        resp_printf(r, "%s|%s|%.2f|%s\n", p->modelo, p->specs, a->col_precio[id], p->imagen);
+    }
+    if (fin < n) resp_printf(r, "SIGUIENTE|%d\n", ids[desc ? n - fin : fin - 1]);
+    if (r->len == 0) resp_agregar(r, "\n");
+    return;
+invalido:
+    resp_agregar(r, "ERROR|Parametros invalidos\n");
+}
+
+static int comparar_int(const void *x, const void *y) {
+    int a = *(const int *)x, b = *(const int *)y;
+    return (a > b) - (a < b);
+}
+
+/* Una unidad vendida, como queda en el libro (ver "Libro de pedidos") */
+typedef struct {
+    const char *marca;
+    const char *modelo;
+    double precio;
+} LineaPedido;
+
+static uint64_t libro_numerar(void);
+static void libro_registrar(uint64_t pedido, const char *usuario, const char *metodo, int64_t fecha,
+                            const LineaPedido *lineas, int n);
+
+/* 'metodo' viene del cliente: sin los separadores del archivo ni celdas vacías */
+static void metodo_limpiar(const char *metodo, char limpio[64]) {
+    size_t largo = 0;
+    while (*metodo == ' ') metodo++;
+    for (; *metodo && largo < 63; ++metodo)
+        limpio[largo++] = *metodo == ';' || *metodo == '\n' || *metodo == '\r' ? ' ' : *metodo;
+    while (largo > 0 && limpio[largo - 1] == ' ') largo--;
+    if (largo == 0) limpio[largo++] = '-';
+    limpio[largo] = '\0';
+}
+
+/*
+ * Vende el carrito: aparta las existencias, registra el pedido completo en
+ * el WAL (número, fecha, usuario, método y marca, modelo y precio de cada
+ * unidad) y, ya confirmado, lo anota en el libro. El turno de venta se
+ * sostiene hasta el final: un checkpoint no puede truncar el WAL entre la
+ * confirmación y la línea de Tienda.pedidos. Si algo no alcanza, justo se
+ * recargó el inventario o el registro no se pudo confirmar, responde el
+ * error y devuelve lo apartado: el carrito queda como estaba.
+ */
+static bool carrito_vender(Conexion *c, const Inventario *inv, const char *metodo, time_t fecha, Respuesta *r) {
+    int ids[MAX_CARRITO], cant[MAX_CARRITO], n = 0;
+    memcpy(ids, c->carrito, (size_t)c->carrito_size * sizeof(int));
+    qsort(ids, (size_t)c->carrito_size, sizeof(int), comparar_int);
+    for (int i = 0; i < c->carrito_size; ++i) {
+        if (n > 0 && ids[n - 1] == ids[i]) {
+            cant[n - 1]++;
+        } else {
+            ids[n] = ids[i];
+            cant[n++] = 1;
+        }
+    }
+    char limpio[64];
+    metodo_limpiar(metodo, limpio);
+    const Almacen *a = inv->alm;
+    venta_entrar();
+    if (atomic_load(&inventario_actual)->alm != a) {
+        /* el registro quedaría detrás de la recarga y se aplicaría al almacén nuevo */
+        venta_salir();
+        resp_agregar(r, "ERROR:REINTENTAR\n");
+        return false;
+    }
+    int falta = existencias_apartar(a, ids, cant, n);
+    if (falta >= 0) {
+        venta_salir();
+        resp_printf(r, "ERROR:SIN_EXISTENCIAS|%s\n", a->productos[ids[falta]].modelo);
+        return false;
+    }
+    uint64_t pedido = libro_numerar();
+    char numero[24], cuando[24], precios[MAX_CARRITO][32];
+    snprintf(numero, sizeof(numero), "%llu", (unsigned long long)pedido);
+    snprintf(cuando, sizeof(cuando), "%lld", (long long)fecha);
+    const char *campos[4 + 3 * MAX_CARRITO] = { numero, cuando, c->current_user, limpio };
+    LineaPedido lineas[MAX_CARRITO];
+    for (int i = 0; i < c->carrito_size; ++i) {
+        int id = c->carrito[i];
+        lineas[i] = (LineaPedido){ producto_marca(a, id), a->productos[id].modelo, a->col_precio[id] };
+        snprintf(precios[i], sizeof(precios[i]), "%.2f", lineas[i].precio);
+        campos[4 + 3 * i] = lineas[i].marca;
+        campos[5 + 3 * i] = lineas[i].modelo;
+        campos[6 + 3 * i] = precios[i];
+    }
+    NodoWal *nodo = wal_agregar(WAL_PEDIDO, campos, 4 + 3 * c->carrito_size);
+    /* sin registro confirmado no hay venta: con el WAL en error tampoco hay checkpoint */
+    bool ok = nodo && wal_esperar(nodo);
+    if (ok) {
+        libro_registrar(pedido, c->current_user, limpio, fecha, lineas, c->carrito_size);
+    } else {
+        int devolver[MAX_CARRITO];
+        for (int i = 0; i < n; ++i) devolver[i] = -cant[i];
+        existencias_apartar(a, ids, devolver, n);
+    }
+    venta_salir();
+    if (!ok) resp_agregar(r, "ERROR:REINTENTAR\n");
+    return ok;
+}
+
+/* ---------- Sesiones ---------- */
+
+/* Marca a 'c' como autenticada con 'u'; con datos_lock en lectura */
+static void sesion_iniciar(Conexion *c, const Usuario *u) {
+    c->logged_in = true;
+    strncpy(c->current_user, u->username, sizeof(c->current_user) - 1);
+    c->current_user[sizeof(c->current_user) - 1] = '\0';
+    strncpy(c->current_role, u->role, sizeof(c->current_role) - 1);
+    c->current_role[sizeof(c->current_role) - 1] = '\0';
+}
+
+/*
+ * LOGIN abre una sesión con un token aleatorio; RESUME:<token> la recupera
+ * desde otra conexión (o tras reiniciar el servidor) con el usuario y el
+ * carrito, en un solo viaje. El mapa está repartido en shards por hash del
+ * token, cada uno con su mutex, así que las reconexiones en masa no se
+ * estorban. El carrito se guarda como en la conexión: ids más una
+ * referencia a su almacén; al reanudar se pasa por carrito_actualizar().
+ * Un hilo escribe el mapa a disco cada tanto (ver "Instantánea de las
+ * sesiones").
+ */
+#define SESION_SHARDS   16      /* potencia de dos */
+#define SESION_VIGENCIA (7 * 24 * 3600)     /* segundos sin usarse antes de expirar */
+
+typedef struct Sesion {
+    char token[SESION_TOKEN + 1];
+    char usuario[128];
+    time_t ultimo_uso;
+    int carrito[MAX_CARRITO];
+    int carrito_size;
+    Almacen *carrito_alm;       /* con una referencia, o NULL */
+    struct Sesion *sig;
+} Sesion;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    Sesion **cubetas;
+    size_t cap;                 /* potencia de dos */
+    size_t n;
+} ShardSesiones;
+
+static ShardSesiones sesiones[SESION_SHARDS];
+static atomic_long sesiones_total;
+static atomic_bool sesiones_cambiaron;     /* desde la última instantánea */
+
+static void sesiones_iniciar(void) {
+    for (int i = 0; i < SESION_SHARDS; ++i) pthread_mutex_init(&sesiones[i].mutex, NULL);
+}
+
+static ShardSesiones *sesion_shard(const char *token, uint32_t *h) {
+    *h = hash_bytes(token, strlen(token));
+    return &sesiones[*h & (SESION_SHARDS - 1)];
+}
+
+/* Con el mutex del shard; los bits bajos del hash ya eligieron el shard */
+static Sesion **sesion_cubeta(ShardSesiones *sh, uint32_t h) {
+    return &sh->cubetas[(h / SESION_SHARDS) & (sh->cap - 1)];
+}
+
+static Sesion *sesion_buscar(ShardSesiones *sh, uint32_t h, const char *token) {
+    if (!sh->cap) return NULL;
+    for (Sesion *x = *sesion_cubeta(sh, h); x; x = x->sig) {
+        if (strcmp(x->token, token) == 0) return x;
+    }
+    return NULL;
+}
+
+static bool sesiones_crecer(ShardSesiones *sh) {
+    size_t cap = sh->cap ? sh->cap * 2 : 64;
+    Sesion **cubetas = calloc(cap, sizeof(*cubetas));
+    if (!cubetas) return false;
+    ShardSesiones nuevo = { .cubetas = cubetas, .cap = cap };
+    for (size_t i = 0; i < sh->cap; ++i) {
+        for (Sesion *x = sh->cubetas[i], *sig; x; x = sig) {
+            sig = x->sig;
+            Sesion **c = sesion_cubeta(&nuevo, hash_bytes(x->token, strlen(x->token)));
+            x->sig = *c;
+            *c = x;
+        }
+    }
+    free(sh->cubetas);
+    sh->cubetas = cubetas;
+    sh->cap = cap;
+    return true;
+}
+
+/* Inserta 'x' (ya con token); false si no hay memoria */
+static bool sesion_insertar(Sesion *x) {
+    uint32_t h;
+    ShardSesiones *sh = sesion_shard(x->token, &h);
+    pthread_mutex_lock(&sh->mutex);
+    bool ok = sh->n < sh->cap || sesiones_crecer(sh);
+    if (ok) {
+        Sesion **c = sesion_cubeta(sh, h);
+        x->sig = *c;
+        *c = x;
+        sh->n++;
+        atomic_fetch_add(&sesiones_total, 1);
+        atomic_store(&sesiones_cambiaron, true);
+    }
+    pthread_mutex_unlock(&sh->mutex);
+    return ok;
+}
+
+static void sesion_liberar(Sesion *x) {
+    almacen_soltar(x->carrito_alm);
+    free(x);
+}
+
+/* Copia un carrito en 'x' y la marca como usada; con el mutex del shard */
+static void sesion_copiar_carrito(Sesion *x, const int *carrito, int n, Almacen *alm) {
+    memcpy(x->carrito, carrito, (size_t)n * sizeof(int));
+    x->carrito_size = n;
+    if (x->carrito_alm != alm) {
+        almacen_soltar(x->carrito_alm);
+        x->carrito_alm = alm ? almacen_tomar(alm) : NULL;
+    }
+    x->ultimo_uso = time(NULL);
+}
+
+/* Abre una sesión para el usuario de 'c' con su carrito actual; NULL si falla */
+static const char *sesion_crear(Conexion *c) {
+    unsigned char azar[SESION_TOKEN / 2];
+    if (getrandom(azar, sizeof(azar), 0) != (ssize_t)sizeof(azar)) return NULL;
+    Sesion *x = calloc(1, sizeof(*x));
+    if (!x) return NULL;
+    for (size_t i = 0; i < sizeof(azar); ++i) sprintf(x->token + 2 * i, "%02x", azar[i]);
+    snprintf(x->usuario, sizeof(x->usuario), "%s", c->current_user);
+    sesion_copiar_carrito(x, c->carrito, c->carrito_size, c->carrito_alm);
+    if (!sesion_insertar(x)) {
+        sesion_liberar(x);
+        return NULL;
+    }
+    memcpy(c->sesion, x->token, sizeof(c->sesion));
+    return c->sesion;
+}
+
+/* Deja en la sesión de 'c' el carrito que tiene ahora la conexión */
+static void sesion_guardar(Conexion *c) {
+    if (!c->sesion[0]) return;
+    uint32_t h;
+    ShardSesiones *sh = sesion_shard(c->sesion, &h);
+    pthread_mutex_lock(&sh->mutex);
+    Sesion *x = sesion_buscar(sh, h, c->sesion);
+    if (x) {
+        sesion_copiar_carrito(x, c->carrito, c->carrito_size, c->carrito_alm);
+        atomic_store(&sesiones_cambiaron, true);
+    }
+    pthread_mutex_unlock(&sh->mutex);
+}
+
+/*
+ * Pasa a 'c' el usuario y el carrito de la sesión 'token'. El rol se toma
+ * de la tabla de usuarios (pudo cambiar); con datos_lock en lectura.
+ * Devuelve el usuario o NULL si la sesión no existe o expiró.
+ */
+static Usuario *sesion_reanudar(Conexion *c, const char *token) {
+    if (strlen(token) != SESION_TOKEN) return NULL;
+    uint32_t h;
+    ShardSesiones *sh = sesion_shard(token, &h);
+    pthread_mutex_lock(&sh->mutex);
+    Sesion *x = sesion_buscar(sh, h, token);
+    Usuario *u = x && time(NULL) - x->ultimo_uso < SESION_VIGENCIA ? find_usuario(x->usuario) : NULL;
+    if (u) {
+        Almacen *viejo = c->carrito_alm;
+        memcpy(c->carrito, x->carrito, (size_t)x->carrito_size * sizeof(int));
+        c->carrito_size = x->carrito_size;
+        c->carrito_alm = x->carrito_alm ? almacen_tomar(x->carrito_alm) : NULL;
+        almacen_soltar(viejo);
+        x->ultimo_uso = time(NULL);
+        memcpy(c->sesion, x->token, sizeof(c->sesion));
+    }
+    pthread_mutex_unlock(&sh->mutex);
+    return u;
+}
+
+/* ---------- Libro de pedidos ---------- */
+
+/*
+ * Cada CHECKOUT deja en el libro una línea por unidad del carrito: pedido,
+ * fecha, usuario, método de pago, marca, modelo y precio. El libro está
+ * repartido en particiones, una por hilo que vende (al terminar el hilo se
+ * recicla, como las ranuras de época), y cada partición es una lista de
+ * tramos por columnas en la que solo escribe su dueño: llena la línea y
+ * después publica el contador del tramo, así que SALES_REPORT lee sin
+ * locks. Los textos van una sola vez a un diccionario por clase y las
+ * líneas guardan su número. Cada pedido se agrega además con un write() a
+ * Tienda.pedidos, que se vuelve a leer al arrancar. Ese write no lleva
+ * fsync propio: el pedido completo ya está en el WAL (registro PEDIDO)
+ * antes de anotarse, el checkpoint sincroniza Tienda.pedidos antes de
+ * truncar el WAL y, al arrancar, los pedidos del WAL que no llegaron al
+ * archivo se vuelven a agregar.
+ */
+#define LIBRO_TRAMO       4096  /* líneas por tramo */
+#define REPORTE_MAX_HILOS 16
+#define REPORTE_MODELOS   50    /* los de más ingreso */
+
+enum { NOMBRE_USUARIO, NOMBRE_METODO, NOMBRE_MARCA, NOMBRE_MODELO, N_NOMBRES_LIBRO };
+
+typedef struct TramoLibro {
+    uint64_t pedido[LIBRO_TRAMO];
+    int64_t fecha[LIBRO_TRAMO];
+    double precio[LIBRO_TRAMO];
+    uint32_t nombre[N_NOMBRES_LIBRO][LIBRO_TRAMO];
+    atomic_llong fecha_min;     /* de sus líneas: el reporte salta tramos fuera del rango */
+    atomic_llong fecha_max;
+    atomic_int n;               /* líneas publicadas */
+    _Atomic(struct TramoLibro *) sig;
+} TramoLibro;
+
+typedef struct ParticionLibro {
+    TramoLibro *primero;
+    TramoLibro *ultimo;         /* solo lo usa el dueño */
+    TramoLibro *repuesto;       /* reservado por libro_reservar para cuando 'ultimo' se llene */
+    atomic_bool en_uso;         /* tomada por un hilo vivo */
+    struct ParticionLibro *sig;
+} ParticionLibro;
+
+/* Textos de una clase (usuarios, métodos...); solo crece */
+typedef struct {
+    pthread_mutex_t mutex;
+    const char **textos;
+    size_t n;
+    size_t cap;
+    IndiceHash indice;
+    Arena arena;
+} NombresLibro;
+
+static NombresLibro nombres_libro[N_NOMBRES_LIBRO];
+static _Atomic(ParticionLibro *) libro_particiones;    /* solo crece */
+static __thread ParticionLibro *particion_propia;
+static pthread_key_t libro_clave;
+static atomic_ullong libro_siguiente = 1;   /* número del próximo pedido */
+static atomic_long libro_pedidos;           /* pedidos en memoria */
+static int libro_fd = -1;
+
+/* Registros PEDIDO del WAL reaplicado; libro_iniciar completa con ellos el archivo */
+typedef struct {
+    uint64_t pedido;
+    char *datos;
+    uint32_t largo;
+    int lineas;                 /* unidades del pedido */
+    int anotadas;               /* líneas suyas que ya estaban en el archivo */
+} PedidoWal;
+
+static PedidoWal *libro_wal;
+static size_t libro_wal_n, libro_wal_cap;
+
+static const char *clave_nombre_libro(const void *ctx, int id) {
+    return ((const NombresLibro *)ctx)->textos[id];
+}
+
+/* Número de los 'n' bytes de 'texto' en la clase 'k', agregándolo si es nuevo; -1 sin memoria */
+static int libro_nombre(int k, const char *texto, size_t n) {
+    NombresLibro *nl = &nombres_libro[k];
+    pthread_mutex_lock(&nl->mutex);
+    int id = indice_buscar_n(&nl->indice, texto, n);
+    if (id < 0 && nl->n < INT_MAX && indice_reservar(&nl->indice)
+        && arreglo_crecer((void **)&nl->textos, &nl->cap, nl->n + 1, sizeof(*nl->textos))) {
+        const char *copia = arena_copiar(&nl->arena, texto, n);
+        if (copia) {
+            nl->textos[nl->n] = copia;
+            id = (int)nl->n++;
+            indice_insertar(&nl->indice, id);   /* ya reservado */
+        }
+    }
+    pthread_mutex_unlock(&nl->mutex);
+    return id;
+}
+
+static TramoLibro *tramo_nuevo(void) {
+    TramoLibro *t = malloc(sizeof(*t));
+    if (!t) return NULL;
+    atomic_init(&t->fecha_min, LLONG_MAX);
+    atomic_init(&t->fecha_max, LLONG_MIN);
+    atomic_init(&t->n, 0);
+    atomic_init(&t->sig, NULL);
+    return t;
+}
+
+static void libro_liberar_particion(void *arg) {
+    ParticionLibro *p = arg;
+    atomic_store(&p->en_uso, false);
+}
+
+/* Partición del hilo: reutiliza una libre o agrega una nueva; NULL sin memoria */
+static ParticionLibro *libro_particion(void) {
+    if (particion_propia) return particion_propia;
+    ParticionLibro *p;
+    for (p = atomic_load(&libro_particiones); p; p = p->sig) {
+        bool libre = false;
+        if (atomic_compare_exchange_strong(&p->en_uso, &libre, true)) break;
+    }
+    if (!p) {
+        p = calloc(1, sizeof(*p));
+        if (!p || !(p->primero = tramo_nuevo())) {
+            free(p);
+            return NULL;
+        }
+        p->ultimo = p->primero;
+        atomic_init(&p->en_uso, true);
+        p->sig = atomic_load(&libro_particiones);
+        while (!atomic_compare_exchange_weak(&libro_particiones, &p->sig, p)) {}
+    }
+    pthread_setspecific(libro_clave, p);
+    return particion_propia = p;
+}
+
+/* Una línea al final de la partición 'p'; solo desde su dueño */
+static bool libro_agregar(ParticionLibro *p, uint64_t pedido, int64_t fecha,
+                          const int nombres[N_NOMBRES_LIBRO], double precio) {
+    TramoLibro *t = p->ultimo;
+    int k = atomic_load_explicit(&t->n, memory_order_relaxed);
+    if (k == LIBRO_TRAMO) {
+        TramoLibro *nuevo = p->repuesto ? p->repuesto : tramo_nuevo();
+        if (!nuevo) return false;
+        p->repuesto = NULL;
+        atomic_store_explicit(&t->sig, nuevo, memory_order_release);
+        p->ultimo = t = nuevo;
+        k = 0;
+    }
+    t->pedido[k] = pedido;
+    t->fecha[k] = fecha;
+    t->precio[k] = precio;
+    for (int j = 0; j < N_NOMBRES_LIBRO; ++j) t->nombre[j][k] = (uint32_t)nombres[j];
+    if (fecha < atomic_load_explicit(&t->fecha_min, memory_order_relaxed))
+        atomic_store_explicit(&t->fecha_min, fecha, memory_order_relaxed);
+    if (fecha > atomic_load_explicit(&t->fecha_max, memory_order_relaxed))
+        atomic_store_explicit(&t->fecha_max, fecha, memory_order_relaxed);
+    atomic_store_explicit(&t->n, k + 1, memory_order_release);
+    return true;
+}
+
+static uint64_t libro_numerar(void) {
+    return atomic_fetch_add(&libro_siguiente, 1);
+}
+
+/* Deja lugar para 'n' líneas más (n <= LIBRO_TRAMO): después, libro_agregar no falla */
+static bool libro_reservar(ParticionLibro *p, int n) {
+    if (LIBRO_TRAMO - atomic_load_explicit(&p->ultimo->n, memory_order_relaxed) >= n) return true;
+    if (!p->repuesto) p->repuesto = tramo_nuevo();
+    return p->repuesto != NULL;
+}
+
+/*
+ * Anota un pedido ya confirmado en el WAL; 'metodo' ya viene limpio. Los
+ * nombres y el espacio se consiguen antes de agregar la primera línea: el
+ * pedido entra entero o no entra.
+ */
+static void libro_registrar(uint64_t pedido, const char *usuario, const char *metodo, int64_t fecha,
+                            const LineaPedido *lineas, int n) {
+    ParticionLibro *p = libro_particion();
+    int nombres[MAX_CARRITO][N_NOMBRES_LIBRO];
+    int usuario_id = libro_nombre(NOMBRE_USUARIO, usuario, strlen(usuario));
+    int metodo_id = libro_nombre(NOMBRE_METODO, metodo, strlen(metodo));
+    bool ok = p && usuario_id >= 0 && metodo_id >= 0 && libro_reservar(p, n);
+    char *buf = NULL;
+    size_t tam = 0;
+    FILE *f = open_memstream(&buf, &tam);
+    for (int i = 0; i < n; ++i) {
+        const char *marca = lineas[i].marca, *modelo = lineas[i].modelo;
+        if (f) {
+            fprintf(f, "%llu;%lld;%s;%s;%s;%s;%.2f\n", (unsigned long long)pedido, (long long)fecha,
+                    usuario, metodo, marca, modelo, lineas[i].precio);
+        }
+        if (!ok) continue;
+        nombres[i][NOMBRE_USUARIO] = usuario_id;
+        nombres[i][NOMBRE_METODO] = metodo_id;
+        nombres[i][NOMBRE_MARCA] = libro_nombre(NOMBRE_MARCA, marca, strlen(marca));
+        nombres[i][NOMBRE_MODELO] = libro_nombre(NOMBRE_MODELO, modelo, strlen(modelo));
+        ok = nombres[i][NOMBRE_MARCA] >= 0 && nombres[i][NOMBRE_MODELO] >= 0;
+    }
+    for (int i = 0; ok && i < n; ++i) libro_agregar(p, pedido, fecha, nombres[i], lineas[i].precio);
+    if (ok) atomic_fetch_add(&libro_pedidos, 1);
+    else fprintf(stderr, "[SERVIDOR] Libro: sin memoria para el pedido %llu\n", (unsigned long long)pedido);
+    if (!f || fclose(f) != 0) {
+        fprintf(stderr, "[SERVIDOR] Libro: el pedido %llu no se pudo escribir\n", (unsigned long long)pedido);
+    } else if (libro_fd >= 0 && write(libro_fd, buf, tam) != (ssize_t)tam) {
+        perror("[SERVIDOR] " PEDIDOS_FILE);
+    }
+    free(buf);
+}
+
+/* Deja Tienda.pedidos en disco; el checkpoint lo pide antes de truncar el WAL */
+static bool libro_sincronizar(void) {
+    return libro_fd < 0 || fdatasync(libro_fd) == 0;
+}
+
+static long long campo_entero(Campo c) {
+    char num[32];
+    snprintf(num, sizeof(num), "%.*s", (int)c.n, c.p);
+    return strtoll(num, NULL, 10);
+}
+
+/*
+ * Separa un registro PEDIDO: 'campo' queda con pedido, fecha, usuario y
+ * método, y 'lineas' con las unidades. Devuelve cuántas son, o -1 si el
+ * registro está incompleto.
+ */
+static int pedido_wal_leer(const char *datos, uint32_t largo, const char *campo[4], LineaPedido lineas[MAX_CARRITO]) {
+    const char *q = datos, *fin = datos + largo;
+    int k = 0, n = 0;
+    for (; k < 4 && q < fin; ++k, q += strlen(q) + 1) campo[k] = q;
+    if (k < 4) return -1;
+    while (n < MAX_CARRITO && q < fin) {
+        const char *marca = q, *modelo, *precio;
+        q += strlen(q) + 1;
+        if (q >= fin) return -1;
+        modelo = q;
+        q += strlen(q) + 1;
+        if (q >= fin) return -1;
+        precio = q;
+        q += strlen(q) + 1;
+        lineas[n++] = (LineaPedido){ marca, modelo, strtod(precio, NULL) };
+    }
+    return n;
+}
+
+/* Guarda una copia de un registro PEDIDO al reaplicar el WAL */
+static void libro_pendiente(const char *datos, uint32_t largo) {
+    const char *campo[4];
+    LineaPedido lineas[MAX_CARRITO];
+    int n = pedido_wal_leer(datos, largo, campo, lineas);
+    if (n <= 0) return;
+    char *copia = malloc(largo);
+    if (!copia || !arreglo_crecer((void **)&libro_wal, &libro_wal_cap, libro_wal_n + 1, sizeof(*libro_wal))) {
+        free(copia);
+        fprintf(stderr, "[SERVIDOR] Libro: sin memoria para reaplicar un pedido del WAL\n");
+        return;
+    }
+    memcpy(copia, datos, largo);
+    libro_wal[libro_wal_n++] = (PedidoWal){ strtoull(campo[0], NULL, 10), copia, largo, n, 0 };
+}
+
+static int comparar_pedido_wal(const void *x, const void *y) {
+    uint64_t a = ((const PedidoWal *)x)->pedido, b = ((const PedidoWal *)y)->pedido;
+    return (a > b) - (a < b);
+}
+
+static PedidoWal *libro_pendiente_buscar(uint64_t pedido) {
+    PedidoWal clave = { .pedido = pedido };
+    return libro_wal_n ? bsearch(&clave, libro_wal, libro_wal_n, sizeof(*libro_wal), comparar_pedido_wal) : NULL;
+}
+
+#define PEDIDOS_TMP PEDIDOS_FILE ".tmp"
+
+static bool escribir_temporal(const char *tmp, void (*escribir)(FILE *, const void *), const void *arg);
+
+/* Filas del archivo actual que se conservan al reescribirlo */
+typedef struct {
+    const TrozoCsv *trozos;
+    int n;
+} LibroLeido;
+
+/* Las filas de pedidos completos, y luego los pedidos del WAL que faltaban enteros */
+static void escribir_libro(FILE *f, const void *arg) {
+    const LibroLeido *l = arg;
+    for (int i = 0; i < l->n; ++i) {
+        for (size_t r = 0; r < l->trozos[i].filas; ++r) {
+            const Campo *celda = l->trozos[i].celdas + r * 7;
+            PedidoWal *w = libro_pendiente_buscar((uint64_t)campo_entero(celda[0]));
+            if (w && w->anotadas != w->lineas) continue;
+            fprintf(f, "%.*s\n", (int)(celda[6].p + celda[6].n - celda[0].p), celda[0].p);
+        }
+    }
+    for (size_t i = 0; i < libro_wal_n; ++i) {
+        const PedidoWal *w = &libro_wal[i];
+        if (w->anotadas == w->lineas) continue;
+        const char *campo[4];
+        LineaPedido lineas[MAX_CARRITO];
+        int n = pedido_wal_leer(w->datos, w->largo, campo, lineas);
+        for (int k = 0; k < n; ++k) {
+            fprintf(f, "%s;%s;%s;%s;%s;%s;%.2f\n", campo[0], campo[1], campo[2], campo[3],
+                    lineas[k].marca, lineas[k].modelo, lineas[k].precio);
+        }
+    }
+}
+
+/*
+ * Compara Tienda.pedidos con los pedidos del WAL. Si a alguno le faltan
+ * líneas (no llegaron al disco antes de una caída), reescribe el archivo:
+ * un pedido queda siempre en líneas seguidas, así que los incompletos se
+ * quitan y se vuelven a escribir enteros al final.
+ */
+static void libro_recuperar(void) {
+    qsort(libro_wal, libro_wal_n, sizeof(*libro_wal), comparar_pedido_wal);
+    MapaArchivo mapa = { 0 };
+    TrozoCsv trozos[CSV_MAX_HILOS];
+    int n = 0;
+    bool mapeado = archivo_mapear(PEDIDOS_FILE, &mapa), ok = true;
+    if (mapeado) n = csv_leer(&mapa, &(TrozoCsv){ .campos = 7, .minimo = 7, .col_precio = 6 }, trozos);
+    for (int i = 0; i < n; ++i) {
+        ok = ok && !trozos[i].sin_memoria;
+        for (size_t r = 0; r < trozos[i].filas; ++r) {
+            PedidoWal *w = libro_pendiente_buscar((uint64_t)campo_entero(trozos[i].celdas[r * 7]));
+            if (w) w->anotadas++;
+        }
+    }
+    long faltan = 0;
+    for (size_t i = 0; i < libro_wal_n; ++i) faltan += libro_wal[i].anotadas != libro_wal[i].lineas;
+    if (faltan > 0 && ok) {
+        ok = escribir_temporal(PEDIDOS_TMP, escribir_libro, &(LibroLeido){ trozos, n })
+             && rename(PEDIDOS_TMP, PEDIDOS_FILE) == 0 && sincronizar_directorio();
+        if (ok) printf("[SERVIDOR] Libro: %ld pedidos recuperados del WAL\n", faltan);
+        else perror("[SERVIDOR] " PEDIDOS_FILE);
+    } else if (faltan > 0) {
+        fprintf(stderr, "[SERVIDOR] Libro: sin memoria para recuperar %ld pedidos del WAL\n", faltan);
+    }
+    csv_liberar(trozos, n);
+    if (mapeado) archivo_desmapear(&mapa);
+    for (size_t i = 0; i < libro_wal_n; ++i) free(libro_wal[i].datos);
+}
+
+/* Lee Tienda.pedidos (en paralelo si es grande) y lo abre para seguir agregando */
+static void libro_iniciar(void) {
+    pthread_key_create(&libro_clave, libro_liberar_particion);
+    for (int k = 0; k < N_NOMBRES_LIBRO; ++k) {
+        pthread_mutex_init(&nombres_libro[k].mutex, NULL);
+        nombres_libro[k].indice = (IndiceHash){ .clave = clave_nombre_libro, .ctx = &nombres_libro[k] };
+    }
+    libro_recuperar();
+    uint64_t siguiente = 1;
+    if (libro_wal_n) siguiente = libro_wal[libro_wal_n - 1].pedido + 1;
+    free(libro_wal);
+    libro_wal = NULL;
+    libro_wal_n = libro_wal_cap = 0;
+    MapaArchivo mapa;
+    bool sin_fin_de_linea = false;
+    if (archivo_mapear(PEDIDOS_FILE, &mapa)) {
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        TrozoCsv trozos[CSV_MAX_HILOS];
+        int n = csv_leer(&mapa, &(TrozoCsv){ .campos = 7, .minimo = 7, .col_precio = 6 }, trozos);
+        ParticionLibro *p = libro_particion();
+        uint64_t anterior = 0;
+        long pedidos = 0, lineas = 0;
+        bool ok = p != NULL;
+        for (int i = 0; i < n; ++i) {
+            ok = ok && !trozos[i].sin_memoria;
+            for (size_t r = 0; ok && r < trozos[i].filas; ++r) {
+                const Campo *celda = trozos[i].celdas + r * 7;
+                uint64_t pedido = (uint64_t)campo_entero(celda[0]);
+                int nombres[N_NOMBRES_LIBRO];
+                for (int k = 0; k < N_NOMBRES_LIBRO; ++k) {
+                    nombres[k] = libro_nombre(k, celda[2 + k].p, celda[2 + k].n);
+                    ok = ok && nombres[k] >= 0;
+                }
+                ok = ok && libro_agregar(p, pedido, campo_entero(celda[1]), nombres, trozos[i].precios[r]);
+                pedidos += pedido != anterior;
+                anterior = pedido;
+                lineas++;
+                if (pedido >= siguiente) siguiente = pedido + 1;
+            }
+        }
+        csv_liberar(trozos, n);
+        sin_fin_de_linea = mapa.tam > 0 && mapa.datos[mapa.tam - 1] != '\n';
+        archivo_desmapear(&mapa);
+        if (!ok) fprintf(stderr, "[SERVIDOR] Libro: sin memoria al leer %s\n", PEDIDOS_FILE);
+        atomic_store(&libro_pedidos, pedidos);
+        printf("[SERVIDOR] Libro de pedidos: %ld pedidos (%ld líneas) en %.3f s\n", pedidos, lineas,
+               segundos_desde(&t0));
+    }
+    libro_fd = open(PEDIDOS_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (libro_fd < 0) perror("[SERVIDOR] " PEDIDOS_FILE);
+    /* una línea cortada por una caída no se pega a la siguiente */
+    else if (sin_fin_de_linea && write(libro_fd, "\n", 1) != 1) perror("[SERVIDOR] " PEDIDOS_FILE);
+    atomic_store(&libro_siguiente, siguiente);
+}
+
+/* Un tramo para un hilo del reporte, con el último pedido del tramo anterior (0 si no hay) */
+typedef struct {
+    const TramoLibro *t;
+    uint64_t pedido_anterior;
+} TrabajoReporte;
+
+/* Lo que suma un hilo del reporte: por método cuenta pedidos; por marca y modelo, unidades */
+typedef struct {
+    const TrabajoReporte *trabajos;
+    int n_trabajos;
+    atomic_int *siguiente;
+    int64_t desde, hasta;
+    size_t n_nombres[N_NOMBRES_LIBRO];
+    long pedidos, unidades;
+    double total;
+    long *cuenta[N_NOMBRES_LIBRO];      /* NULL en las clases que no se reportan */
+    double *ingreso[N_NOMBRES_LIBRO];
+} ParteReporte;
+
+static const bool reporte_por[N_NOMBRES_LIBRO] = {
+    [NOMBRE_METODO] = true, [NOMBRE_MARCA] = true, [NOMBRE_MODELO] = true,
+};
+
+static void *reporte_sumar(void *arg) {
+    ParteReporte *pr = arg;
+    for (int w; (w = atomic_fetch_add(pr->siguiente, 1)) < pr->n_trabajos;) {
+        const TramoLibro *t = pr->trabajos[w].t;
+        int n = atomic_load_explicit(&t->n, memory_order_acquire);
+        if (n == 0 || atomic_load_explicit(&t->fecha_max, memory_order_relaxed) < pr->desde
+            || atomic_load_explicit(&t->fecha_min, memory_order_relaxed) > pr->hasta)
+            continue;
+        uint64_t anterior = pr->trabajos[w].pedido_anterior;
+        const uint32_t *metodo = t->nombre[NOMBRE_METODO], *marca = t->nombre[NOMBRE_MARCA];
+        const uint32_t *modelo = t->nombre[NOMBRE_MODELO];
+        for (int k = 0; k < n; ++k) {
+            bool nuevo = t->pedido[k] != anterior;
+            anterior = t->pedido[k];
+            if (t->fecha[k] < pr->desde || t->fecha[k] > pr->hasta) continue;
+            /* nombres que aparecieron después de empezar el reporte: la línea también */
+            if (metodo[k] >= pr->n_nombres[NOMBRE_METODO] || marca[k] >= pr->n_nombres[NOMBRE_MARCA]
+                || modelo[k] >= pr->n_nombres[NOMBRE_MODELO])
+                continue;
+            double precio = t->precio[k];
+            pr->unidades++;
+            pr->total += precio;
+            if (nuevo) {
+                pr->pedidos++;
+                pr->cuenta[NOMBRE_METODO][metodo[k]]++;
+            }
+            pr->ingreso[NOMBRE_METODO][metodo[k]] += precio;
+            pr->cuenta[NOMBRE_MARCA][marca[k]]++;
+            pr->ingreso[NOMBRE_MARCA][marca[k]] += precio;
+            pr->cuenta[NOMBRE_MODELO][modelo[k]]++;
+            pr->ingreso[NOMBRE_MODELO][modelo[k]] += precio;
+        }
+    }
+    return NULL;
+}
+
+/* "AAAA-MM-DD" (hora local) o segundos desde 1970; vacío: sin límite. 'fin': hasta el final de ese día */
+static bool reporte_fecha(const char *s, size_t n, bool fin, int64_t *out) {
+    char buf[32];
+    if (n == 0) {
+        *out = fin ? INT64_MAX : INT64_MIN;
+        return true;
+    }
+    if (n >= sizeof(buf)) return false;
+    memcpy(buf, s, n);
+    buf[n] = '\0';
+    if (strspn(buf, "0123456789") == n) {
+        *out = strtoll(buf, NULL, 10);
+        return true;
+    }
+    struct tm tmv = {0};
+    const char *resto = strptime(buf, "%Y-%m-%d", &tmv);
+    if (!resto || *resto) return false;
+    tmv.tm_isdst = -1;
+    if (fin) tmv.tm_mday++;
+    time_t t = mktime(&tmv);
+    if (t == (time_t)-1) return false;
+    *out = fin ? (int64_t)t - 1 : (int64_t)t;
+    return true;
+}
+
+typedef struct {
+    int id;
+    long n;
+    double ingreso;
+} FilaReporte;
+
+static int comparar_fila_reporte(const void *x, const void *y) {
+    const FilaReporte *a = x, *b = y;
+    if (a->ingreso != b->ingreso) return a->ingreso < b->ingreso ? 1 : -1;
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+/* Líneas "CLASE|nombre|cuenta|ingreso" de la clase 'k', de mayor a menor ingreso, hasta 'max' */
+static bool reporte_listar(Respuesta *r, const ParteReporte *pr, int k, const char *clase, size_t max) {
+    FilaReporte *filas = malloc((pr->n_nombres[k] ? pr->n_nombres[k] : 1) * sizeof(*filas));
+    if (!filas) return false;
+    size_t n = 0;
+    for (size_t i = 0; i < pr->n_nombres[k]; ++i) {
+        if (pr->cuenta[k][i] || pr->ingreso[k][i] != 0)
+            filas[n++] = (FilaReporte){ (int)i, pr->cuenta[k][i], pr->ingreso[k][i] };
+    }
+    qsort(filas, n, sizeof(*filas), comparar_fila_reporte);
+    pthread_mutex_lock(&nombres_libro[k].mutex);
+    for (size_t i = 0; i < n && i < max; ++i)
+        resp_printf(r, "%s|%s|%ld|%.2f\n", clase, nombres_libro[k].textos[filas[i].id], filas[i].n, filas[i].ingreso);
+    pthread_mutex_unlock(&nombres_libro[k].mutex);
+    free(filas);
+    return true;
+}
+
+/*
+ * SALES_REPORT:<desde>:<hasta>. Los tramos de todas las particiones se
+ * reparten entre hasta REPORTE_MAX_HILOS hilos (uno por CPU), cada uno
+ * suma en sus propios arreglos por número de nombre y al final se juntan.
+ * Responde "OK|pedidos|unidades|ingreso" y las líneas MARCA|, METODO| y
+ * MODELO| (los REPORTE_MODELOS de más ingreso).
+ */
+static void libro_reporte(const char *arg, Respuesta *r) {
+    int64_t desde, hasta;
+    size_t largo = strcspn(arg, ":");
+    if (!reporte_fecha(arg, largo, false, &desde)
+        || !reporte_fecha(arg + largo + (arg[largo] == ':'), strlen(arg + largo + (arg[largo] == ':')), true, &hasta)) {
+        resp_agregar(r, "ERROR|Fechas invalidas\n");
+        return;
+    }
+    ParteReporte base = { .desde = desde, .hasta = hasta };
+    for (int k = 0; k < N_NOMBRES_LIBRO; ++k) {
+        pthread_mutex_lock(&nombres_libro[k].mutex);
+        base.n_nombres[k] = nombres_libro[k].n;
+        pthread_mutex_unlock(&nombres_libro[k].mutex);
+    }
+    TrabajoReporte *trabajos = NULL;
+    size_t n_trabajos = 0, cap = 0;
+    bool ok = true;
+    for (ParticionLibro *p = atomic_load(&libro_particiones); p && ok; p = p->sig) {
+        uint64_t anterior = 0;
+        for (const TramoLibro *t = p->primero, *sig; t && ok; t = sig) {
+            sig = atomic_load_explicit(&t->sig, memory_order_acquire);
+            if ((ok = arreglo_crecer((void **)&trabajos, &cap, n_trabajos + 1, sizeof(*trabajos))))
+                trabajos[n_trabajos++] = (TrabajoReporte){ t, anterior };
+            /* un tramo con siguiente está lleno y ya no cambia */
+            if (sig) anterior = t->pedido[LIBRO_TRAMO - 1];
+        }
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int hilos = cpus > 0 ? (int)cpus : 1;
+    if (hilos > REPORTE_MAX_HILOS) hilos = REPORTE_MAX_HILOS;
+    if ((size_t)hilos > n_trabajos) hilos = n_trabajos > 0 ? (int)n_trabajos : 1;
+    ParteReporte partes[REPORTE_MAX_HILOS];
+    atomic_int siguiente = 0;
+    base.trabajos = trabajos;
+    base.n_trabajos = (int)n_trabajos;
+    base.siguiente = &siguiente;
+    for (int h = 0; h < hilos; ++h) {
+        partes[h] = base;
+        for (int k = 0; k < N_NOMBRES_LIBRO; ++k) {
+            if (!reporte_por[k]) continue;
+            partes[h].cuenta[k] = calloc(base.n_nombres[k] + 1, sizeof(long));
+            partes[h].ingreso[k] = calloc(base.n_nombres[k] + 1, sizeof(double));
+            ok = ok && partes[h].cuenta[k] && partes[h].ingreso[k];
+        }
+    }
+    if (ok) {
+        pthread_t tid[REPORTE_MAX_HILOS];
+        bool lanzado[REPORTE_MAX_HILOS] = { false };
+        for (int h = 1; h < hilos; ++h) lanzado[h] = pthread_create(&tid[h], NULL, reporte_sumar, &partes[h]) == 0;
+        reporte_sumar(&partes[0]);
+        for (int h = 1; h < hilos; ++h) {
+            if (lanzado[h]) pthread_join(tid[h], NULL);
+        }
+        ParteReporte *total = &partes[0];
+        for (int h = 1; h < hilos; ++h) {
+            total->pedidos += partes[h].pedidos;
+            total->unidades += partes[h].unidades;
+            total->total += partes[h].total;
+            for (int k = 0; k < N_NOMBRES_LIBRO; ++k) {
+                for (size_t i = 0; reporte_por[k] && i < base.n_nombres[k]; ++i) {
+                    total->cuenta[k][i] += partes[h].cuenta[k][i];
+                    total->ingreso[k][i] += partes[h].ingreso[k][i];
+                }
+            }
+        }
+        resp_printf(r, "OK|%ld|%ld|%.2f\n", total->pedidos, total->unidades, total->total);
+        ok = reporte_listar(r, total, NOMBRE_MARCA, "MARCA", SIZE_MAX)
+             && reporte_listar(r, total, NOMBRE_METODO, "METODO", SIZE_MAX)
+             && reporte_listar(r, total, NOMBRE_MODELO, "MODELO", REPORTE_MODELOS);
+    }
+    for (int h = 0; h < hilos; ++h) {
+        for (int k = 0; k < N_NOMBRES_LIBRO; ++k) {
+            free(partes[h].cuenta[k]);
+            free(partes[h].ingreso[k]);
+        }
+    }
+    free(trabajos);
+    if (!ok) {
+        /* el OK| y parte de las líneas ya pueden estar en 'r' */
+        resp_vaciar(r);
+        resp_agregar(r, "ERROR|Sin memoria\n");
+    }
+}
+
+/* Lista los primeros FILTRO_MAX productos de un FILTER */
+typedef struct {
+    const Almacen *a;
+    Respuesta *r;
+    int n;
+} FiltroListado;
+
+static bool filtro_listar_uno(void *ctx, int id) {
+    FiltroListado *fl = ctx;
+    const Producto *p = &fl->a->productos[id];
+    resp_printf(fl->r, "%s|%s|%s|%.2f|%s\n", p->modelo, producto_marca(fl->a, id), p->specs,
+                fl->a->col_precio[id], p->imagen);
+    return ++fl->n < FILTRO_MAX;
+}
+
+/* Ejecuta un comando ya delimitado sobre la versión 'inv' y agrega la respuesta a 'r' */
+static void procesar_comando(Conexion *c, const Inventario *inv, const char *buffer, Respuesta *r) {
+    const Almacen *a = inv->alm;
+
+    if (strcmp(buffer, "GET_BRANDS") == 0) {
+        if (inv->catalogo) {
+            resp_contenido(r, contenido_tomar(inv->catalogo->marcas));
+        } else {
+            /* sin memoria extra: una marca sale con su primer producto activo */
+            bool primera = true;
+            for (int i = 0; i < a->n; ++i) {
+                if (!producto_activo(inv, i) || primer_activo_marca(inv, (int)a->col_marca[i]) != i) continue;
+                /* join with '|' without trailing '|' */
+                if (!primera) resp_agregar(r, "|");
+                resp_agregar(r, producto_marca(a, i));
+                primera = false;
+            }
+            resp_agregar(r, "\n");
+        }
+    }
+    else if (strncmp(buffer, "GET_MODELS:", 11) == 0 && strchr(buffer + 11, ';')) {
+        if (inv->catalogo) catalogo_pagina(inv, buffer + 11, r);
+        else resp_agregar(r, "ERROR|Sin memoria\n");
+    }
+    else if (strncmp(buffer, "GET_MODELS:", 11) == 0) {
+        const char* brand = buffer + 11;
+        if (inv->catalogo) {
+            Contenido *modelos = catalogo_modelos(inv, inv->catalogo, brand);
+            if (modelos) resp_contenido(r, contenido_tomar(modelos));
+        } else {
+            int m = indice_buscar(&a->por_marca, brand);
+            for (int k = 0; m >= 0 && k < a->marcas[m].n; ++k) {
+                int i = a->marcas[m].productos[k];
+                if (!producto_activo(inv, i)) continue;
+                resp_printf(r, "%s|%s|%.2f|%s\n",
+                            a->productos[i].modelo,
+                            a->productos[i].specs,
+                            a->col_precio[i],
+                            a->productos[i].imagen);
+            }
+        }
+        if (r->len == 0) resp_agregar(r, "\n");
+    }
+    else if (strncmp(buffer, "ADD_TO_CART:", 12) == 0) {
+        const char* modelo = buffer + 12;
+        carrito_actualizar(c, inv);
+        if (c->carrito_size >= MAX_CARRITO) {
+            resp_agregar(r, "ERROR: Carrito lleno\n");
+        } else {
+            int id = find_model(inv, modelo);
+            if (id >= 0 && atomic_load(&a->existencias[id]) == 0) {
+                resp_agregar(r, "ERROR: Sin existencias\n");
+            } else if (id >= 0) {
+                c->carrito[c->carrito_size++] = id;
+                sesion_guardar(c);
+                resp_agregar(r, "OK\n");
+            } else {
+                resp_agregar(r, "ERROR: Modelo no encontrado\n");
+            }
+        }
+    }
+    else if (strncmp(buffer, "SEARCH:", 7) == 0) {
+        int ids[BUSQUEDA_MAX];
+        int n = busqueda_consultar(a, inv->activo, buffer + 7, ids);
+        if (n < 0) {
+            resp_agregar(r, "ERROR|Consulta vacia\n");
+        } else if (n == 0) {
+            resp_agregar(r, "EMPTY\n");
+        } else {
+            /* mismo formato que GET_CART_ITEMS, del más relevante al menos */
+            for (int i = 0; i < n; ++i) {
+                const Producto *p = &a->productos[ids[i]];
+                resp_printf(r, "%s|%s|%s|%.2f|%s\n", p->modelo, producto_marca(a, ids[i]), p->specs,
+                            a->col_precio[ids[i]], p->imagen);
+            }
+        }
+    }
+    else if (strncmp(buffer, "FILTER:", 7) == 0) {
+        Roaring res;
+        const char *error = filtro_evaluar(a, inv->activo, buffer + 7, &res);
+        if (error) {
+            resp_printf(r, "ERROR|%s\n", error);
+        } else {
+            long total = roaring_cuantos(&res);
+            resp_printf(r, "OK|%ld\n", total);
+            FiltroListado fl = { a, r, 0 };
+            roaring_recorrer(&res, filtro_listar_uno, &fl);
+            /* FACETA|faceta|valor|productos, los valores con más productos primero */
+            for (int k = 0; k < N_FACETAS; ++k) {
+                ConteoFaceta conteo[FACETA_VALORES];
+                int m = faceta_contar(a, k, &res, conteo);
+                for (int i = 0; i < m; ++i) {
+                    resp_printf(r, "FACETA|%s|%s|%ld\n", facetas_nombre[k],
+                                a->facetas.faceta[k].valores[conteo[i].valor].texto, conteo[i].n);
+                }
+            }
+            roaring_liberar(&res);
+        }
+    }
+    else if (strcmp(buffer, "GET_CART_ITEMS") == 0) {
+        carrito_actualizar(c, inv);
+        int write_idx = 0;
+        for (int i = 0; i < c->carrito_size; ++i) {
+            if (producto_activo(inv, c->carrito[i])) {
+                c->carrito[write_idx++] = c->carrito[i];
+            }
+        }
+        c->carrito_size = write_idx;
+
+        if (c->carrito_size == 0) {
+            resp_agregar(r, "EMPTY\n");
+        } else {
+            for (int i = 0; i < c->carrito_size; ++i) {
+                const Producto *p = &a->productos[c->carrito[i]];
+                resp_printf(r, "%s|%s|%s|%.2f|%s\n",
+                            p->modelo,
+                            producto_marca(a, c->carrito[i]),
+                            p->specs,
+                            a->col_precio[c->carrito[i]],
+                            p->imagen);
+            }
+        }
+    }
+    else if (strncmp(buffer, "CHECKOUT:", 9) == 0) {
+        if (!c->logged_in) {
+            resp_agregar(r, "ERROR:LOGIN_REQUIRED\n");
+            return;
+        }
+        const char* metodo = buffer + 9;
+        carrito_actualizar(c, inv);
+        int write_idx = 0;
+        for (int i = 0; i < c->carrito_size; ++i) {
+            if (producto_activo(inv, c->carrito[i])) {
+                c->carrito[write_idx++] = c->carrito[i];
+            }
+        }
+        c->carrito_size = write_idx;
+        if (c->carrito_size == 0) {
+            resp_agregar(r, "ERROR:CART_EMPTY\n");
+            return;
+        }
+        time_t now = time(NULL);
+        if (!carrito_vender(c, inv, metodo, now, r)) return;
+        double total = 0.0;
+        for (int i = 0; i < c->carrito_size; ++i) total += a->col_precio[c->carrito[i]];
+        struct tm tmv;
+        localtime_r(&now, &tmv);
+        char fecha[32];
+        strftime(fecha, sizeof(fecha), "%Y-%m-%d %H:%M:%S", &tmv);
+        resp_printf(r, "OK|%s|%.2f\n", fecha, total);
+        for (int i = 0; i < c->carrito_size; ++i) {
+            const Producto *p = &a->productos[c->carrito[i]];
+            resp_printf(r, "%s|%s|%s|%.2f|%s\n",
+                        p->modelo,
+                        producto_marca(a, c->carrito[i]),
+                        p->specs,
+                        a->col_precio[c->carrito[i]],
+                        p->imagen);
+        }
+        c->carrito_size = 0;
+        sesion_guardar(c);
+    }
+    else if (strcmp(buffer, "SALES_REPORT") == 0 || strncmp(buffer, "SALES_REPORT:", 13) == 0) {
+        if (!c->logged_in || strcmp(c->current_role, "admin") != 0) {
+            resp_agregar(r, "ERROR|SIN_PERMISOS\n");
+        } else {
+            libro_reporte(buffer[12] ? buffer + 13 : "", r);
+        }
+    }
+    else if (strncmp(buffer, "RESUME:", 7) == 0) {
+        Usuario *u = sesion_reanudar(c, buffer + 7);
+        if (u) {
+            sesion_iniciar(c, u);
+            resp_printf(r, "OK|%s|%d\n", u->role, c->carrito_size);
+        } else {
+            resp_agregar(r, "ERROR|SESION_INVALIDA\n");
+        }
+    }
+    else if (strncmp(buffer, "REMOVE_PRODUCT:", 15) == 0) {
+        if (!c->logged_in || strcmp(c->current_role, "admin") != 0) {
+            resp_agregar(r, "ERROR|SIN_PERMISOS\n");
+        } else {
+            const char *error = inventario_quitar(buffer + 15);
+            if (error) resp_printf(r, "ERROR|%s\n", error);
+            else resp_agregar(r, "OK\n");
+        }
+    }
+    else if (strcmp(buffer, "GET_ALL_PRODUCTS") == 0) {
+        if (!c->logged_in || strcmp(c->current_role, "admin") != 0) {
+            resp_agregar(r, "ERROR|SIN_PERMISOS\n");
+        } else {
+            bool any = false;
+            /* de 64 en 64 por el mapa de activos: las bajas ni se miran */
+            for (size_t w = 0; w < mapa_palabras(a->n); ++w) {
+                for (uint64_t m = inv->activo[w]; m; m &= m - 1) {
+                    int i = (int)(w * 64) + __builtin_ctzll(m);
+                    any = true;
+                    resp_printf(r, "%s|%s|%s|%.2f\n",
+                                producto_marca(a, i),
+                                a->productos[i].modelo,
+                                a->productos[i].specs,
+                                a->col_precio[i]);
+                }
+            }
+            if (!any) resp_agregar(r, "EMPTY\n");
+        }
+    }
+    else if (strcmp(buffer, "STATS") == 0) {
+        if (!c->logged_in || strcmp(c->current_role, "admin") != 0) {
+            resp_agregar(r, "ERROR|SIN_PERMISOS\n");
+        } else {
+            /* SHARD|id|conexiones activas|aceptadas en total */
+            for (int i = 0; i < num_shards; ++i) {
+                resp_printf(r, "SHARD|%d|%ld|%ld\n",
+                            shards[i].id,
+                            atomic_load(&shards[i].activas),
+                            atomic_load(&shards[i].aceptadas));
+            }
+            resp_printf(r, "INVENTARIO|%lu\n", inv->gen);
+            /* ADMISION|activas|tope|rechazadas por el tope|rechazadas por IP|comandos rechazados|IPs sin cubeta */
+            resp_printf(r, "ADMISION|%ld|%ld|%lu|%lu|%lu|%lu\n", atomic_load(&admision.activas),
+                        admision.max_conexiones, atomic_load(&admision.rechazadas_max),
+                        atomic_load(&admision.rechazadas_ip), atomic_load(&admision.comandos_rechazados),
+                        atomic_load(&admision.sin_cubeta));
+            resp_printf(r, "SESIONES|%ld\n", atomic_load(&sesiones_total));
+            resp_printf(r, "PEDIDOS|%ld\n", atomic_load(&libro_pedidos));
+            /* WAL|registros|fsyncs|lotes: con escrituras concurrentes hay menos fsyncs que registros */
+            resp_printf(r, "WAL|%lu|%lu|%lu\n", atomic_load(&wal.registros), atomic_load(&wal.fsyncs),
+                        atomic_load(&wal.lotes));
+            /* AUTH|hilos|en cola|máximo en cola|rechazados|verificaciones|us por verificación|us máximo|us de espera en cola */
+            unsigned long verif = atomic_load(&auth.verificaciones), atendidos = atomic_load(&auth.atendidos);
+            resp_printf(r, "AUTH|%d|%d|%d|%lu|%lu|%lu|%lu|%lu\n", auth.hilos, atomic_load(&auth.en_cola),
+                        atomic_load(&auth.max_en_cola), atomic_load(&auth.rechazados), verif,
+                        verif ? atomic_load(&auth.verif_ns) / verif / 1000 : 0,
+                        atomic_load(&auth.verif_ns_max) / 1000,
+                        atendidos ? atomic_load(&auth.espera_ns) / atendidos / 1000 : 0);
+        }
+    }
+    else if (strncmp(buffer, "GET_IMAGE:", 10) == 0) {
+        /* ruta como viene en el inventario, nombre de archivo o modelo */
+        const char *arg = buffer + 10;
+        int id = find_model(inv, arg);
+        const char *nombre = imagen_nombre_valido(id >= 0 ? a->productos[id].imagen : arg);
+        Imagen *img = nombre ? imagen_obtener(nombre) : NULL;
+        if (!img) {
+            resp_agregar(r, "ERROR|NO_ENCONTRADO\n");
+        } else {
+            /* OK|bytes|mtime y a continuación el contenido del archivo */
+            resp_printf(r, "OK|%zu|%lld\n", img->base.tam, (long long)img->mtime);
+            resp_contenido(r, &img->base);
+        }
+    }
+    else if (strcmp(buffer, PROTO_LINEAS) == 0) {
+        /* el cambio de modo ya lo hizo conexion_comando; esta respuesta aún va sin encabezado */
+        resp_agregar(r, "OK\n");
+    }
+    else {
+        resp_agregar(r, "COMANDO_NO_VALIDO\n");
+    }
+}
+
+/*
+ * LOGIN y REGISTER: la clave se copia con datos_lock en lectura, el hash
+ * se resuelve en el pool de autenticación sin ningún lock tomado y el
+ * resultado se aplica después con el lock de nuevo.
+ */
+static void login_procesar(Conexion *c, const char *payload, Respuesta *r) {
+    char copy[512];
+    strncpy(copy, payload, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    char *sep = strchr(copy, '|');
+    if (!sep) {
+        resp_agregar(r, "ERROR\n");
+        return;
+    }
+    *sep = '\0';
+    const char *user = copy;
+    const char *pass = sep + 1;
+    char guardada[CLAVE_MAX];
+    pthread_rwlock_rdlock(&datos_lock);
+    Usuario *u = find_usuario(user);
+    snprintf(guardada, sizeof(guardada), "%s", u ? u->password : clave_ficticia);
+    pthread_rwlock_unlock(&datos_lock);
+
+    int ok = auth_pedir(pass, guardada, NULL);
+    explicit_bzero(guardada, sizeof(guardada));
+    if (ok < 0) {
+        resp_agregar(r, RESPUESTA_OCUPADO);
+        return;
+    }
+    pthread_rwlock_rdlock(&datos_lock);
+    u = ok ? find_usuario(user) : NULL;
+    if (u) {
+        resp_printf(r, "OK|%s\n", u->role);
+        sesion_iniciar(c, u);
+        /* en otra línea: el cliente GTK toma el rol hasta el '\n' */
+        const char *token = sesion_crear(c);
+        if (token) resp_printf(r, "SESION|%s\n", token);
+    } else {
+        resp_agregar(r, "ERROR\n");
+    }
+    pthread_rwlock_unlock(&datos_lock);
+}
+
+static void registro_procesar(const char *payload, Respuesta *r) {
+    char copy[512];
+    strncpy(copy, payload, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    char *sep = strchr(copy, '|');
+    if (!sep) {
+        resp_agregar(r, "ERROR|Formato invalido\n");
+        return;
+    }
+    *sep = '\0';
+    const char *user = copy;
+    const char *pass = sep + 1;
+    pthread_rwlock_rdlock(&datos_lock);
+    bool existe = find_usuario(user) != NULL;
+    pthread_rwlock_unlock(&datos_lock);
+    char hash[CLAVE_MAX];
+    int ok;
+    if (existe) {
+        resp_agregar(r, "ERROR|Usuario existente\n");
+    } else if (strlen(user) < 3 || strlen(pass) < 4) {
+        resp_agregar(r, "ERROR|Datos demasiado cortos\n");
+    } else if (strpbrk(user, "|\r\n") || strpbrk(pass, "|\r\n")) {
+        resp_agregar(r, "ERROR|Caracteres invalidos\n");
+    } else if ((ok = auth_pedir(pass, NULL, hash)) <= 0) {
+        resp_agregar(r, ok < 0 ? RESPUESTA_OCUPADO : "ERROR|No se pudo registrar\n");
+    } else {
+        /* otro REGISTER pudo ganarle mientras se calculaba el hash */
+        int alta = usuario_alta(user, hash, "cliente");
+        if (alta == ALTA_EXISTE) resp_agregar(r, "ERROR|Usuario existente\n");
+        else if (alta == ALTA_ERROR) resp_agregar(r, "ERROR|No se pudo registrar\n");
+        else resp_agregar(r, "OK\n");
+    }
+}
+
+/*
+ * Pasa a hash las claves que siguen en texto plano (Usuarios.csv de antes
+ * o altas viejas del WAL), de a una, con prioridad baja y fuera del lock.
+ * Cada cambio va al WAL y el checkpoint lo lleva al CSV.
+ */
+static void *hilo_migrar_claves(void *arg) {
+    (void)arg;
+    if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), MIGRAR_NICE) != 0) perror("[SERVIDOR] setpriority");
+    char user[512], plano[CLAVE_MAX], hash[CLAVE_MAX];
+    int migradas = 0;
+    for (int i = 0;; ++i) {
+        pthread_rwlock_rdlock(&datos_lock);
+        bool fin = i >= usuarios_size;
+        bool pendiente = !fin && !clave_es_hash(usuarios[i].password)
+                         && strlen(usuarios[i].username) < sizeof(user)
+                         && strlen(usuarios[i].password) < sizeof(plano);
+        if (pendiente) {
+            strcpy(user, usuarios[i].username);
+            strcpy(plano, usuarios[i].password);
+        }
+        pthread_rwlock_unlock(&datos_lock);
+        if (fin) break;
+        if (!pendiente || !clave_hash(plano, hash)) continue;
+
+        NodoWal *nodo = NULL;
+        pthread_rwlock_wrlock(&datos_lock);
+        Usuario *u = &usuarios[i];      /* los ids no cambian; el arreglo sí puede moverse */
+        char *dup = strcmp(u->password, plano) == 0 ? strdup(hash) : NULL;
+        if (dup && (nodo = wal_agregar(WAL_CLAVE_USUARIO, (const char *[]){ user, hash }, 2))) {
+            explicit_bzero(u->password, strlen(u->password));
+            free(u->password);
+            u->password = dup;
+        } else {
+            free(dup);
+        }
+        pthread_rwlock_unlock(&datos_lock);
+        explicit_bzero(plano, sizeof(plano));
+        if (nodo && wal_esperar(nodo)) migradas++;
+    }
+    if (migradas > 0) printf("[SERVIDOR] Claves migradas a yescrypt: %d\n", migradas);
+    return NULL;
+}
+
+static void ejecutar_comando(Conexion *c, const char *cmd, Respuesta *r) {
+    if (strncmp(cmd, "LOGIN:", 6) == 0) {
+        login_procesar(c, cmd + 6, r);
+    } else if (strncmp(cmd, "REGISTER:", 9) == 0) {
+        registro_procesar(cmd + 9, r);
+    } else {
+        bool resume = strncmp(cmd, "RESUME:", 7) == 0;
+        if (resume) pthread_rwlock_rdlock(&datos_lock);
+        const Inventario *inv = inventario_entrar();
+        procesar_comando(c, inv, cmd, r);
+        inventario_salir();
+        if (resume) pthread_rwlock_unlock(&datos_lock);
+    }
+}
+
+/* ejecutar_comando si la IP tiene fichas */
+static void atender_comando(Conexion *c, const char *cmd, Respuesta *r) {
+    if (admision_comando(c)) ejecutar_comando(c, cmd, r);
+    else resp_agregar(r, RESPUESTA_OCUPADO);
+}
+
+/* ---------- Reproducción y checkpoint del WAL ---------- */
+
+/*
+ * Aplica los registros posteriores al último checkpoint sobre los datos
+ * recién cargados de los CSV; las bajas van directo a 'inv', que aún no
+ * se publica. Los cambios al inventario anteriores a la última recarga se
+ * saltan: el CSV que se acaba de leer ya es el recargado. Devuelve cuántos
+ * cambios hizo al inventario.
+ */
+static int wal_reproducir(Inventario *inv) {
+    MapaArchivo m;
+    if (!archivo_mapear(WAL_FILE, &m)) return 0;
+    const char *p = m.datos, *fin = m.datos + m.tam, *datos;
+    CabeceraWal h;
+    const char *recarga = m.datos;
+    while (wal_siguiente(&p, fin, &h, &datos)) {
+        if (h.tipo == WAL_RECARGA_INVENTARIO) recarga = p;
+    }
+    p = m.datos;
+    int registros = 0, quitados = 0;
+    while (wal_siguiente(&p, fin, &h, &datos)) {
+        bool de_inventario = h.tipo == WAL_QUITAR_PRODUCTO || h.tipo == WAL_VENTA;
+        if (de_inventario && p <= recarga) continue;
+        /* datos: cadenas seguidas; las que falten quedan vacías */
+        const char *campo[3] = { "", "", "" };
+        const char *q = datos;
+        for (int i = 0; i < 3 && q < datos + h.largo; ++i) {
+            campo[i] = q;
+            q += strlen(q) + 1;
+        }
+        registros++;
+        if (h.tipo == WAL_QUITAR_PRODUCTO) {
+            int id = find_model(inv, campo[0]);
+            if (id >= 0) {
+                inventario_desactivar(inv, id);
+                quitados++;
+            }
+        } else if (h.tipo == WAL_PEDIDO) {
+            /* el libro se completa aunque la venta sea de antes de la recarga */
+            libro_pendiente(datos, h.largo);
+            if (p <= recarga) continue;
+            const char *pedido[4];
+            LineaPedido lineas[MAX_CARRITO];
+            int n = pedido_wal_leer(datos, h.largo, pedido, lineas);
+            for (int k = 0; k < n; ++k) {
+                int id = find_model(inv, lineas[k].modelo);
+                if (id < 0) continue;
+                int e = atomic_load(&inv->alm->existencias[id]);
+                if (e != SIN_LIMITE && e > 0) atomic_store(&inv->alm->existencias[id], e - 1);
+            }
+        } else if (h.tipo == WAL_VENTA) {
+            for (const char *q = datos; q < datos + h.largo;) {
+                const char *modelo = q;
+                q += strlen(q) + 1;
+                if (q >= datos + h.largo) break;
+                int cantidad = atoi(q);
+                q += strlen(q) + 1;
+                int id = find_model(inv, modelo);
+                if (id < 0) continue;
+                int e = atomic_load(&inv->alm->existencias[id]);
+                if (e != SIN_LIMITE) atomic_store(&inv->alm->existencias[id], e > cantidad ? e - cantidad : 0);
+            }
+        } else if (h.tipo == WAL_ALTA_USUARIO) {
+            if (!find_usuario(campo[0])) add_user(campo[0], campo[1], campo[2]);
+        } else if (h.tipo == WAL_ROL_USUARIO) {
+            Usuario *u = find_usuario(campo[0]);
+            if (u) usuario_cambiar_rol(u, campo[1]);
+        } else if (h.tipo == WAL_CLAVE_USUARIO) {
+            Usuario *u = find_usuario(campo[0]);
+            char *clave = u ? strdup(campo[1]) : NULL;
+            if (clave) {
+                free(u->password);
+                u->password = clave;
+            }
+        }
+    }
+    archivo_desmapear(&m);
+    if (registros > 0) printf("[SERVIDOR] WAL: %d cambios reaplicados\n", registros);
+    return quitados;
+}
+
+/*
+ * Firma del CSV del inventario que refleja la memoria: el que se cargó o el
+ * último que escribió un checkpoint. Si el archivo ya no la tiene, alguien
+ * lo reemplazó y hay que recargarlo. Con inventario_mutex.
+ */
+static FirmaArchivo inventario_firma;
+
+/* Escribe 'tmp' completo y lo deja en disco */
+static bool escribir_temporal(const char *tmp, void (*escribir)(FILE *, const void *), const void *arg) {
+    FILE *f = fopen(tmp, "w");
+    if (!f) return false;
+    escribir(f, arg);
+    bool ok = !ferror(f);
+    ok = fflush(f) == 0 && ok;
+    ok = fsync(fileno(f)) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+    return ok;
+}
+
+/* Pasa el estado actual a los CSV y vacía el WAL; detiene a los que escriben mientras tanto */
+static bool wal_checkpoint(void) {
+    pthread_mutex_lock(&inventario_mutex);
+    pthread_rwlock_rdlock(&datos_lock);
+    bool ok = true;
+    pthread_mutex_lock(&wal.mutex);
+    bool pendiente = wal.tam > 0 && !atomic_load(&wal.error);
+    pthread_mutex_unlock(&wal.mutex);
+    if (pendiente) {
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        /* un CSV nuevo que aún no se recargó no se pisa: la recarga lo reemplaza todo */
+        bool propio = firma_igual(firma_archivo(INVENTARIO_FILE), inventario_firma);
+        ventas_pausar();        /* las existencias del CSV y el corte del WAL deben coincidir */
+        ok = (!propio || escribir_temporal(INVENTARIO_TMP, escribir_inventario, atomic_load(&inventario_actual)))
+             && escribir_temporal(USUARIOS_TMP, escribir_usuarios, NULL)
+             && libro_sincronizar()
+             && wal_registrar(WAL_CHECKPOINT, NULL, 0)
+             && (!propio || rename(INVENTARIO_TMP, INVENTARIO_FILE) == 0)
+             && rename(USUARIOS_TMP, USUARIOS_FILE) == 0
+             && sincronizar_directorio()
+             && wal_truncar();
+        ventas_reanudar();
+        if (propio) inventario_firma = firma_archivo(INVENTARIO_FILE);
+        if (ok) printf("[SERVIDOR] Checkpoint del WAL en %.3f s\n", segundos_desde(&t0));
+        else perror("[SERVIDOR] checkpoint");
+    }
+    pthread_rwlock_unlock(&datos_lock);
+    pthread_mutex_unlock(&inventario_mutex);
+    return ok;
+}
+
+static void *hilo_checkpoint(void *arg) {
+    (void)arg;
+    int segundos = 0;
+    for (;;) {
+        sleep(1);
+        segundos++;
+        pthread_mutex_lock(&wal.mutex);
+        uint64_t tam = wal.tam;
+        pthread_mutex_unlock(&wal.mutex);
+        if (tam >= WAL_CHECKPOINT_BYTES || (tam > 0 && segundos >= WAL_CHECKPOINT_SEG)) {
+            wal_checkpoint();
+            segundos = 0;
+        }
+    }
+    return NULL;
+}
+
+/* ---------- Recarga del inventario en caliente ---------- */
+
+/*
+ * Un hilo vigila el directorio con inotify. Cuando el CSV del inventario
+ * se reemplaza o se termina de escribir, espera a que deje de cambiar, lo
+ * lee en un almacén nuevo con prioridad baja (sin locks: los comandos
+ * siguen con la versión vigente) y publica una versión que lo usa, igual
+ * que una baja. Los carritos pasan al almacén nuevo por modelo la próxima
+ * vez que se usan. El registro RECARGA del WAL deja sin efecto las bajas
+ * anteriores al reaplicarlo, porque al arrancar ya se lee el CSV nuevo.
+ */
+#define RECARGA_QUIETO_MS 200   /* sin eventos durante este tiempo antes de leer */
+#define RECARGA_NICE      10
+
+/* Lee el CSV si cambió desde la última carga o checkpoint y lo publica */
+static bool inventario_recargar(void) {
+    pthread_mutex_lock(&inventario_mutex);
+    FirmaArchivo firma = firma_archivo(INVENTARIO_FILE);
+    bool igual = firma_igual(firma, inventario_firma);
+    pthread_mutex_unlock(&inventario_mutex);
+    /* lo escribió un checkpoint, o no está (a mitad de un reemplazo) */
+    if (igual || firma.mtime_ns < 0) return false;
+
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    Almacen *alm = cargar_inventario(INVENTARIO_FILE);
+    if (!alm) return false;
+    if (alm->n == 0) {
+        fprintf(stderr, "[SERVIDOR] Recarga: %s no tiene productos, se ignora\n", INVENTARIO_FILE);
+        almacen_soltar(alm);
+        return false;
+    }
+    /* el catálogo también se arma aquí, fuera del mutex */
+    Inventario *nuevo = inventario_version(alm, NULL, -1);
+    almacen_soltar(alm);
+    if (!nuevo) {
+        fprintf(stderr, "[SERVIDOR] Recarga: sin memoria\n");
+        return false;
+    }
+
+    pthread_mutex_lock(&inventario_mutex);
+    ventas_pausar();            /* ninguna venta del almacén viejo queda detrás de la RECARGA */
+    bool ok = wal_registrar(WAL_RECARGA_INVENTARIO, NULL, 0);
+    unsigned long gen = atomic_load(&inventario_actual)->gen + 1;
+    if (ok) {
+        nuevo->gen = gen;
+        inventario_firma = firma;
+        inventario_publicar(nuevo);
+    } else {
+        inventario_liberar(nuevo);
+    }
+    ventas_reanudar();
+    pthread_mutex_unlock(&inventario_mutex);
+    if (ok) printf("[SERVIDOR] Inventario recargado en %.3f s (versión %lu)\n", segundos_desde(&t0), gen);
+    else fprintf(stderr, "[SERVIDOR] Recarga: no se pudo registrar en el WAL\n");
+    return ok;
+}
+
+/* Algún evento del lote es sobre el CSV del inventario */
+static bool evento_inventario(const char *buf, ssize_t n) {
+    for (const char *p = buf; p < buf + n;) {
+        const struct inotify_event *ev = (const struct inotify_event *)p;
+        if (ev->len > 0 && strcmp(ev->name, INVENTARIO_FILE) == 0) return true;
+        p += sizeof(*ev) + ev->len;
+    }
+    return false;
+}
+
+static void *hilo_recarga(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    /* leer el CSV no debe quitarle CPU a quienes atienden; los hilos del lector heredan el nice */
+    if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), RECARGA_NICE) != 0) perror("[SERVIDOR] setpriority");
+    inventario_recargar();      /* pudo cambiar mientras se arrancaba */
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (!evento_inventario(buf, n)) continue;
+        /* una copia larga produce varios eventos: se lee cuando para */
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        while (poll(&pfd, 1, RECARGA_QUIETO_MS) > 0 && read(fd, buf, sizeof(buf)) > 0) {}
+        if (!inventario_recargar()) continue;
+        /* el almacén anterior se libera en cuanto los lectores sueltan su versión */
+        bool quedan = true;
+        for (int i = 0; i < 50 && quedan; ++i) {
+            usleep(100 * 1000);
+            pthread_mutex_lock(&inventario_mutex);
+            inventario_reclamar();
+            quedan = inventario_retirados != NULL;
+            pthread_mutex_unlock(&inventario_mutex);
+        }
+    }
+    perror("[SERVIDOR] inotify");
+    close(fd);
+    return NULL;
+}
+
+static void inventario_vigilar(void) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror("[SERVIDOR] inotify (sin recarga del inventario)");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    pthread_t hilo;
+    if (pthread_create(&hilo, NULL, hilo_recarga, (void *)(intptr_t)fd) == 0) pthread_detach(hilo);
+    else close(fd);
+}
+
+/* ---------- Instantánea de las sesiones ---------- */
+
+/*
+ * Cada SESIONES_SEG, si algo cambió, el mapa de sesiones se escribe en
+ * Tienda.sesiones (temporal + rename) con una línea por sesión:
+ * token;usuario;último uso;modelo;modelo... Los carritos van por modelo
+ * para que sirvan con cualquier almacén. Las sesiones vencidas se
+ * descartan aquí mismo. Al arrancar se leen después de publicar el
+ * inventario; lo que cambió después de la última instantánea se pierde.
+ */
+#define SESIONES_SEG 30
+#define SESIONES_TMP SESIONES_FILE ".tmp"
+
+/* Escribe las sesiones vigentes y quita las vencidas; toma cada shard por turno */
+static void escribir_sesiones(FILE *f, const void *arg) {
+    (void)arg;
+    time_t ahora = time(NULL);
+    for (int i = 0; i < SESION_SHARDS; ++i) {
+        ShardSesiones *sh = &sesiones[i];
+        pthread_mutex_lock(&sh->mutex);
+        for (size_t k = 0; k < sh->cap; ++k) {
+            for (Sesion **pp = &sh->cubetas[k], *x; (x = *pp);) {
+                if (ahora - x->ultimo_uso >= SESION_VIGENCIA) {
+                    *pp = x->sig;
+                    sh->n--;
+                    atomic_fetch_sub(&sesiones_total, 1);
+                    sesion_liberar(x);
+                    continue;
+                }
+                fprintf(f, "%s;%s;%lld", x->token, x->usuario, (long long)x->ultimo_uso);
+                for (int j = 0; j < x->carrito_size; ++j) {
+                    fprintf(f, ";%s", x->carrito_alm->productos[x->carrito[j]].modelo);
+                }
+                fputc('\n', f);
+                pp = &x->sig;
+            }
+        }
+        pthread_mutex_unlock(&sh->mutex);
+    }
+}
+
+static bool sesiones_guardar(void) {
+    atomic_store(&sesiones_cambiaron, false);
+    bool ok = escribir_temporal(SESIONES_TMP, escribir_sesiones, NULL)
+              && rename(SESIONES_TMP, SESIONES_FILE) == 0
+              && sincronizar_directorio();
+    if (!ok) {
+        perror("[SERVIDOR] " SESIONES_FILE);
+        atomic_store(&sesiones_cambiaron, true);
+    }
+    return ok;
+}
+
+static void *hilo_sesiones(void *arg) {
+    (void)arg;
+    for (;;) {
+        sleep(SESIONES_SEG);
+        if (atomic_load(&sesiones_cambiaron)) sesiones_guardar();
+    }
+    return NULL;
+}
+
+/* Lee Tienda.sesiones; los modelos que ya no están en 'inv' se descartan */
+static void sesiones_cargar(const Inventario *inv) {
+    FILE *f = fopen(SESIONES_FILE, "r");
+    if (!f) return;
+    char *linea = NULL;
+    size_t cap = 0;
+    int n = 0;
+    time_t ahora = time(NULL);
+    while (getline(&linea, &cap, f) > 0) {
+        linea[strcspn(linea, "\r\n")] = '\0';
+        char *guardar;
+        const char *token = strtok_r(linea, ";", &guardar);
+        const char *usuario = strtok_r(NULL, ";", &guardar);
+        const char *uso = strtok_r(NULL, ";", &guardar);
+        if (!token || !usuario || !uso || strlen(token) != SESION_TOKEN) continue;
+        Sesion *x = calloc(1, sizeof(*x));
+        if (!x) break;
+        memcpy(x->token, token, SESION_TOKEN);
+        snprintf(x->usuario, sizeof(x->usuario), "%s", usuario);
+        x->ultimo_uso = (time_t)atoll(uso);
+        for (const char *m; (m = strtok_r(NULL, ";", &guardar)) && x->carrito_size < MAX_CARRITO;) {
+            int id = find_model(inv, m);
+            if (id >= 0) x->carrito[x->carrito_size++] = id;
+        }
+        x->carrito_alm = almacen_tomar(inv->alm);
+        if (ahora - x->ultimo_uso >= SESION_VIGENCIA || !sesion_insertar(x)) {
+            sesion_liberar(x);
+            continue;
+        }
+        n++;
+    }
+    free(linea);
+    fclose(f);
+    atomic_store(&sesiones_cambiaron, false);
+    printf("[SERVIDOR] %d sesiones recuperadas de %s\n", n, SESIONES_FILE);
+}
+
+static void sesiones_vigilar(void) {
+    pthread_t hilo;
+    if (pthread_create(&hilo, NULL, hilo_sesiones, NULL) == 0) pthread_detach(hilo);
+    else perror("[SERVIDOR] sesiones");
+}
+
+/* ---------- E/S de la conexión: protocolo heredado y por líneas ---------- */
+
+/*
+ * Modo heredado: cada recv() es un comando completo. Tras "PROTO:LINEAS"
+ * los comandos terminan en '\n' y se extraen de un anillo de entrada, así
+ * que pueden llegar partidos en varias lecturas o varios en una sola
+ * (pipelining). En ese modo las respuestas van por trozos "<bytes>\n<datos>"
+ * y terminan con "0\n", sin límite de tamaño.
+ */
+
+#define ENTRADA_CAP (2 * BUFFER_SIZE)   /* potencia de dos */
+
+enum { COMANDO_NINGUNO = -1, COMANDO_INVALIDO = -2 };
+
+/* Hasta dos tramos libres del anillo, para recvmsg() */
+static int entrada_huecos(Conexion *c, struct iovec iov[2]) {
+    size_t libre = ENTRADA_CAP - c->ent_len;
+    size_t fin = (c->ent_ini + c->ent_len) & (ENTRADA_CAP - 1);
+    size_t primero = ENTRADA_CAP - fin;
+    if (primero > libre) primero = libre;
+    iov[0].iov_base = c->entrada + fin;
+    iov[0].iov_len = primero;
+    iov[1].iov_base = c->entrada;
+    iov[1].iov_len = libre - primero;
+    return iov[1].iov_len ? 2 : (primero ? 1 : 0);
+}
+
+static bool entrada_agregar(Conexion *c, const char *data, size_t n) {
+    struct iovec iov[2];
+    int k = entrada_huecos(c, iov);
+    size_t libre = k == 0 ? 0 : iov[0].iov_len + (k == 2 ? iov[1].iov_len : 0);
+    if (n > libre) return false;
+    size_t a = n < iov[0].iov_len ? n : iov[0].iov_len;
+    memcpy(iov[0].iov_base, data, a);
+    if (n > a) memcpy(iov[1].iov_base, data + a, n - a);
+    c->ent_len += n;
+    return true;
+}
+
+/* Saca la siguiente línea no vacía, sin "\r\n", y la deja en dst */
+static int entrada_linea(Conexion *c, char *dst, size_t cap) {
+    while (c->ent_escaneado < c->ent_len) {
+        size_t pos = (c->ent_ini + c->ent_escaneado) & (ENTRADA_CAP - 1);
+        size_t tramo = ENTRADA_CAP - pos;
+        if (tramo > c->ent_len - c->ent_escaneado) tramo = c->ent_len - c->ent_escaneado;
+        char *nl = memchr(c->entrada + pos, '\n', tramo);
+        if (!nl) {
+            c->ent_escaneado += tramo;
+            continue;
+        }
+        size_t len = c->ent_escaneado + (size_t)(nl - (c->entrada + pos));
+        if (len >= cap) return COMANDO_INVALIDO;
+        size_t ini = c->ent_ini;
+        size_t a = ENTRADA_CAP - ini;
+        if (a > len) a = len;
+        memcpy(dst, c->entrada + ini, a);
+        memcpy(dst + a, c->entrada, len - a);
+        if (len > 0 && dst[len - 1] == '\r') len--;
+        dst[len] = '\0';
+        c->ent_ini = (ini + c->ent_escaneado + (size_t)(nl - (c->entrada + pos)) + 1) & (ENTRADA_CAP - 1);
+        c->ent_len -= c->ent_escaneado + (size_t)(nl - (c->entrada + pos)) + 1;
+        c->ent_escaneado = 0;
+        if (len > 0) return (int)len;
+    }
+    /* anillo lleno sin fin de línea: el comando no cabe */
+    return c->ent_len == ENTRADA_CAP ? COMANDO_INVALIDO : COMANDO_NINGUNO;
+}
+
+/*
+ * Siguiente comando listo para ejecutar, o COMANDO_NINGUNO si hace falta
+ * leer más. '*enmarcado' indica si su respuesta lleva encabezado.
+ */
+static int conexion_comando(Conexion *c, char *linea, size_t cap, const char **cmd, bool *enmarcado) {
+    if (c->in_len > 0) {
+        size_t n = c->in_len;
+        c->in_len = 0;
+        c->in[n] = '\0';
+        size_t fin = strcspn(c->in, "\r\n");
+        c->in[fin] = '\0';
+        if (!c->enmarcado && strcmp(c->in, PROTO_LINEAS) == 0) {
+            /* lo que venga detrás del comando ya pertenece al modo por líneas */
+            c->entrada = malloc(ENTRADA_CAP);
+            if (!c->entrada) return COMANDO_INVALIDO;
+            c->enmarcado = true;
+            size_t resto = fin < n ? fin + 1 : n;
+            if (!entrada_agregar(c, c->in + resto, n - resto)) return COMANDO_INVALIDO;
+        }
+        if (fin > 0) {
+            *cmd = c->in;
+            *enmarcado = false;
+            return (int)fin;
+        }
+    }
+    if (!c->enmarcado) return COMANDO_NINGUNO;
+    int r = entrada_linea(c, linea, cap);
+    if (r >= 0) {
+        *cmd = linea;
+        *enmarcado = true;
+    }
+    return r;
+}
+
+/* recv() al destino que corresponde al modo de la conexión */
+static ssize_t conexion_recibir(Conexion *c) {
+    if (!c->enmarcado) {
+        ssize_t n = recv(c->sock, c->in, BUFFER_SIZE - 1, 0);
+        if (n > 0) c->in_len = (size_t)n;
+        return n;
+    }
+    struct iovec iov[2];
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)entrada_huecos(c, iov);
+    if (msg.msg_iovlen == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    ssize_t n = recvmsg(c->sock, &msg, 0);
+    if (n > 0) c->ent_len += (size_t)n;
+    return n;
+}
+
+/*
+ * Encola bytes en la salida pendiente de la conexión. Solo se escribe
+ * detrás de lo ya encolado, así que es seguro aunque el kernel esté
+ * leyendo la cola por una sendmsg de io_uring en vuelo.
+ */
+static bool conexion_encolar(Conexion *c, const char *data, size_t len) {
+    Segmento *s = c->sal_fin;
+    if (!segmento_cabe(s, len)) {
+        s = segmento_nuevo(len);
+        if (!s) return false;
+        if (c->sal_fin) c->sal_fin->sig = s;
+        else c->sal_ini = s;
+        c->sal_fin = s;
+    }
+    memcpy(s->datos + s->fin, data, len);
+    s->fin += len;
+    c->sal_pend += len;
+    return true;
+}
+
+#define COPIA_MAX 1024          /* respuestas menores se copian en vez de encadenarse */
+
+/* Pasa la respuesta a la cola de salida y la deja vacía */
+static bool conexion_encolar_resp(Conexion *c, Respuesta *r) {
+    if (r->sin_memoria) return false;
+    size_t total = 0;
+    for (Segmento *s = r->ini; s; s = s->sig) total += s->fin - s->ini;
+    if (total <= COPIA_MAX) {
+        /* varias respuestas cortas comparten segmento: menos iovecs por writev */
+        for (Segmento *s = r->ini; s; s = s->sig) {
+            if (!conexion_encolar(c, segmento_datos(s) + s->ini, s->fin - s->ini)) return false;
+        }
+        resp_vaciar(r);
+        return true;
+    }
+    if (c->sal_fin) c->sal_fin->sig = r->ini;
+    else c->sal_ini = r->ini;
+    c->sal_fin = r->fin;
+    c->sal_pend += total;
+    memset(r, 0, sizeof(*r));
+    return true;
+}
+
+static bool conexion_responder(Conexion *c, Respuesta *r, bool enmarcado) {
+    if (enmarcado) resp_enmarcar(r);
+    return conexion_encolar_resp(c, r);
+}
+
+static bool segmento_sendfile(const Segmento *s) {
+    return s->cont && s->cont->fd >= 0;
+}
+
+/*
+ * Hasta 'max' tramos de la cola de salida. Con 'mapear' los archivos se
+ * envían desde su mapeo; si no, la lista se corta en el primero.
+ */
+static int salida_iov(Conexion *c, struct iovec *iov, int max, bool mapear) {
+    int k = 0;
+    for (Segmento *s = c->sal_ini; s && k < max; s = s->sig) {
+        if (s->fin == s->ini) continue;
+        if (segmento_sendfile(s) && !mapear) break;
+        iov[k].iov_base = (char *)segmento_datos(s) + s->ini;
+        iov[k].iov_len = s->fin - s->ini;
+        k++;
+    }
+    return k;
+}
+
+/* Descarta los segmentos vacíos del frente; el último se conserva */
+static Segmento *salida_cabeza(Conexion *c) {
+    while (c->sal_ini != c->sal_fin && c->sal_ini->ini == c->sal_ini->fin) {
+        Segmento *s = c->sal_ini;
+        c->sal_ini = s->sig;
+        s->sig = NULL;
+        segmentos_liberar(s);
+    }
+    return c->sal_ini;
+}
+
+/* Descarta n bytes ya enviados */
+static void salida_consumir(Conexion *c, size_t n) {
+    c->sal_pend -= n;
+    while (c->sal_ini) {
+        Segmento *s = c->sal_ini;
+        size_t k = s->fin - s->ini;
+        if (n < k) {
+            s->ini += n;
+            return;
+        }
+        n -= k;
+        if (s == c->sal_fin && !s->cont) {
+            /* el último se reutiliza para lo siguiente que se encole */
+            s->ini = s->fin = MARCO_RESERVA;
+            return;
+        }
+        c->sal_ini = s->sig;
+        if (s == c->sal_fin) c->sal_fin = NULL;
+        s->sig = NULL;
+        segmentos_liberar(s);
+    }
+}
+
+/* Envía lo pendiente; devuelve false si la conexión debe cerrarse */
+static bool conexion_flush(Conexion *c) {
+    while (c->sal_pend > 0) {
+        Segmento *s = salida_cabeza(c);
+        ssize_t w;
+        if (segmento_sendfile(s)) {
+            off_t off = (off_t)s->ini;
+            w = sendfile(c->sock, s->cont->fd, &off, s->fin - s->ini);
+        } else {
+            struct iovec iov[SALIDA_IOV];
+            w = writev(c->sock, iov, salida_iov(c, iov, SALIDA_IOV, false));
+        }
+        if (w > 0) {
+            salida_consumir(c, (size_t)w);
+        } else if (w < 0 && errno == EINTR) {
+            continue;
+        } else if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void* handle_client(void* arg) {
+    Conexion *c = arg;
+    int sock = c->sock;
+    Respuesta resp = {0};
+    char linea[BUFFER_SIZE];
+    printf("[SERVIDOR] Cliente conectado FD=%d\n", sock);
+
+    while (conexion_recibir(c) > 0) {
+        const char *cmd;
+        bool enmarcado;
+        int r;
+        /* todas las respuestas de una ráfaga salen en un solo send() */
+        while ((r = conexion_comando(c, linea, sizeof(linea), &cmd, &enmarcado)) >= 0) {
+            atender_comando(c, cmd, &resp);
+            if (!conexion_responder(c, &resp, enmarcado)) break;
+        }
+        if (r == COMANDO_INVALIDO || r >= 0 || !conexion_flush(c)) break;
+    }
+
+    resp_liberar(&resp);
+    close(sock);
+    conexion_desconectada(c);
+    conexion_liberar(c);
+    return NULL;
+}
+
+/* ---------- Pool de trabajadores con robo de tareas ---------- */
+
+/*
+ * Cada trabajador tiene su propia deque: las tareas entran por el final,
+ * el dueño las toma del final (LIFO, datos aún en caché) y los demás roban
+ * del inicio (las más antiguas) cuando su deque está vacía.
+ */
+typedef struct {
+    void (*fn)(void *arg);
+    void *arg;
+} Tarea;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    Tarea *items;
+    size_t cap;
+    size_t ini;
+    size_t len;
+} Deque;
+
+typedef struct {
+    int n;
+    Deque *deques;
+    pthread_t *hilos;
+    atomic_uint siguiente;      /* reparto round-robin desde fuera del pool */
+    atomic_long pendientes;
+    atomic_int dormidos;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} PoolTrabajo;
+
+static PoolTrabajo pool;
+static __thread int trabajador_id = -1;
+
+static bool deque_push(Deque *d, Tarea t) {
+    pthread_mutex_lock(&d->mutex);
+    if (d->len == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        Tarea *items = malloc(cap * sizeof(*items));
+        if (!items) {
+            pthread_mutex_unlock(&d->mutex);
+            return false;
+        }
+        for (size_t i = 0; i < d->len; ++i) items[i] = d->items[(d->ini + i) % d->cap];
+        free(d->items);
+        d->items = items;
+        d->cap = cap;
+        d->ini = 0;
+    }
+    d->items[(d->ini + d->len) % d->cap] = t;
+    d->len++;
+    pthread_mutex_unlock(&d->mutex);
+    return true;
+}
+
+static bool deque_pop(Deque *d, Tarea *t) {
+    bool ok = false;
+    pthread_mutex_lock(&d->mutex);
+    if (d->len > 0) {
+        d->len--;
+        *t = d->items[(d->ini + d->len) % d->cap];
+        ok = true;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return ok;
+}
+
+static bool deque_robar(Deque *d, Tarea *t) {
+    bool ok = false;
+    if (pthread_mutex_trylock(&d->mutex) != 0) return false;
+    if (d->len > 0) {
+        *t = d->items[d->ini];
+        d->ini = (d->ini + 1) % d->cap;
+        d->len--;
+        ok = true;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return ok;
+}
+
+static bool pool_tomar(int id, Tarea *t) {
+    if (deque_pop(&pool.deques[id], t)) return true;
+    for (int k = 1; k < pool.n; ++k) {
+        if (deque_robar(&pool.deques[(id + k) % pool.n], t)) return true;
+    }
+    return false;
+}
+
+static void *trabajador_main(void *arg) {
+    trabajador_id = (int)(intptr_t)arg;
+    for (;;) {
+        Tarea t;
+        if (pool_tomar(trabajador_id, &t)) {
+            atomic_fetch_sub(&pool.pendientes, 1);
+            t.fn(t.arg);
+            continue;
+        }
+        pthread_mutex_lock(&pool.mutex);
+        atomic_fetch_add(&pool.dormidos, 1);
+        while (atomic_load(&pool.pendientes) == 0)
+            pthread_cond_wait(&pool.cond, &pool.mutex);
+        atomic_fetch_sub(&pool.dormidos, 1);
+        pthread_mutex_unlock(&pool.mutex);
+    }
+    return NULL;
+}
+
+static bool pool_enviar(void (*fn)(void *), void *arg) {
+    Tarea t = { fn, arg };
+    int id = trabajador_id >= 0 ? trabajador_id
+                                : (int)(atomic_fetch_add(&pool.siguiente, 1) % (unsigned)pool.n);
+    if (!deque_push(&pool.deques[id], t)) return false;
+    atomic_fetch_add(&pool.pendientes, 1);
+    if (atomic_load(&pool.dormidos) > 0) {
+        pthread_mutex_lock(&pool.mutex);
+        pthread_cond_signal(&pool.cond);
+        pthread_mutex_unlock(&pool.mutex);
+    }
+    return true;
+}
+
+static void pool_iniciar(int n) {
+    pool.n = n;
+    pool.deques = calloc((size_t)n, sizeof(*pool.deques));
+    pool.hilos = calloc((size_t)n, sizeof(*pool.hilos));
+    if (!pool.deques || !pool.hilos) {
+        perror("pool");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    /* todas las deques listas antes de que un trabajador intente robar */
+    for (int i = 0; i < n; ++i) pthread_mutex_init(&pool.deques[i].mutex, NULL);
+    for (int i = 0; i < n; ++i) {
+        if (pthread_create(&pool.hilos[i], NULL, trabajador_main, (void*)(intptr_t)i) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(pool.hilos[i]);
+    }
+    printf("[SERVIDOR] Pool de trabajo: %d hilos\n", n);
+}
+
+/* ---------- Modo epoll (edge-triggered, sockets no bloqueantes) ---------- */
+
+#define EPOLL_MAX_EVENTS 256
+#define OUT_MAX_PENDIENTE (4 * BUFFER_SIZE)
+#define MAX_COMANDOS_PENDIENTES 64
+
+/* Comando leído por el bucle y ejecutado en el pool */
+struct TareaComando {
+    struct TareaComando *sig;
+    Conexion *c;
+    struct Bucle *bucle;
+    char *cmd;
+    bool enmarcado;
+    bool ocupado;               /* sin fichas de comando al leerlo: responde BUSY */
+    Respuesta resp;             /* ya por trozos si va enmarcada */
+};
+
+typedef struct Bucle {
+    Shard *shard;
+    int epfd;
+    int server_socket;
+    int evfd;                       /* avisa de tareas terminadas */
+    pthread_mutex_t listas_mutex;
+    TareaComando *listas;           /* terminadas, pendientes de enviar */
+    Conexion *por_liberar;          /* cerradas durante la iteración actual */
+    bool usar_pool;
+    char linea[BUFFER_SIZE];        /* comando extraído del anillo de entrada */
+    Respuesta resp;                 /* para los comandos ejecutados en el bucle */
+} Bucle;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void tarea_comando_liberar(TareaComando *t) {
+    free(t->cmd);
+    resp_liberar(&t->resp);
+    free(t);
+}
+
+/* La respuesta ya armada vuelve al bucle por el eventfd */
+static void tarea_comando_terminar(TareaComando *t) {
+    Bucle *b = t->bucle;
+    if (t->enmarcado) resp_enmarcar(&t->resp);
 
-/* Trim in-place: elimina espacios iniciales y finales y deja el resultado al inicio del buffer */
-static char *trim_inplace(char *s) {
-    if (!s) return s;
-    char *start = s;
-    while (*start && isspace((unsigned char)*start)) start++;
-    char *end = start + strlen(start);
-    if (end != start) {
-        end--; 
-        while (end >= start && isspace((unsigned char)*end)) { *end = '\0'; end--; }
-    }
-    if (start != s) memmove(s, start, strlen(start) + 1);
-    return s;
+    pthread_mutex_lock(&b->listas_mutex);
+    t->sig = b->listas;
+    b->listas = t;
+    pthread_mutex_unlock(&b->listas_mutex);
+    uint64_t uno = 1;
+    ssize_t w = write(b->evfd, &uno, sizeof(uno));
+    (void)w;
+}
+
+/* Corre en un trabajador */
+static void tarea_comando_ejecutar(void *arg) {
+    TareaComando *t = arg;
+    ejecutar_comando(t->c, t->cmd, &t->resp);
+    tarea_comando_terminar(t);
 }
 
-/* Remove thousands separators (commas) in-place */
-static void remove_thousands_commas(char *s) {
-    if (!s) return;
-    char *r = s;
-    for (char *p = s; *p; ++p) {
-        if (*p == ',') continue;
-        *r++ = *p;
+/*
+ * Manda al pool el siguiente comando de la conexión, si no hay otro en
+ * curso. LOGIN y REGISTER van al pool de autenticación; sin trabajadores,
+ * lo que quedó detrás de ellos se ejecuta aquí y sale por la misma cola.
+ */
+static void conexion_siguiente(Conexion *c) {
+    if (c->en_vuelo || !c->pend_ini) return;
+    TareaComando *t = c->pend_ini;
+    c->pend_ini = t->sig;
+    if (!c->pend_ini) c->pend_fin = NULL;
+    c->pend_n--;
+    t->sig = NULL;
+    c->en_vuelo = true;
+    if (t->ocupado) {
+        resp_agregar(&t->resp, RESPUESTA_OCUPADO);
+        tarea_comando_terminar(t);
+        return;
+    }
+    if (es_credencial(t->cmd)) {
+        if (auth_enviar(tarea_comando_ejecutar, t)) return;
+        /* cola llena: la respuesta sale sin ocupar un trabajador */
+        resp_agregar(&t->resp, RESPUESTA_OCUPADO);
+        tarea_comando_terminar(t);
+        return;
+    }
+    if (!t->bucle->usar_pool || !pool_enviar(tarea_comando_ejecutar, t)) {
+        /* sin pool o sin memoria para encolar: se ejecuta aquí mismo */
+        tarea_comando_ejecutar(t);
     }
-    *r = '\0';
 }
 
-static void cargar_inventario(const char* filename) {
-    FILE* f = fopen(filename, "r");
-    if (!f) {
-        perror("inventario");
-        exit(EXIT_FAILURE);
+static bool conexion_despachar(Bucle *b, Conexion *c, const char *cmd, bool enmarcado) {
+    TareaComando *t = calloc(1, sizeof(*t));
+    if (!t) return false;
+    t->c = c;
+    t->bucle = b;
+    t->enmarcado = enmarcado;
+    t->ocupado = !admision_comando(c);
+    t->cmd = strdup(cmd);
+    if (!t->cmd) {
+        free(t);
+        return false;
     }
-    char line[4096];
-    inventario_size = 0;
-    while (fgets(line, sizeof(line), f) && inventario_size < MAX_PRODUCTOS) {
-        /* remove trailing newline/carriage */
-        line[strcspn(line, "\r\n")] = 0;
-
-        /* tokenize by ';' */
-        char *marca = strtok(line, ";");
-        char *modelo = strtok(NULL, ";");
-        char *specs = strtok(NULL, ";");
-        char *precio = strtok(NULL, ";");
-        char *imagen = strtok(NULL, ";");
-
-        if (!marca || !modelo || !specs || !precio || !imagen) {
-            /* malformed or incomplete line: skip */
+    if (c->pend_fin) c->pend_fin->sig = t;
+    else c->pend_ini = t;
+    c->pend_fin = t;
+    c->pend_n++;
+    conexion_siguiente(c);
+    return true;
+}
+
+static bool conexion_saturada(Conexion *c) {
+    return c->sal_pend > OUT_MAX_PENDIENTE || c->pend_n >= MAX_COMANDOS_PENDIENTES;
+}
+
+/*
+ * Ejecuta o despacha los comandos ya recibidos. Devuelve -1 si hay que
+ * cerrar, 0 si hace falta leer más y 1 si se detuvo por backpressure.
+ */
+static int conexion_atender(Bucle *b, Conexion *c) {
+    while (!conexion_saturada(c)) {
+        const char *cmd;
+        bool enmarcado;
+        int r = conexion_comando(c, b->linea, sizeof(b->linea), &cmd, &enmarcado);
+        if (r == COMANDO_NINGUNO) return 0;
+        if (r == COMANDO_INVALIDO) return -1;
+        if (b->usar_pool || c->en_vuelo || es_credencial(cmd)) {
+            if (!conexion_despachar(b, c, cmd, enmarcado)) return -1;
             continue;
         }
+        atender_comando(c, cmd, &b->resp);
+        if (!conexion_responder(c, &b->resp, enmarcado)) return -1;
+    }
+    return 1;
+}
 
-        /* strdup tokens to own them */
-        char *marca_trim = strdup(marca);
-        char *modelo_trim = strdup(modelo);
-        char *specs_trim = strdup(specs);
-        char *precio_trim = strdup(precio);
-        char *imagen_trim = strdup(imagen);
-
-        if (!marca_trim || !modelo_trim || !specs_trim || !precio_trim || !imagen_trim) {
-            /* allocation failure: free what we have and break */
-            free(marca_trim); free(modelo_trim); free(specs_trim); free(precio_trim); free(imagen_trim);
-            break;
+/* Lee hasta EAGAIN, atendiendo los comandos de cada lectura */
+static bool conexion_leer(Bucle *b, Conexion *c) {
+    c->lectura_pendiente = false;
+    for (;;) {
+        int r = conexion_atender(b, c);
+        if (r < 0 || !conexion_flush(c)) return false;
+        if (conexion_saturada(c)) {
+            /* el cliente no está leyendo: esperar a vaciar la cola antes de seguir */
+            c->lectura_pendiente = true;
+            return true;
         }
+        if (r > 0) continue;    /* el flush hizo sitio; quedan comandos en el anillo */
+        ssize_t n = conexion_recibir(c);
+        if (n == 0) return false;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+}
 
-        /* trim each field in-place (and normalize to start of buffer) */
-        trim_inplace(marca_trim);
-        trim_inplace(modelo_trim);
-        trim_inplace(specs_trim);
-        trim_inplace(precio_trim);
-        trim_inplace(imagen_trim);
+/* La memoria se libera al final de la iteración y nunca con una tarea en curso */
+static void conexion_cerrar(Bucle *b, Conexion *c) {
+    if (c->cerrada) return;
+    c->cerrada = true;
+    epoll_ctl(b->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+    close(c->sock);
+    conexion_desconectada(c);
+    while (c->pend_ini) {
+        TareaComando *t = c->pend_ini;
+        c->pend_ini = t->sig;
+        tarea_comando_liberar(t);
+    }
+    c->pend_fin = NULL;
+    c->pend_n = 0;
+    if (!c->en_vuelo) {
+        c->sig_liberar = b->por_liberar;
+        b->por_liberar = c;
+    }
+}
 
-        /* remove comma thousand separators in price, e.g. "12,999.00" -> "12999.00" */
-        remove_thousands_commas(precio_trim);
+static TareaComando *tomar_terminadas(Bucle *b) {
+    pthread_mutex_lock(&b->listas_mutex);
+    TareaComando *lista = b->listas;
+    b->listas = NULL;
+    pthread_mutex_unlock(&b->listas_mutex);
+    return lista;
+}
 
-        double price_val = atof(precio_trim);
+static void procesar_terminadas(Bucle *b) {
+    uint64_t cuenta;
+    ssize_t r = read(b->evfd, &cuenta, sizeof(cuenta));
+    (void)r;
 
-        /* store pointers (owned) */
-        inventario[inventario_size].marca  = marca_trim;
-        inventario[inventario_size].modelo = modelo_trim;
-        inventario[inventario_size].specs  = specs_trim;
-        inventario[inventario_size].precio = price_val;
-        inventario[inventario_size].imagen = imagen_trim;
-        inventario[inventario_size].activo = true;
+    TareaComando *lista = tomar_terminadas(b);
 
-        inventario_size++;
+    while (lista) {
+        TareaComando *t = lista;
+        lista = t->sig;
+        Conexion *c = t->c;
+        c->en_vuelo = false;
+        if (c->cerrada) {
+            c->sig_liberar = b->por_liberar;
+            b->por_liberar = c;
+            tarea_comando_liberar(t);
+            continue;
+        }
+        bool ok = conexion_encolar_resp(c, &t->resp);
+        tarea_comando_liberar(t);
+        conexion_siguiente(c);
+        if (ok) ok = conexion_flush(c);
+        if (ok && c->lectura_pendiente) ok = conexion_leer(b, c);
+        if (!ok) conexion_cerrar(b, c);
     }
-    fclose(f);
-    printf("[SERVIDOR] Inventario cargado: %d productos\n", inventario_size);
 }
 
-static void persist_inventory(void) {
-    FILE *f = fopen(INVENTARIO_FILE, "w");
-    if (!f) {
-        perror("inventario_save");
-        return;
-    }
-    for (int i = 0; i < inventario_size; ++i) {
-        if (!inventario[i].activo) continue;
-        fprintf(f, "%s;%s;%s;%.2f;%s\n",
-                inventario[i].marca,
-                inventario[i].modelo,
-                inventario[i].specs,
-                inventario[i].precio,
-                inventario[i].imagen);
+static void aceptar_pendientes(Bucle *b) {
+    for (;;) {
+        struct sockaddr_in caddr;
+        socklen_t clen = sizeof(caddr);
+        int client_fd = accept4(b->server_socket, (struct sockaddr*)&caddr, &clen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        Conexion *c = conexion_nueva(client_fd, b->shard, caddr.sin_addr.s_addr);
+        if (!c) {
+            close(client_fd);
+            continue;
+        }
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(b->epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(client_fd);
+            conexion_desconectada(c);
+            conexion_liberar(c);
+            continue;
+        }
+        printf("[SERVIDOR] Cliente conectado FD=%d (shard %d)\n", client_fd, b->shard->id);
     }
-    fclose(f);
 }
 
-static void cargar_usuarios(const char *filename) {
-    FILE *f = fopen(filename, "r");
-    if (!f) {
-        fprintf(stderr, "[SERVIDOR] Advertencia: no se pudo abrir %s; sin usuarios precargados.\n", filename);
-        usuarios_size = 0;
-        return;
+static void ejecutar_epoll(Shard *s, bool usar_pool) {
+    int server_socket = s->server_socket;
+    if (set_nonblocking(server_socket) < 0) {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
     }
-
-    char line[1024];
-    usuarios_size = 0;
-    while (fgets(line, sizeof(line), f) && usuarios_size < MAX_USUARIOS) {
-        line[strcspn(line, "\r\n")] = 0;
-        char *user = strtok(line, ";");
-        char *pass = strtok(NULL, ";");
-        char *role = strtok(NULL, ";");
-        if (!user || !pass) continue;
-
-        char *user_dup = strdup(user);
-        char *pass_dup = strdup(pass);
-        char *role_dup = NULL;
-        if (role) {
-            role_dup = strdup(role);
-        } else {
-            const char *fallback = (strcmp(user, "admin") == 0) ? "admin" : "cliente";
-            role_dup = strdup(fallback);
+    Bucle *b = calloc(1, sizeof(*b));
+    if (!b) {
+        perror("bucle");
+        exit(EXIT_FAILURE);
+    }
+    b->shard = s;
+    b->server_socket = server_socket;
+    b->usar_pool = usar_pool;
+    pthread_mutex_init(&b->listas_mutex, NULL);
+    b->epfd = epoll_create1(EPOLL_CLOEXEC);
+    b->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (b->epfd < 0 || b->evfd < 0) {
+        perror("epoll_create1/eventfd");
+        exit(EXIT_FAILURE);
+    }
+    /* data.ptr: NULL es el socket de escucha, el propio Bucle es el eventfd */
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(b->epfd, EPOLL_CTL_ADD, server_socket, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    ev.data.ptr = b;
+    if (epoll_ctl(b->epfd, EPOLL_CTL_ADD, b->evfd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(b->epfd, events, EPOLL_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
         }
-        if (!user_dup || !pass_dup || !role_dup) {
-            free(user_dup);
-            free(pass_dup);
-            free(role_dup);
-            continue;
+        for (int i = 0; i < n; ++i) {
+            void *ptr = events[i].data.ptr;
+            if (!ptr) {
+                aceptar_pendientes(b);
+                continue;
+            }
+            if (ptr == b) {
+                procesar_terminadas(b);
+                continue;
+            }
+            Conexion *c = ptr;
+            if (c->cerrada) continue;
+            uint32_t e = events[i].events;
+            bool ok = true;
+            if (e & EPOLLOUT) {
+                ok = conexion_flush(c);
+                if (ok && c->lectura_pendiente && !conexion_saturada(c)) e |= EPOLLIN;
+            }
+            if (ok && (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) ok = conexion_leer(b, c);
+            if (ok && (e & EPOLLERR)) ok = false;
+            if (!ok) conexion_cerrar(b, c);
         }
+        while (b->por_liberar) {
+            Conexion *c = b->por_liberar;
+            b->por_liberar = c->sig_liberar;
+            conexion_liberar(c);
+        }
+    }
+    close(b->evfd);
+    close(b->epfd);
+    resp_liberar(&b->resp);
+    free(b);
+}
 
-        trim_inplace(user_dup);
-        trim_inplace(pass_dup);
-        trim_inplace(role_dup);
+/* ---------- Modo io_uring (accept/recv/send por lotes) ---------- */
 
-        if (*role_dup == '\0' && strcmp(user_dup, "admin") == 0) {
-            free(role_dup);
-            role_dup = strdup("admin");
-        } else if (*role_dup == '\0') {
-            free(role_dup);
-            role_dup = strdup("cliente");
-        }
+/*
+ * Sin liburing: el anillo se configura con las llamadas al sistema
+ * directamente. Cada vuelta del bucle entrega todas las SQE acumuladas y
+ * espera completaciones con un solo io_uring_enter().
+ */
 
-        usuarios[usuarios_size].username = user_dup;
-        usuarios[usuarios_size].password = pass_dup;
-        usuarios[usuarios_size].role = role_dup;
-        usuarios[usuarios_size].is_admin = (strcmp(role_dup, "admin") == 0);
-        usuarios_size++;
-    }
-    fclose(f);
-    printf("[SERVIDOR] Usuarios cargados: %d\n", usuarios_size);
+#define URING_ENTRADAS 1024
+#define URING_ACEPTAR_EN_VUELO 4
+#define URING_PAUSA_ACEPTAR_MS 100  /* sin descriptores libres, cada cuánto se reintenta el accept */
+
+/* Tipo de operación en los 3 bits bajos de user_data (las conexiones están alineadas a 8) */
+enum { URING_ACEPTAR = 0, URING_RECV = 1, URING_SEND = 2, URING_AVISO = 3, URING_PAUSA = 4 };
+#define URING_TIPO 7
+
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned por_enviar;
+    void *sq_ptr;
+    size_t sq_sz;
+    void *cq_ptr;
+    size_t cq_sz;
+    size_t sqes_sz;
+} Anillo;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
 }
 
-static Usuario *find_usuario(const char *username) {
-    for (int i = 0; i < usuarios_size; ++i) {
-        if (strcmp(usuarios[i].username, username) == 0) return &usuarios[i];
-    }
-    return NULL;
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
 }
 
-static bool append_user_record(const char *username, const char *password, const char *role) {
-    FILE *f = fopen(USUARIOS_FILE, "a");
-    if (!f) {
-        perror("usuarios_append");
-        return false;
-    }
-    int written = fprintf(f, "%s;%s;%s\n", username, password, role);
-    fclose(f);
-    return written > 0;
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
 }
 
-static bool add_user(const char *username, const char *password, const char *role, bool persist) {
-    if (find_usuario(username)) return false;
-    if (usuarios_size >= MAX_USUARIOS) return false;
+static void anillo_cerrar(Anillo *r) {
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_sz);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_sz);
+    if (r->fd >= 0) close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
 
-    char *user_dup = strdup(username);
-    char *pass_dup = strdup(password);
-    char *role_dup = strdup(role);
-    if (!user_dup || !pass_dup || !role_dup) {
-        free(user_dup);
-        free(pass_dup);
-        free(role_dup);
+/* Comprueba que el kernel soporte todas las operaciones que usamos */
+static bool anillo_soporta_ops(int fd) {
+    size_t sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, sz);
+    if (!probe) return false;
+    bool ok = uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_READ, IORING_OP_TIMEOUT };
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); ++i) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static bool anillo_abrir(Anillo *r, unsigned entries) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = uring_setup(entries, &p);
+    if (r->fd < 0) return false;
+    if (!anillo_soporta_ops(r->fd)) {
+        errno = EOPNOTSUPP;
+        anillo_cerrar(r);
         return false;
     }
 
-    if (persist && !append_user_record(username, password, role)) {
-        free(user_dup);
-        free(pass_dup);
-        free(role_dup);
+    r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_sz > r->sq_sz) r->sq_sz = r->cq_sz;
+        r->cq_sz = r->sq_sz;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        anillo_cerrar(r);
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            anillo_cerrar(r);
+            return false;
+        }
+    }
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        anillo_cerrar(r);
         return false;
     }
 
-    usuarios[usuarios_size].username = user_dup;
-    usuarios[usuarios_size].password = pass_dup;
-    usuarios[usuarios_size].role = role_dup;
-    usuarios[usuarios_size].is_admin = (strcmp(role_dup, "admin") == 0);
-    usuarios_size++;
+    char *sq = r->sq_ptr;
+    char *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
     return true;
 }
 
-static void persist_users(void) {
-    FILE *f = fopen(USUARIOS_FILE, "w");
-    if (!f) {
-        perror("usuarios_save");
-        return;
-    }
-    for (int i = 0; i < usuarios_size; ++i) {
-        fprintf(f, "%s;%s;%s\n",
-                usuarios[i].username,
-                usuarios[i].password,
-                usuarios[i].role ? usuarios[i].role : "cliente");
+static int anillo_entregar(Anillo *r, unsigned min_complete) {
+    unsigned n = r->por_enviar;
+    int ret;
+    do {
+        ret = uring_enter(r->fd, n, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret > 0) r->por_enviar -= (unsigned)ret > n ? n : (unsigned)ret;
+    return ret;
+}
+
+static struct io_uring_sqe *anillo_sqe(Anillo *r) {
+    unsigned tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        /* cola llena: entregar lo acumulado sin esperar */
+        anillo_entregar(r, 0);
+        if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) return NULL;
     }
-    fclose(f);
+    unsigned idx = tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->por_enviar++;
+    return sqe;
 }
 
-static void ensure_default_admin(void) {
-    Usuario *admin = find_usuario("admin");
-    if (admin) {
-        if (!admin->is_admin) {
-            char *new_role = strdup("admin");
-            if (!new_role) return;
-            free(admin->role);
-            admin->role = new_role;
-            admin->is_admin = true;
-            persist_users();
-            printf("[SERVIDOR] Cuenta admin actualizada con privilegios.\n");
-        }
-        return;
+typedef struct {
+    Anillo anillo;
+    Bucle bucle;                /* reutiliza la cola de tareas terminadas del pool */
+    uint64_t aviso;
+    int aceptando;              /* accept en vuelo */
+    bool en_pausa;              /* hay un timeout armado para volver a aceptar */
+    bool sin_descriptores;      /* ya se avisó; se vuelve a avisar tras un accept bueno */
+    struct __kernel_timespec pausa;
+} BucleUring;
+
+static uint64_t uring_dato(void *ptr, unsigned tipo) {
+    return (uint64_t)(uintptr_t)ptr | tipo;
+}
+
+static bool uring_aceptar(BucleUring *u) {
+    struct io_uring_sqe *sqe = anillo_sqe(&u->anillo);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = u->bucle.server_socket;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uring_dato(NULL, URING_ACEPTAR);
+    u->aceptando++;
+    return true;
+}
+
+/*
+ * El accept falló por falta de descriptores o memoria: rearmarlo enseguida
+ * solo haría girar el bucle (la conexión sigue en la cola del socket). Se
+ * deja de aceptar y un IORING_OP_TIMEOUT vuelve a armar los accept; el
+ * error se informa una vez por episodio.
+ */
+static void uring_pausar_aceptar(BucleUring *u, int error) {
+    if (!u->sin_descriptores) {
+        fprintf(stderr, "[SERVIDOR] accept: %s; se reintenta cada %d ms\n", strerror(error), URING_PAUSA_ACEPTAR_MS);
+        u->sin_descriptores = true;
     }
-    if (!add_user("admin", "admin123", "admin", true)) {
-        fprintf(stderr, "[SERVIDOR] No se pudo crear cuenta admin por defecto.\n");
-    } else {
-        printf("[SERVIDOR] Cuenta admin por defecto generada.\n");
+    if (u->en_pausa) return;
+    struct io_uring_sqe *sqe = anillo_sqe(&u->anillo);
+    if (!sqe) {
+        if (u->aceptando == 0) uring_aceptar(u);
+        return;
     }
+    u->pausa = (struct __kernel_timespec){ .tv_nsec = URING_PAUSA_ACEPTAR_MS * 1000000LL };
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&u->pausa;
+    sqe->len = 1;
+    sqe->user_data = uring_dato(NULL, URING_PAUSA);
+    u->en_pausa = true;
 }
 
-/* find by modelo exact match */
-static Producto* find_model(const char* modelo) {
-    for (int i = 0; i < inventario_size; ++i)
-        if (inventario[i].activo && strcmp(inventario[i].modelo, modelo) == 0)
-            return &inventario[i];
-    return NULL;
+static void uring_reanudar_aceptar(BucleUring *u) {
+    u->en_pausa = false;
+    while (u->aceptando < URING_ACEPTAR_EN_VUELO && uring_aceptar(u)) {}
 }
 
-/* check brand exists in list */
-static int brand_already(char** list, int count, const char* brand) {
-    for (int i = 0; i < count; ++i)
-        if (strcmp(list[i], brand) == 0) return 1;
-    return 0;
+static void uring_armar_aviso(BucleUring *u) {
+    struct io_uring_sqe *sqe = anillo_sqe(&u->anillo);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = u->bucle.evfd;
+    sqe->addr = (uint64_t)(uintptr_t)&u->aviso;
+    sqe->len = sizeof(u->aviso);
+    sqe->user_data = uring_dato(NULL, URING_AVISO);
 }
 
-static void* handle_client(void* arg) {
-    int sock = *(int*)arg;
-    free(arg);
-
-    Producto* carrito[MAX_CARRITO];
-    int carrito_size = 0;
-    char current_user[128] = "";
-    char current_role[16] = "cliente";
-    bool logged_in = false;
+static void uring_liberar_si_inactiva(Conexion *c) {
+    if (c->cerrada && !c->uring_recv && !c->uring_send && !c->en_vuelo) conexion_liberar(c);
+}
 
-    char buffer[BUFFER_SIZE];
-    int n;
-    printf("[SERVIDOR] Cliente conectado FD=%d\n", sock);
+static void uring_cerrar(Conexion *c) {
+    if (c->cerrada) return;
+    c->cerrada = true;
+    /* shutdown despierta el recv pendiente; su CQE llega con 0 */
+    shutdown(c->sock, SHUT_RDWR);
+    close(c->sock);
+    conexion_desconectada(c);
+    while (c->pend_ini) {
+        TareaComando *t = c->pend_ini;
+        c->pend_ini = t->sig;
+        tarea_comando_liberar(t);
+    }
+    c->pend_fin = NULL;
+    c->pend_n = 0;
+}
 
-    while ((n = recv(sock, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-        buffer[n] = '\0';
-        buffer[strcspn(buffer, "\r\n")] = 0;
-        if (!*buffer) continue;
-
-        char response[BUFFER_SIZE];
-        response[0] = '\0';
-
-        if (strcmp(buffer, "GET_BRANDS") == 0) {
-            /* build unique brands list */
-            char* brands_seen[MAX_PRODUCTOS];
-            int seen = 0;
-            for (int i = 0; i < inventario_size; ++i) {
-                if (!inventario[i].activo) continue;
-                const char *b = inventario[i].marca;
-                if (!brand_already(brands_seen, seen, b)) {
-                    brands_seen[seen++] = (char*)b;
-                }
-            }
-            /* join with '|' without trailing '|' */
-            for (int i = 0; i < seen; ++i) {
-                strncat(response, brands_seen[i], sizeof(response)-1 - strlen(response));
-                if (i < seen - 1) strncat(response, "|", sizeof(response)-1 - strlen(response));
-            }
-            strncat(response, "\n", sizeof(response)-1 - strlen(response));
-        }
-        else if (strncmp(buffer, "GET_MODELS:", 11) == 0) {
-            const char* brand = buffer + 11;
-            for (int i = 0; i < inventario_size; ++i) {
-                if (!inventario[i].activo) continue;
-                if (strcmp(inventario[i].marca, brand) == 0) {
-                    char linebuf[1024];
-                    snprintf(linebuf, sizeof(linebuf), "%s|%s|%.2f|%s\n",
-                             inventario[i].modelo,
-                             inventario[i].specs,
-                             inventario[i].precio,
-                             inventario[i].imagen);
-                    if (strlen(response) + strlen(linebuf) < sizeof(response)-1)
-                        strcat(response, linebuf);
-                }
-            }
-            if (!*response) strcpy(response, "\n");
+/* Mantiene una recv o una send en vuelo según el estado de la conexión */
+static void uring_avanzar(BucleUring *u, Conexion *c) {
+    if (c->cerrada) return;
+    if (!c->uring_send && c->sal_pend > 0) {
+        struct io_uring_sqe *sqe = anillo_sqe(&u->anillo);
+        if (sqe) {
+            memset(&c->uring_msg, 0, sizeof(c->uring_msg));
+            c->uring_msg.msg_iov = c->uring_iov;
+            c->uring_msg.msg_iovlen = (size_t)salida_iov(c, c->uring_iov, SALIDA_IOV, true);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = c->sock;
+            sqe->addr = (uint64_t)(uintptr_t)&c->uring_msg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = uring_dato(c, URING_SEND);
+            c->uring_send = true;
         }
-        else if (strncmp(buffer, "ADD_TO_CART:", 12) == 0) {
-            const char* modelo = buffer + 12;
-            if (carrito_size >= MAX_CARRITO) {
-                strcpy(response, "ERROR: Carrito lleno\n");
-            } else {
-                Producto* p = find_model(modelo);
-                if (p) {
-                    carrito[carrito_size++] = p;
-                    strcpy(response, "OK\n");
-                } else {
-                    strcpy(response, "ERROR: Modelo no encontrado\n");
-                }
-            }
+    }
+    if (!c->uring_recv && !conexion_saturada(c)) {
+        /* en modo por líneas se lee al primer tramo libre del anillo */
+        struct iovec iov[2] = {{c->in, BUFFER_SIZE - 1}, {NULL, 0}};
+        if (c->enmarcado && entrada_huecos(c, iov) == 0) return;
+        struct io_uring_sqe *sqe = anillo_sqe(&u->anillo);
+        if (sqe) {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = c->sock;
+            sqe->addr = (uint64_t)(uintptr_t)iov[0].iov_base;
+            sqe->len = (unsigned)iov[0].iov_len;
+            sqe->user_data = uring_dato(c, URING_RECV);
+            c->uring_recv = true;
         }
-        else if (strcmp(buffer, "GET_CART_ITEMS") == 0) {
-            int write_idx = 0;
-            for (int i = 0; i < carrito_size; ++i) {
-                if (carrito[i] && carrito[i]->activo) {
-                    carrito[write_idx++] = carrito[i];
-                }
-            }
-            carrito_size = write_idx;
+    }
+}
 
-            if (carrito_size == 0) {
-                strcpy(response, "EMPTY\n");
-            } else {
-                for (int i = 0; i < carrito_size; ++i) {
-                    char linebuf[1024];
-                    snprintf(linebuf, sizeof(linebuf), "%s|%s|%s|%.2f|%s\n",
-                             carrito[i]->modelo,
-                             carrito[i]->marca,
-                             carrito[i]->specs,
-                             carrito[i]->precio,
-                             carrito[i]->imagen);
-                    if (strlen(response) + strlen(linebuf) < sizeof(response)-1)
-                        strcat(response, linebuf);
-                }
-            }
+static void uring_recibido(BucleUring *u, Conexion *c, int n) {
+    c->uring_recv = false;
+    if (c->cerrada || n <= 0) {
+        uring_cerrar(c);
+        uring_liberar_si_inactiva(c);
+        return;
+    }
+    if (c->enmarcado) c->ent_len += (size_t)n;
+    else c->in_len = (size_t)n;
+    if (conexion_atender(&u->bucle, c) < 0) uring_cerrar(c);
+    uring_avanzar(u, c);
+    uring_liberar_si_inactiva(c);
+}
+
+static void uring_enviado(BucleUring *u, Conexion *c, int n) {
+    c->uring_send = false;
+    if (c->cerrada || n < 0) {
+        uring_cerrar(c);
+        uring_liberar_si_inactiva(c);
+        return;
+    }
+    salida_consumir(c, (size_t)n);
+    if (!conexion_saturada(c) && conexion_atender(&u->bucle, c) < 0) uring_cerrar(c);
+    uring_avanzar(u, c);
+    uring_liberar_si_inactiva(c);
+}
+
+static void uring_terminadas(BucleUring *u) {
+    TareaComando *lista = tomar_terminadas(&u->bucle);
+    while (lista) {
+        TareaComando *t = lista;
+        lista = t->sig;
+        Conexion *c = t->c;
+        c->en_vuelo = false;
+        if (!c->cerrada && !conexion_encolar_resp(c, &t->resp)) uring_cerrar(c);
+        tarea_comando_liberar(t);
+        conexion_siguiente(c);
+        /* quedaban comandos en el anillo a la espera de que hubiera sitio */
+        if (!c->cerrada && conexion_atender(&u->bucle, c) < 0) uring_cerrar(c);
+        uring_avanzar(u, c);
+        uring_liberar_si_inactiva(c);
+    }
+    uring_armar_aviso(u);
+}
+
+/* Devuelve false si io_uring no está disponible y hay que usar otro modo */
+static bool ejecutar_uring(Shard *s, bool usar_pool) {
+    BucleUring *u = calloc(1, sizeof(*u));
+    if (!u) return false;
+    if (!anillo_abrir(&u->anillo, URING_ENTRADAS)) {
+        fprintf(stderr, "[SERVIDOR] io_uring no disponible (%s); se usa epoll.\n", strerror(errno));
+        free(u);
+        return false;
+    }
+    Bucle *b = &u->bucle;
+    b->shard = s;
+    b->server_socket = s->server_socket;
+    b->epfd = -1;
+    b->usar_pool = usar_pool;
+    pthread_mutex_init(&b->listas_mutex, NULL);
+    /* bloqueante a propósito: la lectura la resuelve el anillo, no el bucle */
+    b->evfd = eventfd(0, EFD_CLOEXEC);
+    if (b->evfd < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    uring_armar_aviso(u);       /* también sin pool: LOGIN vuelve del pool de autenticación */
+    for (int i = 0; i < URING_ACEPTAR_EN_VUELO; ++i) uring_aceptar(u);
+
+    Anillo *r = &u->anillo;
+    while (1) {
+        if (anillo_entregar(r, 1) < 0 && errno != EBUSY && errno != EAGAIN) {
+            perror("io_uring_enter");
+            break;
         }
-        else if (strncmp(buffer, "CHECKOUT:", 9) == 0) {
-            if (!logged_in) {
-                strcpy(response, "ERROR:LOGIN_REQUIRED\n");
-                goto send_reply;
-            }
-            const char* metodo = buffer + 9;
-            int write_idx = 0;
-            for (int i = 0; i < carrito_size; ++i) {
-                if (carrito[i] && carrito[i]->activo) {
-                    carrito[write_idx++] = carrito[i];
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+            unsigned tipo = (unsigned)(cqe->user_data & URING_TIPO);
+            Conexion *c = (Conexion *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_TIPO);
+            int res = cqe->res;
+            switch (tipo) {
+            case URING_ACEPTAR:
+                u->aceptando--;
+                if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM) {
+                    uring_pausar_aceptar(u, -res);
+                    break;
                 }
-            }
-            carrito_size = write_idx;
-            if (carrito_size == 0) {
-                strcpy(response, "ERROR:CART_EMPTY\n");
-                goto send_reply;
-            }
-            double total = 0.0;
-            for (int i = 0; i < carrito_size; ++i) total += carrito[i]->precio;
-            time_t now = time(NULL);
-            struct tm tmv;
-            localtime_r(&now, &tmv);
-            char fecha[32];
-            strftime(fecha, sizeof(fecha), "%Y-%m-%d %H:%M:%S", &tmv);
-            snprintf(response, sizeof(response), "OK|%s|%.2f\n", fecha, total);
-            for (int i = 0; i < carrito_size; ++i) {
-                char linebuf[1024];
-                snprintf(linebuf, sizeof(linebuf), "%s|%s|%s|%.2f|%s\n",
-                         carrito[i]->modelo,
-                         carrito[i]->marca,
-                         carrito[i]->specs,
-                         carrito[i]->precio,
-                         carrito[i]->imagen);
-                if (strlen(response) + strlen(linebuf) < sizeof(response)-1)
-                    strcat(response, linebuf);
-            }
-            carrito_size = 0;
-            (void)metodo;
-        }
-        else if (strncmp(buffer, "LOGIN:", 6) == 0) {
-            const char *payload = buffer + 6;
-            char copy[512];
-            strncpy(copy, payload, sizeof(copy) - 1);
-            copy[sizeof(copy) - 1] = '\0';
-            char *sep = strchr(copy, '|');
-            if (!sep) {
-                strcpy(response, "ERROR\n");
-            } else {
-                *sep = '\0';
-                const char *user = copy;
-                const char *pass = sep + 1;
-                Usuario *u = find_usuario(user);
-                if (u && strcmp(u->password, pass) == 0) {
-                    snprintf(response, sizeof(response), "OK|%s\n", u->role);
-                    logged_in = true;
-                    strncpy(current_user, u->username, sizeof(current_user) - 1);
-                    current_user[sizeof(current_user) - 1] = '\0';
-                    strncpy(current_role, u->role, sizeof(current_role) - 1);
-                    current_role[sizeof(current_role) - 1] = '\0';
-                } else {
-                    strcpy(response, "ERROR\n");
+                uring_aceptar(u);
+                if (res < 0) {
+                    if (res != -EINTR && res != -ECONNABORTED && res != -EAGAIN) {
+                        fprintf(stderr, "accept: %s\n", strerror(-res));
+                    }
+                    break;
                 }
-            }
-        }
-        else if (strncmp(buffer, "REGISTER:", 9) == 0) {
-            const char *payload = buffer + 9;
-            char copy[512];
-            strncpy(copy, payload, sizeof(copy) - 1);
-            copy[sizeof(copy) - 1] = '\0';
-            char *sep = strchr(copy, '|');
-            if (!sep) {
-                strcpy(response, "ERROR|Formato invalido\n");
-            } else {
-                *sep = '\0';
-                const char *user = copy;
-                const char *pass = sep + 1;
-                if (find_usuario(user)) {
-                    strcpy(response, "ERROR|Usuario existente\n");
-                } else if (strlen(user) < 3 || strlen(pass) < 4) {
-                    strcpy(response, "ERROR|Datos demasiado cortos\n");
-                } else if (strpbrk(user, "|\r\n") || strpbrk(pass, "|\r\n")) {
-                    strcpy(response, "ERROR|Caracteres invalidos\n");
-                } else if (!add_user(user, pass, "cliente", true)) {
-                    strcpy(response, "ERROR|No se pudo registrar\n");
-                } else {
-                    strcpy(response, "OK\n");
+                u->sin_descriptores = false;
+                c = conexion_nueva(res, s, ip_de(res));
+                if (!c) {
+                    close(res);
+                    break;
                 }
+                printf("[SERVIDOR] Cliente conectado FD=%d (shard %d)\n", res, s->id);
+                uring_avanzar(u, c);
+                break;
+            case URING_RECV:
+                uring_recibido(u, c, res);
+                break;
+            case URING_SEND:
+                uring_enviado(u, c, res);
+                break;
+            case URING_AVISO:
+                uring_terminadas(u);
+                break;
+            case URING_PAUSA:
+                uring_reanudar_aceptar(u);
+                break;
             }
         }
-        else if (strncmp(buffer, "REMOVE_PRODUCT:", 15) == 0) {
-            if (!logged_in || strcmp(current_role, "admin") != 0) {
-                strcpy(response, "ERROR|SIN_PERMISOS\n");
-            } else {
-                const char *modelo = buffer + 15;
-                Producto *p = find_model(modelo);
-                if (!p) {
-                    strcpy(response, "ERROR|NO_ENCONTRADO\n");
-                } else {
-                    p->activo = false;
-                    persist_inventory();
-                    strcpy(response, "OK\n");
-                }
-            }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    anillo_cerrar(r);
+    close(b->evfd);
+    resp_liberar(&b->resp);
+    free(u);
+    return true;
+}
+
+static void ejecutar_hilos(Shard *s) {
+    while (1) {
+        struct sockaddr_in caddr;
+        socklen_t clen = sizeof(caddr);
+        int client_fd = accept(s->server_socket, (struct sockaddr*)&caddr, &clen);
+        if (client_fd < 0) {
+            perror("accept");
+            continue;
         }
-        else if (strcmp(buffer, "GET_ALL_PRODUCTS") == 0) {
-            if (!logged_in || strcmp(current_role, "admin") != 0) {
-                strcpy(response, "ERROR|SIN_PERMISOS\n");
-            } else {
-                bool any = false;
-                for (int i = 0; i < inventario_size; ++i) {
-                    if (!inventario[i].activo) continue;
-                    any = true;
-                    char linebuf[1024];
-                    snprintf(linebuf, sizeof(linebuf), "%s|%s|%s|%.2f\n",
-                             inventario[i].marca,
-                             inventario[i].modelo,
-                             inventario[i].specs,
-                             inventario[i].precio);
-                    if (strlen(response) + strlen(linebuf) < sizeof(response)-1)
-                        strcat(response, linebuf);
-                }
-                if (!any) strcpy(response, "EMPTY\n");
-            }
+        Conexion *c = conexion_nueva(client_fd, s, caddr.sin_addr.s_addr);
+        if (!c) {
+            close(client_fd);
+            continue;
         }
-        else {
-            strcpy(response, "COMANDO_NO_VALIDO\n");
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, handle_client, c) == 0) {
+            pthread_detach(tid);
+        } else {
+            perror("pthread_create");
+            close(client_fd);
+            conexion_desconectada(c);
+            conexion_liberar(c);
         }
-
-send_reply:
-        send(sock, response, strlen(response), 0);
-        memset(buffer, 0, sizeof(buffer));
     }
-
-    close(sock);
-    printf("[SERVIDOR] Cliente desconectado FD=%d\n", sock);
-    return NULL;
 }
 
-int main() {
-    cargar_inventario(INVENTARIO_FILE);
-    cargar_usuarios(USUARIOS_FILE);
-    ensure_default_admin();
+/* ---------- Shards: un socket SO_REUSEPORT y un bucle por acceptor ---------- */
+
+static ModoServidor modo_servidor = MODO_HILOS;
+static bool usar_pool_global = false;
 
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+static int crear_socket_escucha(bool reuseport) {
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_socket < 0) {
         perror("socket");
         exit(EXIT_FAILURE);
     }
     int opt = 1;
     setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    /* el kernel reparte las conexiones entre los sockets del mismo puerto */
+    if (reuseport && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
     struct sockaddr_in addr = {0};
     addr.sin_family = AF_INET;
     addr.sin_port = htons(PORT);
@@ -562,43 +7161,176 @@ int main() {
         perror("bind");
         exit(EXIT_FAILURE);
     }
-    if (listen(server_socket, 8) < 0) {
+    if (listen(server_socket, SOMAXCONN) < 0) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
-    printf("[SERVIDOR] Escuchando en %d\n", PORT);
+    return server_socket;
+}
 
-    while (1) {
-        struct sockaddr_in caddr;
-        socklen_t clen = sizeof(caddr);
-        int client_fd = accept(server_socket, (struct sockaddr*)&caddr, &clen);
-        if (client_fd < 0) {
-            perror("accept");
-            continue;
-        }
-        int* fdptr = malloc(sizeof(int));
-        *fdptr = client_fd;
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_client, fdptr) == 0) {
-            pthread_detach(tid);
+static void *shard_main(void *arg) {
+    Shard *s = arg;
+    if (s->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(s->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) fprintf(stderr, "[SERVIDOR] shard %d: no se pudo fijar a CPU %d: %s\n", s->id, s->cpu, strerror(err));
+    }
+    if (modo_servidor == MODO_URING && ejecutar_uring(s, usar_pool_global)) return NULL;
+    if (modo_servidor == MODO_HILOS) ejecutar_hilos(s);
+    else ejecutar_epoll(s, usar_pool_global);
+    return NULL;
+}
+
+static void uso(const char *prog) {
+    fprintf(stderr, "Uso: %s [--modo hilos|epoll|uring] [--trabajadores N] [--shards N] [--fijar-cpu]\n"
+                    "       [--durabilidad estricta|diferida] [--espera-lote US]\n"
+                    "       [--hilos-auth N] [--cola-auth N] [--max-conexiones N]\n"
+                    "       [--conexiones-ip TASA[:RAFAGA]] [--comandos-ip TASA[:RAFAGA]]\n"
+                    "       %s --medir-escaneo [FILAS]\n", prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+    ModoServidor modo = MODO_HILOS;
+    bool fijar_cpu = false;
+    int trabajadores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (trabajadores < 1) trabajadores = 1;
+    /* la mitad de las CPU para el hash: el resto queda para los demás comandos */
+    int hilos_auth = trabajadores > 1 ? trabajadores / 2 : 1;
+    int cola_auth = AUTH_COLA;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--modo") == 0 && i + 1 < argc) {
+            const char *m = argv[++i];
+            if (strcmp(m, "hilos") == 0) modo = MODO_HILOS;
+            else if (strcmp(m, "epoll") == 0) modo = MODO_EPOLL;
+            else if (strcmp(m, "uring") == 0) modo = MODO_URING;
+            else { uso(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--trabajadores") == 0 && i + 1 < argc) {
+            /* 0: los comandos se ejecutan en el propio bucle epoll */
+            trabajadores = atoi(argv[++i]);
+            if (trabajadores < 0) { uso(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            num_shards = atoi(argv[++i]);
+            if (num_shards < 1) { uso(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--fijar-cpu") == 0) {
+            fijar_cpu = true;
+        } else if (strcmp(argv[i], "--durabilidad") == 0 && i + 1 < argc) {
+            const char *d = argv[++i];
+            if (strcmp(d, "estricta") == 0) wal.diferida = false;
+            else if (strcmp(d, "diferida") == 0) wal.diferida = true;
+            else { uso(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--espera-lote") == 0 && i + 1 < argc) {
+            /* microsegundos que el escritor del WAL junta registros antes de cada lote */
+            wal.espera_lote_us = atoi(argv[++i]);
+            if (wal.espera_lote_us < 0 || wal.espera_lote_us > 1000000) { uso(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--hilos-auth") == 0 && i + 1 < argc) {
+            hilos_auth = atoi(argv[++i]);
+            if (hilos_auth < 1) { uso(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--cola-auth") == 0 && i + 1 < argc) {
+            /* LOGIN/REGISTER en espera antes de responder ERROR|BUSY */
+            cola_auth = atoi(argv[++i]);
+            if (cola_auth < 1) { uso(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--max-conexiones") == 0 && i + 1 < argc) {
+            /* 0: sin tope */
+            admision.max_conexiones = atol(argv[++i]);
+            if (admision.max_conexiones < 0) { uso(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--conexiones-ip") == 0 && i + 1 < argc) {
+            /* conexiones nuevas por segundo y por IP */
+            if (!tasa_leer(argv[++i], &admision.conexiones_ip)) { uso(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--comandos-ip") == 0 && i + 1 < argc) {
+            if (!tasa_leer(argv[++i], &admision.comandos_ip)) { uso(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--medir-escaneo") == 0) {
+            /* mide los recorridos por columnas y termina, sin abrir el puerto */
+            int filas = i + 1 < argc ? atoi(argv[i + 1]) : 1000000;
+            if (filas < 1) { uso(argv[0]); return 1; }
+            return medir_escaneo(filas);
         } else {
-            perror("pthread_create");
-            close(client_fd);
-            free(fdptr);
+            uso(argv[0]);
+            return 1;
         }
     }
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_rwlockattr_t rwattr;
+    pthread_rwlockattr_init(&rwattr);
+    pthread_rwlockattr_setkind_np(&rwattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&datos_lock, &rwattr);
+    pthread_rwlockattr_destroy(&rwattr);
+
+    wal_abrir();
+    wal_iniciar_escritor();
+    inventario_firma = firma_archivo(INVENTARIO_FILE);
+    Almacen *alm;
+    bool snap_usuarios;
+    snapshot_cargar(&alm, &snap_usuarios);
+    if (!alm && !(alm = cargar_inventario(INVENTARIO_FILE))) exit(EXIT_FAILURE);
+    if (!snap_usuarios) cargar_usuarios(USUARIOS_FILE);
+    /* el snapshot refleja los CSV; lo que está en el WAL se aplica encima */
+    if (!snapshot_vigente()) snapshot_escribir(alm);
+    epocas_iniciar();
+    Inventario *inicial = inventario_version(alm, NULL, -1);
+    almacen_soltar(alm);
+    if (!inicial) {
+        perror("inventario");
+        exit(EXIT_FAILURE);
+    }
+    if (wal_reproducir(inicial) > 0) {
+        catalogo_liberar(inicial->catalogo);
+        inicial->catalogo = catalogo_construir(inicial);
+    }
+    ensure_default_admin();
+    auth_iniciar(hilos_auth, cola_auth);
+    pthread_t migrar;
+    if (pthread_create(&migrar, NULL, hilo_migrar_claves, NULL) == 0) pthread_detach(migrar);
+    inventario_publicar(inicial);
+    sesiones_iniciar();
+    sesiones_cargar(inicial);
+    sesiones_vigilar();
+    libro_iniciar();
+    pthread_t checkpoint;
+    if (pthread_create(&checkpoint, NULL, hilo_checkpoint, NULL) == 0) pthread_detach(checkpoint);
+    inventario_vigilar();
+    imagenes_dir = open(IMAGENES_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (imagenes_dir < 0) perror("[SERVIDOR] " IMAGENES_DIR " (GET_IMAGE no disponible)");
+
+    shards = calloc((size_t)num_shards, sizeof(*shards));
+    if (!shards) {
+        perror("shards");
+        exit(EXIT_FAILURE);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < num_shards; ++i) {
+        shards[i].id = i;
+        shards[i].server_socket = crear_socket_escucha(num_shards > 1);
+        shards[i].cpu = fijar_cpu ? (int)(i % (cpus > 0 ? cpus : 1)) : -1;
+    }
+    printf("[SERVIDOR] Escuchando en %d (modo %s, %d shard%s)\n", PORT,
+           modo == MODO_URING ? "uring" : modo == MODO_EPOLL ? "epoll" : "hilos",
+           num_shards, num_shards == 1 ? "" : "s");
 
-    close(server_socket);
-    for (int i = 0; i < inventario_size; ++i) {
-        free(inventario[i].marca);
-        free(inventario[i].modelo);
-        free(inventario[i].specs);
-        free(inventario[i].imagen);
+    modo_servidor = modo;
+    usar_pool_global = modo != MODO_HILOS && trabajadores > 0;
+    if (usar_pool_global) pool_iniciar(trabajadores);
+    for (int i = 1; i < num_shards; ++i) {
+        if (pthread_create(&shards[i].hilo, NULL, shard_main, &shards[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
     }
+    shard_main(&shards[0]);
+    for (int i = 1; i < num_shards; ++i) pthread_join(shards[i].hilo, NULL);
+
+    for (int i = 0; i < num_shards; ++i) close(shards[i].server_socket);
+    free(shards);
     for (int i = 0; i < usuarios_size; ++i) {
         free(usuarios[i].username);
         free(usuarios[i].password);
         free(usuarios[i].role);
     }
+    free(usuarios);
+    indice_liberar(&indice_usuarios);
+    imagenes_cerrar();
+    inventario_cerrar();
     return 0;
 }